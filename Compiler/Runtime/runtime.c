@@ -0,0 +1,38 @@
+/************************************************************************
+University of Leeds
+School of Computing
+COMP2932- Compiler Design and Construction
+The Native Runtime
+
+Entry point of the executables built from the assembly of the -native flag,
+which runs Main.main on the OS of os.c:
+    ./compiler -native Dir
+    gcc -O2 -o program code.s Runtime/runtime.c os.c
+    ./program [-screen file.pbm]
+Exits with 0 if the program ended normally.
+*************************************************************************/
+
+#include <string.h>
+#include <stdio.h>
+
+#include "../os.h"
+#include "../native.h"
+
+extern int16_t vmRam[VM_RAM_SIZE]; // from os.c
+extern int vmStatus; // from os.c
+
+int jack_run(int16_t *ram); // from code.s
+
+int main(int argc, char **argv) {
+    BootOS();
+    int reason = jack_run(vmRam);
+    if (reason == NATIVE_STACK_OVERFLOW) {
+        printf("VM error: stack overflow\n");
+        vmStatus = 0;
+    }
+    fflush(stdout);
+    if (argc > 2 && strcmp(argv[1], "-screen") == 0) {
+        SaveVMScreen(argv[2]);
+    }
+    return vmStatus && reason == NATIVE_HALT ? 0 : 1;
+}
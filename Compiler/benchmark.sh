@@ -0,0 +1,48 @@
+#!/bin/bash
+# Runs the sample projects on the built-in vm interpreter and as native executables (-native)
+# and compares their output, screen and run time. Run it from Compiler/ on x86-64 Linux:
+#     ./benchmark.sh [compiler]
+# The games never end, so runs stop after STEPS vm instructions or LIMIT seconds.
+
+COMPILER=${1:-./compiler}
+STEPS=${STEPS:-1000000000}
+LIMIT=${LIMIT:-5}
+INPUT="3\n1\n2\n3\n" # numbers for the programs reading the keyboard
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD" code.s' EXIT
+
+printf "%-44s %14s %9s %10s %8s  %s\n" project "vm instructions" "vm (s)" "native (s)" speedup output
+for dir in */ ../Programs/Jack\ Programs/Set\ */*/; do
+    dir=${dir%/}
+    [ -f "$dir/Main.jack" ] || continue
+    project=$dir
+
+    # interpreted -- the time is the one of the vm report, so compiling is not counted
+    report=$(printf "$INPUT" | "$COMPILER" -O2 -run -stats -steps $STEPS "$project" | grep "^vm:.*million per second")
+    printf "$INPUT" | "$COMPILER" -O2 -run -steps $STEPS -screen "$BUILD/vm.pbm" "$project" > "$BUILD/vm.txt"
+    instructions=$(echo "$report" | awk '{print $2}')
+    vmSeconds=$(echo "$report" | awk '{print $5}')
+
+    # native
+    rm -f code.s
+    "$COMPILER" -O2 -native "$project" > /dev/null
+    if [ ! -f code.s ] || ! gcc -O2 -o "$BUILD/program" code.s Runtime/runtime.c os.c; then
+        printf "%-44s could not be built\n" "$dir"
+        continue
+    fi
+    start=$(date +%s%N)
+    printf "$INPUT" | timeout $LIMIT "$BUILD/program" -screen "$BUILD/native.pbm" > "$BUILD/native.txt"
+    status=$?
+    nativeSeconds=$(awk -v ns=$(( $(date +%s%N) - start )) 'BEGIN {printf "%.3f", ns / 1e9}')
+
+    speedup=$(awk -v vm="$vmSeconds" -v native="$nativeSeconds" 'BEGIN {if (vm >= 0.01 && native > 0) printf "%.1fx", vm / native; else printf "-"}')
+    if echo "$report" | grep -q "step limit" || [ $status -eq 124 ]; then
+        output="no end, not compared"
+        speedup="-"
+    elif cmp -s "$BUILD/vm.txt" "$BUILD/native.txt" && cmp -s "$BUILD/vm.pbm" "$BUILD/native.pbm"; then
+        output="same"
+    else
+        output="DIFFERENT"
+    fi
+    printf "%-44s %14s %9s %10s %8s  %s\n" "$dir" "$instructions" "$vmSeconds" "$nativeSeconds" "$speedup" "$output"
+done
@@ -17,18 +17,105 @@ Date Work Commenced: 19.03.2021
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "compiler.h"
+#include "optimiser.h"
+#include "vm.h"
+#include "jit.h"
+#include "native.h"
+#include "hack.h"
+#include "daemon.h"
+#include "manifest.h"
+#include "watch.h"
 
 /** Global variables for compilation process **/
-char files[512][128]; // holds all .jack filenames in current directory
+char files[512][128]; // holds all .jack filenames in the project directory, sorted
 int filesCounter; // indexing for files[]
 int globalPass = 1;
 int standardPass = 0;
+int emitStandardLibs = 0; // 1 if VM code is generated for the standard libraries as well (-stdlib)
+int optimisationLevel = 1; // -O0 / -O1 / -O2, picks the passes of the optimisation pipeline (passes[] in optimiser.c)
+int passReport = 0; // 1 if the statistics of every pass are printed after compiling (-stats)
+int runProgram = 0; // 1 if the program is run on the built-in vm after compiling (-run)
+long maxSteps = 0; // the run stops after this many vm instructions, 0 for no limit (-steps n)
+char *screenFile = NULL; // the screen is saved to this pbm image after the run (-screen file)
+int useJit = 0; // 1 if the program is compiled to x86-64 machine code and run natively (-jit)
+int nativeOutput = 0; // 1 if the program is also written as x86-64 assembly to ./code.s (-native)
+int hackOutput = 0; // 1 if the program is also translated to hack assembly in ./code.asm (-hack)
+int bytecodeOutput = 0; // 1 if the program is also saved as vm bytecode to ./code.vmb (-bytecode)
+char *bytecodeFile = NULL; // the program is loaded from this bytecode file instead of being compiled (-load file)
+int profileProgram = 0; // 1 if the run counts calls and instructions per subroutine (-profile)
+char *foldedFile = NULL; // the call stacks of the profile are saved here for flame graphs (-folded file)
+int compileThreads = 0; // files compiled at once, 0 for one thread per core (-j n)
+int incrementalBuild = 0; // 1 if the files unchanged since the last build are not compiled again (-incremental)
+char *projectDirectory = "Average"; // the directory of the .jack files compiled
+char *outputDirectory = NULL; // the vm code is written as a Class.vm file per class here instead of ./code.vm (-o dir)
+int printCode = 0; // 1 if the vm code is printed to stdout as well (-print)
+char *libraryDirectory = "."; // the standard library .jack files are read from here
+int standardLibsLoaded = 0; // 1 while the symbol tables of the standard libraries are kept (pass 0 done)
+FILE *outputList = NULL; // the files written are listed here as "output path" lines, if set (by the daemon)
 
-extern int counter; // from parser.c
-extern SymbolTable tables[512]; // from parser.c
+SourceFile sourceFiles[512]; // parallel to files[]
+int nextSourceFile; // next file to be taken by a compiling thread
+int sourceFileFailed; // 1 once a file has an error in the current pass, so no more files are started
+pthread_mutex_t sourceFileLock = PTHREAD_MUTEX_INITIALIZER;
+
+#define OUTPUT_WRITE_PARTS 1024 // parts of the code written by one writev (IOV_MAX on linux)
+
+// a class of the program, written to its own .vm file (-o dir)
+typedef struct {
+	char name[128];
+	char path[PATH_MAX]; // outputDirectory/Class.vm
+	struct iovec *parts; // where its subroutines are in the vm code, adjacent ones joined -- written at once with writev
+	int partCount;
+	int written; // 1 once the file is written whole
+} ClassOutput;
+
+ClassOutput *classOutputs;
+int classOutputCount;
+int nextClassOutput; // next file to be taken by a writing thread
+pthread_mutex_t classOutputLock = PTHREAD_MUTEX_INITIALIZER;
+
+extern int programTableCount; // from parser.c
+extern SymbolTable programTables[MAX_SYMBOL_TABLES]; // from parser.c
 extern char vmCode[1024]; // from parser.c
+extern char pooledClasses[512][128]; // from parser.c
+extern int pooledClassesCount; // from parser.c
+
+// adds calls to the Class.$strings initialisers (pooled string literals) at the start of Main.main, or of Sys.init
+// in a program without Main.main
+int callStringInitialisers(char *code) {
+	char *entry = strstr(code, "function Main.main ");
+	if (entry == NULL) {
+		entry = strstr(code, "function Sys.init ");
+	}
+	if (pooledClassesCount == 0 || entry == NULL) {
+		return 0;
+	}
+	char *body = strchr(entry, '\n') + 1;
+
+	char *calls = malloc(pooledClassesCount * 160 + 1);
+	strcpy(calls, "");
+	for (int i = 0; i < pooledClassesCount; ++i) {
+		char callCommand[160];
+		sprintf(callCommand, " call %s.$strings 0\n pop temp 0\n", pooledClasses[i]);
+		strcat(calls, callCommand);
+	}
+
+	int callsLength = strlen(calls);
+	memmove(body + callsLength, body, strlen(body) + 1);
+	memcpy(body, calls, callsLength);
+	free(calls);
+	return pooledClassesCount;
+}
 
 int outputVM(char *filename, char *code) {
   FILE *fp = fopen(filename, "wb");
@@ -41,47 +128,266 @@ int outputVM(char *filename, char *code) {
   return 1;
 }
 
+// lists a file written by the compiler on outputList
+void listOutput(char *filename) {
+	if (outputList == NULL) {
+		return;
+	}
+	char path[PATH_MAX];
+	fprintf(outputList, "output %s\n", realpath(filename, path) ? path : filename);
+	fflush(outputList);
+}
+
+void *writeClassOutputsThread(void *unused) {
+	for (;;) {
+		pthread_mutex_lock(&classOutputLock);
+		int i = nextClassOutput++;
+		pthread_mutex_unlock(&classOutputLock);
+		if (i >= classOutputCount) {
+			return NULL;
+		}
+		ClassOutput *output = &classOutputs[i];
+		int fd = open(output->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			continue;
+		}
+		ssize_t length = 0, written = 0;
+		for (int j = 0; j < output->partCount; j += OUTPUT_WRITE_PARTS) {
+			int parts = output->partCount - j < OUTPUT_WRITE_PARTS ? output->partCount - j : OUTPUT_WRITE_PARTS;
+			for (int k = j; k < j + parts; ++k) {
+				length += output->parts[k].iov_len;
+			}
+			written += writev(fd, output->parts + j, parts);
+		}
+		output->written = close(fd) == 0 && written == length;
+	}
+}
+
+// writes the code as one .vm file per class in the directory (the standard layout), the files on up to
+// compileThreads threads -- returns 0 (after printing why) if a file could not be written
+int outputClasses(char *directory, char *code) {
+	if (mkdir(directory, 0777) != 0 && errno != EEXIST) {
+		printf("Could not create the output directory %s.\n", directory);
+		return 0;
+	}
+	VMFunction *functions = malloc(MAX_VM_FUNCTIONS * sizeof(VMFunction));
+	int count = SplitVMFunctions(code, functions);
+	classOutputs = calloc(count + 1, sizeof(ClassOutput));
+	classOutputCount = 0;
+	ClassOutput *output = NULL;
+	for (int i = 0; i < count; ++i) {
+		char *start = i == 0 ? code : functions[i].start; // with anything before the first subroutine
+		int length = functions[i].start + functions[i].length - start;
+		char name[128];
+		snprintf(name, sizeof name, "%.*s", (int)strcspn(functions[i].name, "."), functions[i].name);
+		for (int j = 0; (output == NULL || strcmp(output->name, name) != 0) && j < classOutputCount; ++j) { // mostly the class of the previous one
+			output = &classOutputs[j];
+		}
+		if (output == NULL || strcmp(output->name, name) != 0) {
+			output = &classOutputs[classOutputCount++];
+			strcpy(output->name, name);
+			if ((size_t)snprintf(output->path, sizeof output->path, "%s/%s.vm", directory, name) >= sizeof output->path) {
+				printf("Path too long: %s/%s.vm\n", directory, name);
+				exit(-1);
+			}
+			output->parts = malloc((count - i) * sizeof(struct iovec));
+		}
+		struct iovec *last = output->partCount ? &output->parts[output->partCount - 1] : NULL;
+		if (last && (char *)last->iov_base + last->iov_len == start) {
+			last->iov_len += length;
+		}
+		else {
+			output->parts[output->partCount].iov_base = start;
+			output->parts[output->partCount].iov_len = length;
+			output->partCount++;
+		}
+	}
+	free(functions);
+
+	int threads = compileThreads > 0 ? compileThreads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > classOutputCount) {
+		threads = classOutputCount;
+	}
+	nextClassOutput = 0;
+	pthread_t workers[threads > 1 ? threads : 1];
+	int started = 0;
+	for (int i = 1; i < threads; ++i) {
+		if (pthread_create(&workers[started], NULL, writeClassOutputsThread, NULL) == 0) {
+			started++;
+		}
+	}
+	writeClassOutputsThread(NULL);
+	for (int i = 0; i < started; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+
+	int status = 1;
+	for (int i = 0; i < classOutputCount; ++i) {
+		if (classOutputs[i].written) {
+			listOutput(classOutputs[i].path);
+		}
+		else if (status) {
+			printf("Could not write the vm file %s.\n", classOutputs[i].path);
+			status = 0;
+		}
+		free(classOutputs[i].parts);
+	}
+	free(classOutputs);
+	return status;
+}
+
+int compareFileNames(const void *a, const void *b) {
+	return strcmp(a, b);
+}
+
+// lists the .jack files of the directory into files[], sorted by name -- returns 0 (after printing why) if it cannot
+int listSourceFiles(char *dir_name) {
+	DIR *dir = opendir(dir_name);
+	if (dir == NULL) {
+		printf("Could not open the directory %s.\n", dir_name);
+		return 0;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		char *name = entry->d_name;
+		size_t length = strlen(name);
+		if (name[0] == '.' || length <= 5 || strcmp(name + length - 5, ".jack") != 0 || entry->d_type == DT_DIR) {
+			continue;
+		}
+		if (filesCounter == (int)(sizeof files / sizeof files[0]) || length >= sizeof files[0]) {
+			printf("Too many .jack files or too long a file name in %s.\n", dir_name);
+			closedir(dir);
+			return 0;
+		}
+		strcpy(files[filesCounter], name);
+		filesCounter += 1;
+	}
+	closedir(dir);
+	qsort(files, filesCounter, sizeof files[0], compareFileNames);
+	return 1;
+}
+
 int InitCompiler ()
 {	
 	filesCounter = 0;
 	globalPass = 1;
-	extern int counter;
-	extern SymbolTable tables[512]; // from parser.c
 	return 1;
 }
 
-ParserInfo compile (char* dir_name)
-{
-	ParserInfo p;
+// runs the current pass (globalPass) on one file, with the file's own parser context
+void compileSourceFile(SourceFile *file) {
+	UseParserContext(&file->context);
+	InitParser(file->path); // init parser for file
+	file->result = Parse(); // parse file
+	StopParser();
+	UseParserContext(NULL);
+}
 
-	// get all .jack files in given directory by executing unix command
-	// redirect output to a textfile : output.txt in same directory as compiler.c
-	char command[64];
-	sprintf(command, "cd %s && ls | grep '\\.jack$' > ../output.txt", dir_name);
-	system(command);
+void *compileSourceFilesThread(void *worker) {
+	for (;;) {
+		pthread_mutex_lock(&sourceFileLock);
+		int i = sourceFileFailed ? filesCounter : nextSourceFile++;
+		pthread_mutex_unlock(&sourceFileLock);
+		if (i >= filesCounter) {
+			if (worker) {
+				FreeParserBuffers();
+				FreeOptimiserBuffers();
+			}
+			return NULL;
+		}
+		if (globalPass > sourceFiles[i].reused) {
+			compileSourceFile(&sourceFiles[i]);
+		}
+		if (sourceFiles[i].result.er != none) {
+			pthread_mutex_lock(&sourceFileLock);
+			sourceFileFailed = 1;
+			pthread_mutex_unlock(&sourceFileLock);
+		}
+	}
+}
 
-	// open file and read all filenames line by line
-	FILE *fp;
-	char fileName[256]; // acts as buffer for fgets
+// runs the current pass on all the files, on up to compileThreads threads taking the files in order (the calling
+// thread included) -- returns the index of the first file with an error, -1 if there is none
+int compileSourceFiles() {
+	int threads = compileThreads > 0 ? compileThreads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > filesCounter) {
+		threads = filesCounter;
+	}
+	for (int i = 0; i < filesCounter; ++i) {
+		sourceFiles[i].result.er = none;
+	}
+	nextSourceFile = 0;
+	sourceFileFailed = 0;
 
-	fp = fopen("output.txt", "r");
-	if (fp == NULL) {
-		printf("Could not get all .jack files in current directory. :(\n");
-		exit(-1);
+	static int worker = 1; // the argument of the other threads, which free their buffers when done
+	pthread_t workers[threads > 1 ? threads : 1];
+	int started = 0;
+	for (int i = 1; i < threads; ++i) {
+		if (pthread_create(&workers[started], NULL, compileSourceFilesThread, &worker) == 0) {
+			started++;
+		}
+	}
+	compileSourceFilesThread(NULL); // the calling thread keeps its buffers
+	for (int i = 0; i < started; ++i) {
+		pthread_join(workers[i], NULL);
 	}
 
-	// read filenames line by line and add them to the global array
-	while(fgets(fileName, 512, fp)) {
-		strcpy(files[filesCounter], fileName);
-		filesCounter += 1;
+	for (int i = 0; i < filesCounter; ++i) {
+		if (sourceFiles[i].result.er != none) {
+			return i;
+		}
 	}
-	fclose(fp);
+	return -1;
+}
 
-	// PARSING PASS 0 - JACK LIBRARIES
-	standardPass = 0; // CHANGE THIS TO 1 TO GENERATE VM CODE FOR STD LIBS AS WELL
-	char standardLibsPaths[8][16] = {"./Array.jack\0", "./Keyboard.jack\0", "./Math.jack\0", "./Memory.jack\0", "./Output.jack\0", "./Screen.jack\0", "./String.jack\0", "./Sys.jack\0"};
+// the static words the pooled string literals may take -- none unless a file of the program has a Main.main or a
+// Sys.init to call their initialisers (callStringInitialisers)
+int StringStaticWords() {
+	for (int i = 0; i < filesCounter; ++i) {
+		ParserContext *context = &sourceFiles[i].context;
+		for (int j = 1; j <= context->tableCount; ++j) {
+			SymbolTable *table = &context->tables[j];
+			if ((strcmp(table->parentClass, "Main") == 0 && strcmp(table->functionName, "main") == 0)
+				|| (strcmp(table->parentClass, "Sys") == 0 && strcmp(table->functionName, "init") == 0)) {
+				return FreeStaticWords();
+			}
+		}
+	}
+	return 0;
+}
+
+// the statics the declared ones leave are shared out to the literals the classes pool (-fstrings), in file order so
+// the code does not depend on the threads -- the files kept from the last build (-incremental) keep theirs
+void shareStringStatics() {
+	int words = StringStaticWords();
+	for (int i = 0; i < filesCounter; ++i) {
+		if (sourceFiles[i].reused == 3) {
+			words -= sourceFiles[i].context.pooledStrings;
+		}
+	}
+	for (int i = 0; i < filesCounter; ++i) {
+		ParserContext *context = &sourceFiles[i].context;
+		if (sourceFiles[i].reused < 3) {
+			context->stringBudget = context->stringLiterals < words ? context->stringLiterals : words;
+			words -= context->stringBudget;
+		}
+	}
+}
+
+// PARSING PASS 0 - JACK LIBRARIES -- their symbol tables are kept until StopCompiler, so a resident compiler
+// (the daemon) parses them once
+ParserInfo LoadStandardLibs()
+{
+	ParserInfo p;
+	standardPass = emitStandardLibs; // generate VM code for std libs as well if requested
+	char standardLibs[8][16] = {"Array.jack", "Keyboard.jack", "Math.jack", "Memory.jack", "Output.jack", "Screen.jack", "String.jack", "Sys.jack"};
 	for (int i = 0; i < 8; ++i) {
-		InitParser(standardLibsPaths[i]);
+		char path[PATH_MAX];
+		snprintf(path, sizeof path, "%s/%s", libraryDirectory, standardLibs[i]);
+		if (!InitParser(path)) {
+			printf("Could not open the standard library file %s.\n", path);
+			exit(-1);
+		}
 		ParserInfo sourceParseInfo = Parse(); // parse file
 		if (sourceParseInfo.er != none) { // report on errors if any and exit if errors found
 			p.er = sourceParseInfo.er;
@@ -92,40 +398,128 @@ ParserInfo compile (char* dir_name)
 		StopParser();
 	}
 	standardPass = 0;
+	standardLibsLoaded = 1;
+	p.er = none;
+	return p;
+}
+
+ParserInfo compile (char* dir_name)
+{
+	ParserInfo p;
+
+	// the standard libraries are parsed again if their code is needed (-stdlib), the kept ones have none
+	if (standardLibsLoaded && emitStandardLibs) {
+		StopCompiler();
+	}
+	if (!standardLibsLoaded) {
+		p = LoadStandardLibs();
+		if (p.er != none) {
+			return p;
+		}
+	}
+
+	// get all .jack files in given directory
+	if (!listSourceFiles(dir_name)) {
+		exit(-1);
+	}
 
-	// parse all .jack source files 
+	// build complete paths : dir_name/...
+	for (int i = 0; i < filesCounter; ++i) {
+		if ((size_t)snprintf(sourceFiles[i].path, sizeof sourceFiles[i].path, "%s/%s", dir_name, files[i]) >= sizeof sourceFiles[i].path) {
+			printf("Path too long: %s/%s\n", dir_name, files[i]);
+			exit(-1);
+		}
+		sourceFiles[i].reused = 0;
+	}
+
+	// the files unchanged since the last build keep their tables and code (-incremental, or built by the daemon) --
+	// the manifest is kept with the per-class output (-o), or else with the project, the daemon keeps it in memory
+	char *manifestDirectory = outputDirectory ? outputDirectory : dir_name;
+	char manifestPath[PATH_MAX];
+	snprintf(manifestPath, sizeof manifestPath, "%s/code.manifest", manifestDirectory);
+	int reuseFiles = incrementalBuild || DaemonRequest();
+	if (reuseFiles) {
+		FILE *manifest = DaemonRequest() ? KeptBuildManifest(manifestDirectory) : NULL;
+		if (manifest == NULL && incrementalBuild) {
+			manifest = fopen(manifestPath, "rb");
+		}
+		LoadBuildManifest(manifest, sourceFiles, filesCounter);
+	}
+
+	// parse all .jack source files -- the files of a pass are compiled in parallel (-j)
 	const int PASSES = 3;
-	// pass 1 : gather symbols <- starts here on PASS = 1!
+	// pass 1 : gather symbols <- starts here on PASS = 1! (into tables of each file, merged in file order)
 	// pass 2 : semantic analysis
-	// pass 3 : code gen
+	// pass 3 : code gen (into code of each file, joined in file order)
 	for (int j = 1; j <= PASSES; ++j) { globalPass = j;
 
-		for (int i = 0; i < filesCounter; ++i) {
-
-		// build complete path : ./dir_name/...
-		char completePathToSource[512];
-		strcpy(completePathToSource, "./");
-		strcat(completePathToSource, dir_name);
-		strcat(completePathToSource, "/");
-		strncat(completePathToSource, files[i], strlen(files[i]) - 1);
-
-		InitParser(completePathToSource); // init parser for file
-		ParserInfo sourceParseInfo = Parse(); // parse file
-		if (sourceParseInfo.er != none) { // report on errors if any and exit if errors found
-			p.er = sourceParseInfo.er;
-			p.tk = sourceParseInfo.tk;
-			StopParser();
+		int failed = compileSourceFiles();
+		if (failed >= 0) { // report on errors if any and exit if errors found
+			p.er = sourceFiles[failed].result.er;
+			p.tk = sourceFiles[failed].result.tk;
 			return p;
 		}
-		StopParser();
 
+		if (globalPass == 1) {
+			for (int i = 0; i < filesCounter; ++i) {
+				if (!MergeSymbolTables(&sourceFiles[i].context)) {
+					printf("Too many classes and subroutines (more than %d symbol tables).\n", MAX_SYMBOL_TABLES);
+					exit(-1);
+				}
+			}
+			if (reuseFiles) { // with all the tables, the interfaces of the classes can be compared
+				CheckBuildDependencies(sourceFiles, filesCounter);
+			}
 		}
+		else if (globalPass == 2) {
+			shareStringStatics();
+		}
+
+	}
 
+	size_t codeLength = strlen(vmCode);
+	for (int i = 0; i < filesCounter; ++i) {
+		ParserContext *context = &sourceFiles[i].context;
+		memcpy(vmCode + codeLength, context->code, context->codeLength);
+		codeLength += context->codeLength;
+		if (strlen(context->pooledClass)) {
+			strcpy(pooledClasses[pooledClassesCount], context->pooledClass);
+			pooledClassesCount++;
+		}
 	}
+	vmCode[codeLength] = '\0';
 
-	// output VM file
-	int status = outputVM("./code.vm\0", vmCode);
-	printf("%s", vmCode); // testing purposes
+	// pooled string literals have to be built before the program runs
+	callStringInitialisers(vmCode);
+
+	// whole program passes -- constant statics, inlining, then linking (dropping the subroutines which
+	// cannot be reached from Main.main / Sys.init)
+	RunProgramPasses(vmCode);
+
+	// output VM file(s)
+	int status;
+	if (outputDirectory) {
+		status = outputClasses(outputDirectory, vmCode);
+	}
+	else {
+		status = outputVM("./code.vm\0", vmCode);
+		listOutput("./code.vm");
+	}
+	if (DaemonRequest()) {
+		KeepBuildManifest(manifestDirectory, sourceFiles, filesCounter);
+	}
+	if (incrementalBuild && SaveBuildManifest(manifestPath, sourceFiles, filesCounter)) {
+		listOutput(manifestPath);
+	}
+	if (printCode) {
+		fwrite(vmCode, 1, strlen(vmCode), stdout); // testing purposes
+	}
+	if (passReport) {
+		PrintPassReport();
+		if (reuseFiles) {
+			PrintManifestReport();
+		}
+	}
 	if (status < 1) {
 		exit(-1);
 	}
@@ -140,28 +534,198 @@ int StopCompiler ()
 	// set all filenames characters to NULL
 	for (int i = 0; i < filesCounter; ++i) {
 		memset(files[i], 0, sizeof files[i]);
+		FreeParserContext(&sourceFiles[i].context);
 	}
-	for (int i = 0; i < counter; ++i) {
-		FreeTable(tables[i]);
+	for (int i = 0; i < programTableCount; ++i) {
+		FreeTable(programTables[i]);
 	}
 
-	memset(tables, 0, sizeof tables);
+	memset(programTables, 0, programTableCount * sizeof programTables[0]); // the rest were never used
 
 	filesCounter = 0;
 	globalPass = 1;
-	counter = 0;
+	programTableCount = 0;
+	UseParserContext(NULL);
 	standardPass = 0;
+	standardLibsLoaded = 0;
+	pooledClassesCount = 0;
+	ResetPassStatistics();
 	return 1;
 }
 
 
-#ifndef TEST_COMPILER
-int main ()
+int ParseCompilerOptions (int argc, char **argv)
 {
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-stdlib") == 0) {
+			emitStandardLibs = 1;
+		}
+		else if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0 || strcmp(argv[i], "-O2") == 0) {
+			optimisationLevel = argv[i][2] - '0';
+		}
+		else if (strcmp(argv[i], "-profile") == 0) {
+			runProgram = 1;
+			profileProgram = 1;
+		}
+		else if (strcmp(argv[i], "-folded") == 0 && i + 1 < argc) {
+			runProgram = 1;
+			profileProgram = 1;
+			foldedFile = argv[++i];
+		}
+		else if (strncmp(argv[i], "-fno-", 5) == 0 || strncmp(argv[i], "-f", 2) == 0) {
+			int enable = strncmp(argv[i], "-fno-", 5) != 0;
+			char *pass = argv[i] + (enable ? 2 : 5);
+			if (!SetPassEnabled(pass, enable)) {
+				printf("Unknown optimisation pass: %s\n", pass);
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "-tailcalls") == 0) {
+			SetPassEnabled("tailcalls", 1);
+		}
+		else if (strcmp(argv[i], "-stats") == 0) {
+			passReport = 1;
+		}
+		else if (strcmp(argv[i], "-run") == 0) {
+			runProgram = 1;
+		}
+		else if (strcmp(argv[i], "-jit") == 0) {
+			runProgram = 1;
+			useJit = 1;
+		}
+		else if (strcmp(argv[i], "-native") == 0) {
+			nativeOutput = 1;
+		}
+		else if (strcmp(argv[i], "-hack") == 0) {
+			hackOutput = 1;
+		}
+		else if (strcmp(argv[i], "-bytecode") == 0) {
+			bytecodeOutput = 1;
+		}
+		else if (strcmp(argv[i], "-load") == 0 && i + 1 < argc) {
+			bytecodeFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			outputDirectory = argv[++i];
+		}
+		else if (strcmp(argv[i], "-print") == 0) {
+			printCode = 1;
+		}
+		else if (strcmp(argv[i], "-incremental") == 0) {
+			incrementalBuild = 1;
+		}
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			compileThreads = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-steps") == 0 && i + 1 < argc) {
+			maxSteps = atol(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-screen") == 0 && i + 1 < argc) {
+			screenFile = argv[++i];
+		}
+		else {
+			projectDirectory = argv[i];
+		}
+	}
+
+	if (bytecodeFile && !nativeOutput) {
+		runProgram = 1; // a loaded program is there to be run
+	}
+	return 1;
+}
+
+int BuildProgram ()
+{
+	int built = 0; // 1 once the program compiled (or loaded)
 	InitCompiler ();
-	ParserInfo p = compile ("Average");
-	// PrintError (p);
+	int loaded = 0; // 1 once the program is in the vm
+	if (bytecodeFile) {
+		loaded = LoadVMBytecode(bytecodeFile);
+		built = loaded;
+	}
+	else {
+		ParserInfo p = compile (projectDirectory);
+		built = p.er == none;
+		// PrintError (p);
+		if (hackOutput && p.er == none && OutputHackProgram(vmCode, "./code.asm")) {
+			listOutput("./code.asm");
+			if (passReport) {
+				PrintHackReport();
+			}
+		}
+		if (p.er == none && (runProgram || nativeOutput || bytecodeOutput)) {
+			loaded = LoadVMProgram(vmCode);
+			built = loaded;
+		}
+		if (loaded && bytecodeOutput && SaveVMBytecode("./code.vmb")) {
+			listOutput("./code.vmb");
+		}
+	}
+	if (loaded && nativeOutput) {
+		if (OutputNativeProgram("./code.s")) {
+			listOutput("./code.s");
+		}
+		if (passReport) {
+			PrintNativeReport();
+		}
+	}
+	if (loaded && runProgram) {
+		if (useJit && !profileProgram) {
+			RunJitProgram(maxSteps);
+		}
+		else {
+			RunVMProgram(maxSteps, profileProgram);
+		}
+		if (screenFile && SaveVMScreen(screenFile)) {
+			listOutput(screenFile);
+		}
+		if (passReport) {
+			PrintVMReport();
+			if (useJit && !profileProgram) {
+				PrintJitReport();
+			}
+		}
+		if (profileProgram) {
+			PrintVMProfile();
+		}
+		if (foldedFile && SaveVMFoldedStacks(foldedFile)) {
+			listOutput(foldedFile);
+		}
+	}
+	StopVM();
 	StopCompiler ();
-	return 1;
+	return built;
+}
+
+int RunCompiler (int argc, char **argv)
+{
+	if (!ParseCompilerOptions(argc, argv)) {
+		return 1;
+	}
+	return BuildProgram() ? 0 : 1;
+}
+
+
+#ifndef TEST_COMPILER
+int main (int argc, char **argv)
+{
+	// usage: compiler [-stdlib] [-O0 | -O1 | -O2] [-f<pass> | -fno-<pass>]... [-tailcalls] [-stats]
+	//                 [-run | -jit | -profile [-folded file]] [-steps n] [-screen file] [-native] [-hack] [-bytecode]
+	//                 [-j n] [-incremental] [-o dir] [-print] [directory | -load file]
+	//        compiler -daemon socket (run from the directory of the standard libraries)
+	//        compiler -connect socket [options] [directory | -load file] (compiled by the daemon)
+	//        compiler -watch [options] directory (compiled again whenever its .jack files change)
+	// -O2 pools string literals (-fstrings): every evaluation of a literal gives the same String, so a program changing or
+	// disposing of one needs -fno-strings (see MutableStrings)
+	if (argc == 3 && strcmp(argv[1], "-daemon") == 0) {
+		return RunDaemon(argv[2]);
+	}
+	if (argc >= 3 && strcmp(argv[1], "-connect") == 0) {
+		return RunDaemonClient(argv[2], argc - 2, argv + 2); // the options follow the socket, in place of argv[0]
+	}
+	if (argc >= 2 && strcmp(argv[1], "-watch") == 0) {
+		return RunWatch(argc - 1, argv + 1);
+	}
+	return RunCompiler(argc, argv);
 }
 #endif
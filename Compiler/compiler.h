@@ -3,13 +3,29 @@
 
 //#define TEST_COMPILER    // uncomment to run the compiler autograder
 
+#include <limits.h>
+
 #include "parser.h"
 #include "symbols.h"
 
+// a source file of the program, with what the parser keeps of it between passes
+typedef struct {
+	char path[PATH_MAX]; // dir_name/File.jack
+	ParserContext context;
+	ParserInfo result; // of the last pass run on the file
+	unsigned long contentHash; // of the source (-incremental)
+	int reused; // passes 1 .. reused are not run, what they give is in the build manifest (0, 1 or 3)
+} SourceFile;
+
 int outputVM(char *filename, char *code); // outputs the code to the output .vm file
 
 int InitCompiler ();
+ParserInfo LoadStandardLibs(); // parses the standard libraries (pass 0), their symbol tables are kept until StopCompiler
 ParserInfo compile (char* dir_name);
 int StopCompiler();
+int StringStaticWords(); // after pass 1: the static words left for pooled string literals (-fstrings)
+int ParseCompilerOptions (int argc, char **argv); // sets the options of the command line (argv[0] is not read), returns 0 (after printing why) if one is wrong
+int BuildProgram (); // compiles (and runs) the program as the options say, returns 1 if it compiled (and loaded) without errors
+int RunCompiler (int argc, char **argv); // compiles (and runs) as the command line asks, argv[0] is not read -- returns the exit status
 
 #endif
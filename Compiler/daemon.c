@@ -0,0 +1,393 @@
+/************************************************************************
+University of Leeds
+School of Computing
+COMP2932- Compiler Design and Construction
+The Daemon Module
+
+Keeps the compiler resident on a unix domain socket with the standard
+libraries parsed (pass 0), for tools running many small compiles:
+    compiler -daemon /tmp/jack.sock     (from the directory of the libraries)
+    compiler -connect /tmp/jack.sock -O2 Pong
+A request is the command line of the client, sent with the client's
+standard input, output and error and its working directory (SCM_RIGHTS),
+so the diagnostics and what a -run prints reach the client directly and
+relative paths are the client's. Every request is compiled in a process
+forked from the daemon, so whatever the compile does (exiting on an error
+included) the daemon stays as it was after pass 0. The answer is a line
+"output path" for every file written and a last line "status n" (none if
+the compile crashed).
+The daemon also keeps in memory the build manifest (see manifest.c) of
+every project it built, so a request only parses the files changed since
+the last build of its project, -incremental or not. The forked process
+finds the manifests as they were when its request was accepted and sends
+the one of its build back on a pipe, read by the daemon between accepting
+connections.
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "compiler.h"
+#include "daemon.h"
+#include "manifest.h"
+
+extern char *libraryDirectory; // from compiler.c
+extern FILE *outputList; // from compiler.c
+
+// the descriptors passed with a request, in order
+enum {DAEMON_STDIN, DAEMON_STDOUT, DAEMON_STDERR, DAEMON_DIRECTORY, DAEMON_DESCRIPTORS};
+
+// the build manifest of a project, as the last request building it sent it
+typedef struct {
+	char directory[PATH_MAX]; // real path of the project, or of its -o directory
+	char *bytes;
+	size_t length;
+	long kept; // order of the manifests kept, the lowest is dropped first
+} KeptManifest;
+
+// the pipe a request sends the manifest of its build on: its length, the directory then the manifest
+typedef struct {
+	int fd;
+	char *bytes; // read so far
+	size_t length;
+	size_t capacity;
+} ManifestPipe;
+
+char daemonSocketPath[sizeof ((struct sockaddr_un *)0)->sun_path]; // removed when the daemon is stopped
+KeptManifest keptManifests[DAEMON_MAX_MANIFESTS];
+int keptManifestsCount;
+long manifestsKept;
+ManifestPipe manifestPipes[DAEMON_BACKLOG]; // of the requests being compiled
+int manifestPipesCount;
+int daemonRequest = 0; // 1 in the process compiling a request
+int requestPipe = -1; // in the process compiling a request: the manifest of the build goes to the daemon on it, -1 if it cannot
+
+int daemonAddress(char *socketPath, struct sockaddr_un *address) {
+	memset(address, 0, sizeof *address);
+	address->sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof address->sun_path) {
+		printf("Socket path too long: %s\n", socketPath);
+		return 0;
+	}
+	strcpy(address->sun_path, socketPath);
+	return 1;
+}
+
+void stopDaemon(int signal) {
+	unlink(daemonSocketPath);
+	_exit(0);
+}
+
+int DaemonRequest() {
+	return daemonRequest;
+}
+
+FILE *KeptBuildManifest(char *directory) {
+	char path[PATH_MAX];
+	if (realpath(directory, path) == NULL) {
+		return NULL;
+	}
+	for (int i = 0; i < keptManifestsCount; ++i) {
+		if (strcmp(keptManifests[i].directory, path) == 0) {
+			return fmemopen(keptManifests[i].bytes, keptManifests[i].length, "rb");
+		}
+	}
+	return NULL;
+}
+
+void KeepBuildManifest(char *directory, SourceFile *files, int count) {
+	char path[PATH_MAX];
+	if (requestPipe < 0 || realpath(directory, path) == NULL) {
+		return;
+	}
+	char *bytes = NULL;
+	size_t length = 0;
+	FILE *fp = open_memstream(&bytes, &length);
+	if (fp == NULL) {
+		return;
+	}
+	int ok = WriteBuildManifest(fp, files, count);
+	if (fclose(fp) == 0 && ok) { // the daemon drops a manifest not sent whole
+		uint64_t size = strlen(path) + 1 + length;
+		FILE *sent = fdopen(requestPipe, "wb");
+		fwrite(&size, sizeof size, 1, sent);
+		fwrite(path, 1, strlen(path) + 1, sent);
+		fwrite(bytes, 1, length, sent);
+		fclose(sent);
+		requestPipe = -1;
+	}
+	free(bytes);
+}
+
+// keeps the manifest of the project in directory (bytes are taken), in place of its last one or of the one kept
+// longest ago
+void keepManifest(char *directory, char *bytes, size_t length) {
+	KeptManifest *kept = NULL;
+	for (int i = 0; i < keptManifestsCount && kept == NULL; ++i) {
+		if (strcmp(keptManifests[i].directory, directory) == 0) {
+			kept = &keptManifests[i];
+		}
+	}
+	if (kept == NULL && keptManifestsCount < DAEMON_MAX_MANIFESTS) {
+		kept = &keptManifests[keptManifestsCount++];
+	}
+	for (int i = 0; kept == NULL && i < keptManifestsCount; ++i) {
+		if (i == 0 || keptManifests[i].kept < kept->kept) {
+			kept = &keptManifests[i];
+		}
+	}
+	free(kept->bytes);
+	strcpy(kept->directory, directory);
+	kept->bytes = bytes;
+	kept->length = length;
+	kept->kept = ++manifestsKept;
+}
+
+// reads what a request sent on its pipe, keeps the manifest once the request closed it -- returns 0 then
+int readManifestPipe(ManifestPipe *request) {
+	if (request->length == request->capacity) {
+		request->capacity = request->capacity ? 2 * request->capacity : 65536;
+		request->bytes = realloc(request->bytes, request->capacity);
+	}
+	ssize_t length = read(request->fd, request->bytes + request->length, request->capacity - request->length);
+	if (length > 0 || (length < 0 && errno == EINTR)) {
+		request->length += length > 0 ? (size_t)length : 0;
+		return 1;
+	}
+
+	uint64_t size;
+	char *directory = request->bytes + sizeof size;
+	if (request->length > sizeof size) {
+		memcpy(&size, request->bytes, sizeof size);
+		size_t directoryLength = strnlen(directory, request->length - sizeof size) + 1;
+		if (size == request->length - sizeof size && directoryLength < size && directoryLength <= PATH_MAX) {
+			char *bytes = malloc(size - directoryLength);
+			memcpy(bytes, directory + directoryLength, size - directoryLength);
+			keepManifest(directory, bytes, size - directoryLength);
+		}
+	}
+	close(request->fd);
+	free(request->bytes);
+	return 0;
+}
+
+// reads a request: the length of the arguments with the descriptors, then the arguments (each ended by '\0') --
+// returns the number of arguments put in argv after argv[0], -1 if the request is not valid
+int readRequest(int connection, char *buffer, char **argv, int *descriptors) {
+	uint32_t length;
+	char control[CMSG_SPACE(DAEMON_DESCRIPTORS * sizeof(int))];
+	struct iovec part = {&length, sizeof length};
+	struct msghdr message = {0};
+	message.msg_iov = &part;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof control;
+	if (recvmsg(connection, &message, MSG_WAITALL) != sizeof length || (message.msg_flags & MSG_CTRUNC)) {
+		return -1;
+	}
+	struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+	if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(DAEMON_DESCRIPTORS * sizeof(int))) {
+		return -1;
+	}
+	memcpy(descriptors, CMSG_DATA(header), DAEMON_DESCRIPTORS * sizeof(int));
+
+	if (length > DAEMON_MAX_REQUEST || (length > 0 && recv(connection, buffer, length, MSG_WAITALL) != length) || (length > 0 && buffer[length - 1] != '\0')) {
+		return -1;
+	}
+	int argc = 0;
+	for (uint32_t i = 0; i < length; i += strlen(buffer + i) + 1) {
+		if (argc == DAEMON_MAX_ARGUMENTS) {
+			return -1;
+		}
+		argv[++argc] = buffer + i;
+	}
+	argv[argc + 1] = NULL;
+	return argc;
+}
+
+// answers a request with the status the compile exits with, after the files written (listed by the compile itself)
+void answerRequest(int status, void *unused) {
+	fprintf(outputList, "status %d\n", status & 0xff);
+	fflush(outputList);
+}
+
+// compiles a request, in a process forked for the connection so the daemon goes on accepting -- does not return
+void serveRequest(int connection) {
+	static char buffer[DAEMON_MAX_REQUEST];
+	char *argv[DAEMON_MAX_ARGUMENTS + 2] = {"compiler"};
+	int descriptors[DAEMON_DESCRIPTORS];
+	daemonRequest = 1;
+	int argc = readRequest(connection, buffer, argv, descriptors);
+	outputList = fdopen(connection, "w");
+	on_exit(answerRequest, NULL); // also when the compile exits on an error
+	if (argc < 0 || fchdir(descriptors[DAEMON_DIRECTORY]) != 0) {
+		exit(-1);
+	}
+	dup2(descriptors[DAEMON_STDIN], STDIN_FILENO);
+	dup2(descriptors[DAEMON_STDOUT], STDOUT_FILENO);
+	dup2(descriptors[DAEMON_STDERR], STDERR_FILENO);
+	for (int i = 0; i < DAEMON_DESCRIPTORS; ++i) {
+		close(descriptors[i]);
+	}
+	exit(RunCompiler(argc + 1, argv));
+}
+
+int RunDaemon(char *socketPath) {
+	struct sockaddr_un address;
+	if (!daemonAddress(socketPath, &address)) {
+		return 1;
+	}
+
+	// the libraries are parsed once, the requests are compiled from other directories
+	static char directory[PATH_MAX];
+	if (getcwd(directory, sizeof directory) == NULL) {
+		printf("Could not get the current directory.\n");
+		return 1;
+	}
+	libraryDirectory = directory;
+	InitCompiler();
+	ParserInfo p = LoadStandardLibs();
+	if (p.er != none) {
+		printf("Could not compile the standard libraries in %s.\n", directory); // the error is printed by the parser
+		return 1;
+	}
+
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct stat existing;
+	if (stat(socketPath, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+		unlink(socketPath); // left by a daemon which was not stopped by a signal
+	}
+	if (server < 0 || bind(server, (struct sockaddr *)&address, sizeof address) != 0 || listen(server, DAEMON_BACKLOG) != 0) {
+		printf("Could not listen on %s.\n", socketPath);
+		return 1;
+	}
+	strcpy(daemonSocketPath, socketPath);
+	signal(SIGINT, stopDaemon);
+	signal(SIGTERM, stopDaemon);
+	signal(SIGCHLD, SIG_IGN); // the process of a connection is not waited for
+	signal(SIGPIPE, SIG_IGN); // a client may go before its answer
+	printf("Compiler daemon listening on %s\n", socketPath);
+	fflush(stdout);
+
+	for (;;) {
+		// the manifests sent by the requests being compiled are read as they come, between the connections
+		struct pollfd polled[DAEMON_BACKLOG + 1] = {{server, POLLIN, 0}};
+		for (int i = 0; i < manifestPipesCount; ++i) {
+			polled[i + 1] = (struct pollfd){manifestPipes[i].fd, POLLIN, 0};
+		}
+		if (poll(polled, manifestPipesCount + 1, -1) < 0) {
+			continue; // interrupted
+		}
+		for (int i = manifestPipesCount - 1; i >= 0; --i) {
+			if (polled[i + 1].revents && !readManifestPipe(&manifestPipes[i])) {
+				manifestPipes[i] = manifestPipes[--manifestPipesCount];
+			}
+		}
+		if (!(polled[0].revents & POLLIN)) {
+			continue;
+		}
+
+		int connection = accept(server, NULL, NULL);
+		if (connection < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				printf("Could not accept a connection on %s.\n", socketPath);
+				unlink(socketPath);
+				return 1;
+			}
+			continue;
+		}
+		int ends[2] = {-1, -1}; // the request sends the manifest of its build on it, if there is one to spare
+		if (manifestPipesCount == DAEMON_BACKLOG || pipe(ends) != 0) {
+			ends[0] = ends[1] = -1;
+		}
+		fflush(stdout); // or the forked process would print it again
+		if (fork() == 0) {
+			close(server);
+			for (int i = 0; i < manifestPipesCount; ++i) {
+				close(manifestPipes[i].fd);
+			}
+			if (ends[0] >= 0) {
+				close(ends[0]);
+			}
+			requestPipe = ends[1];
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGCHLD, SIG_DFL);
+			serveRequest(connection);
+		}
+		close(connection);
+		if (ends[0] >= 0) {
+			close(ends[1]);
+			manifestPipes[manifestPipesCount++] = (ManifestPipe){ends[0], NULL, 0, 0};
+		}
+	}
+}
+
+int RunDaemonClient(char *socketPath, int argc, char **argv) {
+	struct sockaddr_un address;
+	int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (connection < 0 || !daemonAddress(socketPath, &address) || connect(connection, (struct sockaddr *)&address, sizeof address) != 0) {
+		fprintf(stderr, "Could not connect to the compiler daemon on %s, compiling here.\n", socketPath);
+		if (connection >= 0) {
+			close(connection);
+		}
+		return RunCompiler(argc, argv);
+	}
+
+	static char buffer[DAEMON_MAX_REQUEST];
+	uint32_t length = 0;
+	for (int i = 1; i < argc; ++i) {
+		size_t argumentLength = strlen(argv[i]) + 1;
+		if (length + argumentLength > sizeof buffer || i > DAEMON_MAX_ARGUMENTS) {
+			printf("Too long a command line for the compiler daemon.\n");
+			return 1;
+		}
+		memcpy(buffer + length, argv[i], argumentLength);
+		length += argumentLength;
+	}
+
+	int descriptors[DAEMON_DESCRIPTORS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, open(".", O_RDONLY | O_DIRECTORY)};
+	char control[CMSG_SPACE(sizeof descriptors)];
+	memset(control, 0, sizeof control);
+	struct iovec parts[2] = {{&length, sizeof length}, {buffer, length}};
+	struct msghdr message = {0};
+	message.msg_iov = parts;
+	message.msg_iovlen = 2;
+	message.msg_control = control;
+	message.msg_controllen = sizeof control;
+	struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof descriptors);
+	memcpy(CMSG_DATA(header), descriptors, sizeof descriptors);
+	if (descriptors[DAEMON_DIRECTORY] < 0 || sendmsg(connection, &message, 0) != (ssize_t)(sizeof length + length)) {
+		printf("Could not send the request to the compiler daemon on %s.\n", socketPath);
+		return 1;
+	}
+	close(descriptors[DAEMON_DIRECTORY]);
+
+	// the files written go to stderr as they are listed, the status is the last line
+	FILE *answer = fdopen(connection, "r");
+	char line[PATH_MAX + 16];
+	while (fgets(line, sizeof line, answer) != NULL) {
+		if (strncmp(line, "status ", 7) == 0) {
+			fclose(answer);
+			return atoi(line + 7);
+		}
+		fputs(line, stderr);
+	}
+	fclose(answer);
+	printf("The compiler daemon on %s stopped before answering.\n", socketPath);
+	return 1;
+}
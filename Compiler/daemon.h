@@ -0,0 +1,19 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#define DAEMON_MAX_REQUEST 65536 // bytes of the command line of a request
+#define DAEMON_MAX_ARGUMENTS 256 // arguments of a request
+#define DAEMON_BACKLOG 64 // connections waiting to be accepted, and requests sending back their build manifests
+#define DAEMON_MAX_MANIFESTS 64 // projects whose build manifest is kept, the one kept longest ago is dropped for another
+
+#include <stdio.h>
+
+#include "compiler.h"
+
+int RunDaemon(char *socketPath); // parses the standard libraries then compiles the requests on the socket, does not return unless it cannot listen
+int RunDaemonClient(char *socketPath, int argc, char **argv); // has the daemon compile as the command line asks (argv[0] is not read), compiles here if there is no daemon -- returns the exit status
+int DaemonRequest(); // 1 in the process compiling a request of the daemon
+FILE *KeptBuildManifest(char *directory); // in the process of a request: the manifest the daemon keeps for the project built in (or output to) directory, NULL if none
+void KeepBuildManifest(char *directory, SourceFile *files, int count); // in the process of a request: sends the manifest of the build to the daemon, which keeps it for the next build of the project
+
+#endif
@@ -0,0 +1,82 @@
+#!/bin/bash
+# Runs the sample projects with every optimisation level and backend and compares their output and screen
+# with the ones of the unoptimised interpreter (-O0 -run). Run it from Compiler/ on x86-64 Linux:
+#     ./difftest.sh [compiler]
+# Only the projects ending within STEPS vm instructions at -O0 are compared, the others run for as long as
+# their optimised code lets them. Exits with 1 if any run differs.
+
+COMPILER=${1:-./compiler}
+STEPS=${STEPS:-100000000}
+LIMIT=${LIMIT:-10}
+INPUT="3\n1\n2\n3\n" # numbers for the programs reading the keyboard
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD" code.vm code.s code.vmb' EXIT
+
+# the runs compared with -O0 -- the -tailcalls one is compared with -O0 -tailcalls, since without the option deep
+# recursions overflow the stack
+RUNS=(O1 O2 O2-j4 O2-jit O2-load O2-native O2-tailcalls)
+declare -A OPTIONS=(
+    [O0]="-O0 -run" [O1]="-O1 -run" [O2]="-O2 -run" [O2-j4]="-O2 -j 4 -run" [O2-jit]="-O2 -run -jit"
+    [O0-tailcalls]="-O0 -tailcalls -run" [O2-tailcalls]="-O2 -tailcalls -run"
+)
+# projects changing the Strings their literals give, which -O2 pools -- they are all compiled with -fno-strings
+UNPOOLED=(MutableStrings)
+
+# runs the project the way name says, its output and screen go to $BUILD/name.txt and $BUILD/name.pbm
+run() {
+    local name=$1 project=$2
+    rm -f code.s code.vmb "$BUILD/$name.txt" "$BUILD/$name.pbm"
+    if [ "$name" = "O2-load" ]; then
+        "$COMPILER" -O2 $extra -bytecode "$project" > /dev/null
+        [ -f code.vmb ] && printf "$INPUT" | "$COMPILER" -load code.vmb -steps $STEPS -screen "$BUILD/$name.pbm" > "$BUILD/$name.txt"
+    elif [ "$name" = "O2-native" ]; then
+        "$COMPILER" -O2 $extra -native "$project" > /dev/null
+        [ -f code.s ] && gcc -O2 -o "$BUILD/program" code.s Runtime/runtime.c os.c \
+            && printf "$INPUT" | timeout $LIMIT "$BUILD/program" -screen "$BUILD/$name.pbm" > "$BUILD/$name.txt"
+    else
+        printf "$INPUT" | "$COMPILER" ${OPTIONS[$name]} $extra -steps $STEPS -screen "$BUILD/$name.pbm" "$project" > "$BUILD/$name.txt"
+    fi
+}
+
+failed=0
+printf "%-44s" project
+for name in "${RUNS[@]}"; do
+    printf " %13s" "$name"
+done
+printf "\n"
+for dir in */ ../Programs/Jack\ Programs/Set\ */*/; do
+    dir=${dir%/}
+    [ -f "$dir/Main.jack" ] || continue
+
+    if printf "$INPUT" | "$COMPILER" -O0 -run -stats -steps $STEPS "$dir" | grep -q "stopped at the step limit"; then
+        printf "%-44s no end at -O0, not compared\n" "$dir"
+        continue
+    fi
+
+    extra=
+    if [[ " ${UNPOOLED[*]} " == *" ${dir##*/} "* ]]; then
+        extra=-fno-strings
+    fi
+    printf "%-44s" "$dir"
+    run O0 "$dir"
+    run O0-tailcalls "$dir"
+    for name in "${RUNS[@]}"; do
+        run "$name" "$dir"
+        reference=O0
+        if [ "$name" = O2-tailcalls ]; then
+            reference=O0-tailcalls
+        fi
+        if [ ! -f "$BUILD/$name.txt" ]; then
+            result="not built"
+            failed=1
+        elif cmp -s "$BUILD/$reference.txt" "$BUILD/$name.txt" && cmp -s "$BUILD/$reference.pbm" "$BUILD/$name.pbm"; then
+            result="same"
+        else
+            result="DIFFERENT"
+            failed=1
+        fi
+        printf " %13s" "$result"
+    done
+    printf "\n"
+done
+exit $failed
@@ -0,0 +1,679 @@
+/************************************************************************
+University of Leeds
+School of Computing
+COMP2932- Compiler Design and Construction
+The Hack Module
+
+Translates the vm code of a whole program to hack assembly (./code.asm),
+so it runs on the hack computer without the nand2tetris vm translator.
+ROM words and cycles are what counts on the hack computer, so:
+- calls and returns share one trampoline each ($CALL, $RETURN) instead of
+  expanding the frame code at every call site,
+- the top of the vm stack is kept in D (and the constant pushed last is
+  folded into the next instruction) and only written to the ram stack
+  when something else needs it, so most commands need no SP load / store,
+- comparisons followed by if-goto (or not, if-goto) become one jump,
+- segment accesses use the shortest form for their index.
+Like the standard translator, eq / gt / lt compare through x - y, which
+overflows when x and y are more than 32767 apart.
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "hack.h"
+
+int readVMCommand(char **cursor, char *line, char *command, char *arg, int *index); // from vm.c
+
+// a vm command of the program
+typedef struct {
+    char command[16];
+    char arg[128];
+    int index;
+} HackCommand;
+
+// where the top of the vm stack is -- everything below it is in the ram stack
+typedef enum {
+    HACK_RAM, // nothing cached
+    HACK_D, // the top is in D
+    HACK_CONSTANT, // the top is hackConstant
+    HACK_D_CONSTANT // the top is hackConstant and the value below it is in D
+} HackCache;
+
+FILE *hackFile;
+HackCommand *hackCommands;
+int hackCommandCount;
+char hackFunction[128]; // function being translated, prefixes its labels
+char hackClass[128]; // its class, owner of the statics
+HackCache hackCache;
+int hackConstant;
+int hackLabels; // for the labels of calls and comparisons
+long hackInstructions; // rom words of the last translation
+int hackVMCommands;
+
+void emitHack(char *format, ...); // one instruction
+void emitHackLabel(char *format, ...);
+
+void loadConstant(int value); // D = value
+void constantOperand(int value, char *operation, char **instruction); // A = value for D = D op A, if it needs A
+void pushD();
+void pushConstant(int value);
+void flushHack(); // writes the cached values to the ram stack
+void topToD(); // pops the top of the vm stack into D
+
+char *segmentBase(char *segment); // LCL / ARG / THIS / THAT, NULL for the fixed segments
+void fixedAddress(char *segment, int index, char *address); // symbol or address of a pointer / temp / static word
+void segmentToA(char *base, int index); // A = base + index, keeping D
+
+void translateHackPush(HackCommand *command);
+void translateHackPop(HackCommand *command);
+void translateHackBinary(char *operation); // D = x operation y
+void translateHackUnary(char *command);
+int translateHackCompare(int i); // returns the commands used
+void translateHackCall(char *function, int arguments);
+void emitTrampolines();
+
+/** ----------------- Assembly Output ----------------- **/
+
+void emitHack(char *format, ...) {
+    va_list list;
+    va_start(list, format);
+    vfprintf(hackFile, format, list);
+    fprintf(hackFile, "\n");
+    va_end(list);
+    hackInstructions++;
+}
+
+void emitHackLabel(char *format, ...) {
+    va_list list;
+    va_start(list, format);
+    fprintf(hackFile, "(");
+    vfprintf(hackFile, format, list);
+    fprintf(hackFile, ")\n");
+    va_end(list);
+}
+
+/** ----------------- Stack Cache ----------------- **/
+
+void loadConstant(int value) {
+    if (value == 0 || value == 1 || value == -1) {
+        emitHack("D=%d", value);
+    }
+    else if (value == -32768) {
+        emitHack("@32767");
+        emitHack("D=!A");
+    }
+    else if (value < 0) {
+        emitHack("@%d", -value);
+        emitHack("D=-A");
+    }
+    else {
+        emitHack("@%d", value);
+        emitHack("D=A");
+    }
+}
+
+// operation is + - & or |, instruction gets the computation for D (NULL if D stays)
+void constantOperand(int value, char *operation, char **instruction) {
+    int negate = value < 0 && value != -32768 && (operation[0] == '+' || operation[0] == '-');
+    if (negate) {
+        value = -value;
+        operation = operation[0] == '+' ? "-" : "+";
+    }
+    if ((operation[0] == '+' || operation[0] == '-') && value == 0) {
+        *instruction = NULL;
+        return;
+    }
+    if (operation[0] == '+' || operation[0] == '-') {
+        if (value == 1) {
+            *instruction = operation[0] == '+' ? "D=D+1" : "D=D-1";
+            return;
+        }
+        *instruction = operation[0] == '+' ? "D=D+A" : "D=D-A";
+    }
+    else {
+        if (value == -1 || value == 0) { // x & -1, x | 0 keep x, x & 0, x | -1 are constants
+            int keep = (operation[0] == '&') == (value == -1);
+            *instruction = keep ? NULL : (value == 0 ? "D=0" : "D=-1");
+            return;
+        }
+        *instruction = operation[0] == '&' ? "D=D&A" : "D=D|A";
+    }
+    if (value < 0) {
+        emitHack("@%d", ~value);
+        emitHack("A=!A");
+    }
+    else {
+        emitHack("@%d", value);
+    }
+}
+
+void pushD() {
+    emitHack("@SP");
+    emitHack("AM=M+1");
+    emitHack("A=A-1");
+    emitHack("M=D");
+}
+
+void pushConstant(int value) {
+    if (value == 0 || value == 1 || value == -1) {
+        emitHack("@SP");
+        emitHack("AM=M+1");
+        emitHack("A=A-1");
+        emitHack("M=%d", value);
+        return;
+    }
+    loadConstant(value);
+    pushD();
+}
+
+void flushHack() {
+    if (hackCache == HACK_D || hackCache == HACK_D_CONSTANT) {
+        pushD();
+    }
+    if (hackCache == HACK_CONSTANT || hackCache == HACK_D_CONSTANT) {
+        pushConstant(hackConstant);
+    }
+    hackCache = HACK_RAM;
+}
+
+void topToD() {
+    switch (hackCache) {
+        case HACK_RAM:
+            emitHack("@SP");
+            emitHack("AM=M-1");
+            emitHack("D=M");
+            break;
+        case HACK_D_CONSTANT:
+            pushD();
+            loadConstant(hackConstant);
+            break;
+        case HACK_CONSTANT:
+            loadConstant(hackConstant);
+            break;
+        default:
+            break;
+    }
+    hackCache = HACK_D;
+}
+
+/** ----------------- Segments ----------------- **/
+
+char *segmentBase(char *segment) {
+    if (strcmp(segment, "local") == 0) {
+        return "LCL";
+    }
+    if (strcmp(segment, "argument") == 0) {
+        return "ARG";
+    }
+    if (strcmp(segment, "this") == 0) {
+        return "THIS";
+    }
+    if (strcmp(segment, "that") == 0) {
+        return "THAT";
+    }
+    return NULL;
+}
+
+void fixedAddress(char *segment, int index, char *address) {
+    if (strcmp(segment, "pointer") == 0) {
+        sprintf(address, "%d", 3 + index);
+    }
+    else if (strcmp(segment, "temp") == 0) {
+        sprintf(address, "%d", 5 + index);
+    }
+    else { // static
+        sprintf(address, "%s.%d", hackClass, index);
+    }
+}
+
+// only for index <= HACK_UNROLL_LIMIT
+void segmentToA(char *base, int index) {
+    emitHack("@%s", base);
+    emitHack(index == 0 ? "A=M" : "A=M+1");
+    for (int i = 1; i < index; ++i) {
+        emitHack("A=A+1");
+    }
+}
+
+/** ----------------- Commands ----------------- **/
+
+void translateHackPush(HackCommand *command) {
+    char address[160];
+    char *base = segmentBase(command->arg);
+    if (strcmp(command->arg, "constant") == 0) {
+        if (hackCache == HACK_CONSTANT || hackCache == HACK_D_CONSTANT) {
+            flushHack();
+        }
+        hackCache = hackCache == HACK_D ? HACK_D_CONSTANT : HACK_CONSTANT;
+        hackConstant = (int16_t)command->index;
+        return;
+    }
+    flushHack();
+    if (base == NULL) {
+        fixedAddress(command->arg, command->index, address);
+        emitHack("@%s", address);
+    }
+    else if (command->index <= HACK_UNROLL_LIMIT) {
+        segmentToA(base, command->index);
+    }
+    else {
+        emitHack("@%d", command->index);
+        emitHack("D=A");
+        emitHack("@%s", base);
+        emitHack("A=D+M");
+    }
+    emitHack("D=M");
+    hackCache = HACK_D;
+}
+
+void translateHackPop(HackCommand *command) {
+    char address[160];
+    char *base = segmentBase(command->arg);
+    int small = (hackCache == HACK_CONSTANT || hackCache == HACK_D_CONSTANT) &&
+        (hackConstant == 0 || hackConstant == 1 || hackConstant == -1); // stored without D
+
+    if (base == NULL || command->index <= HACK_UNROLL_LIMIT) { // the address needs no D
+        if (!small) {
+            topToD();
+        }
+        if (base == NULL) {
+            fixedAddress(command->arg, command->index, address);
+            emitHack("@%s", address);
+        }
+        else {
+            segmentToA(base, command->index);
+        }
+        if (small) {
+            emitHack("M=%d", hackConstant);
+            hackCache = hackCache == HACK_D_CONSTANT ? HACK_D : HACK_RAM;
+        }
+        else {
+            emitHack("M=D");
+            hackCache = HACK_RAM;
+        }
+        return;
+    }
+
+    // far index -- the address is computed in D and kept in R13
+    if (hackCache == HACK_D_CONSTANT) {
+        pushD();
+        hackCache = HACK_CONSTANT;
+    }
+    if (hackCache == HACK_D) {
+        emitHack("@R14");
+        emitHack("M=D");
+    }
+    emitHack("@%d", command->index);
+    emitHack("D=A");
+    emitHack("@%s", base);
+    if (small) {
+        emitHack("A=D+M");
+        emitHack("M=%d", hackConstant);
+        hackCache = HACK_RAM;
+        return;
+    }
+    emitHack("D=D+M");
+    emitHack("@R13");
+    emitHack("M=D");
+    if (hackCache == HACK_D) {
+        emitHack("@R14");
+        emitHack("D=M");
+    }
+    else if (hackCache == HACK_CONSTANT) {
+        loadConstant(hackConstant);
+    }
+    else {
+        emitHack("@SP");
+        emitHack("AM=M-1");
+        emitHack("D=M");
+    }
+    emitHack("@R13");
+    emitHack("A=M");
+    emitHack("M=D");
+    hackCache = HACK_RAM;
+}
+
+void translateHackBinary(char *operation) {
+    if (hackCache == HACK_CONSTANT || hackCache == HACK_D_CONSTANT) {
+        if (hackCache == HACK_CONSTANT) { // x is in the ram stack
+            emitHack("@SP");
+            emitHack("AM=M-1");
+            emitHack("D=M");
+        }
+        char *instruction;
+        constantOperand(hackConstant, operation, &instruction);
+        if (instruction != NULL) {
+            emitHack("%s", instruction);
+        }
+        hackCache = HACK_D;
+        return;
+    }
+    topToD(); // y
+    emitHack("@SP");
+    emitHack("AM=M-1");
+    switch (operation[0]) {
+        case '+': emitHack("D=D+M"); break;
+        case '-': emitHack("D=M-D"); break;
+        case '&': emitHack("D=D&M"); break;
+        default: emitHack("D=D|M"); break;
+    }
+    hackCache = HACK_D;
+}
+
+void translateHackUnary(char *command) {
+    int negate = strcmp(command, "neg") == 0;
+    switch (hackCache) {
+        case HACK_CONSTANT: case HACK_D_CONSTANT:
+            hackConstant = negate ? (int16_t)-hackConstant : (int16_t)~hackConstant;
+            break;
+        case HACK_D:
+            emitHack(negate ? "D=-D" : "D=!D");
+            break;
+        default:
+            emitHack("@SP");
+            emitHack("A=M-1");
+            emitHack(negate ? "M=-M" : "M=!M");
+            break;
+    }
+}
+
+int translateHackCompare(int i) {
+    char *command = hackCommands[i].command;
+    char *jumps[2][3] = {{"JEQ", "JGT", "JLT"}, {"JNE", "JLE", "JGE"}}; // taken if true, taken if false
+    int kind = strcmp(command, "eq") == 0 ? 0 : (strcmp(command, "gt") == 0 ? 1 : 2);
+    translateHackBinary("-");
+
+    int negated = i + 1 < hackCommandCount && strcmp(hackCommands[i + 1].command, "not") == 0;
+    int branch = i + 1 + negated;
+    if (branch < hackCommandCount && strcmp(hackCommands[branch].command, "if-goto") == 0) {
+        emitHack("@%s$%s", hackFunction, hackCommands[branch].arg);
+        emitHack("D;%s", jumps[negated][kind]);
+        hackCache = HACK_RAM;
+        return branch - i + 1;
+    }
+    int label = hackLabels++;
+    emitHack("@$TRUE%d", label);
+    emitHack("D;%s", jumps[0][kind]);
+    emitHack("D=0");
+    emitHack("@$END%d", label);
+    emitHack("0;JMP");
+    emitHackLabel("$TRUE%d", label);
+    emitHack("D=-1");
+    emitHackLabel("$END%d", label);
+    hackCache = HACK_D;
+    return 1;
+}
+
+// the return value is left in D
+void translateHackCall(char *function, int arguments) {
+    int label = hackLabels++;
+    flushHack();
+    emitHack("@%d", arguments + 5);
+    emitHack("D=A");
+    emitHack("@R14");
+    emitHack("M=D");
+    emitHack("@%s", function);
+    emitHack("D=A");
+    emitHack("@R13");
+    emitHack("M=D");
+    emitHack("@$RET%d", label);
+    emitHack("D=A");
+    emitHack("@$CALL");
+    emitHack("0;JMP");
+    emitHackLabel("$RET%d", label);
+    hackCache = HACK_D;
+}
+
+void emitTrampolines() {
+    // D return address, R13 callee, R14 number of arguments + 5
+    emitHackLabel("$CALL");
+    emitHack("@SP");
+    emitHack("A=M");
+    emitHack("M=D");
+    char *saved[4] = {"LCL", "ARG", "THIS", "THAT"};
+    for (int i = 0; i < 4; ++i) {
+        emitHack("@%s", saved[i]);
+        emitHack("D=M");
+        emitHack("@SP");
+        emitHack("AM=M+1");
+        emitHack("M=D");
+    }
+    emitHack("@SP");
+    emitHack("MD=M+1");
+    emitHack("@LCL");
+    emitHack("M=D");
+    emitHack("@R14");
+    emitHack("D=D-M");
+    emitHack("@ARG");
+    emitHack("M=D");
+    emitHack("@R13");
+    emitHack("A=M");
+    emitHack("0;JMP");
+
+    // D return value, handed back in D -- the caller's stack ends where the arguments started
+    emitHackLabel("$RETURN");
+    emitHack("@R15");
+    emitHack("M=D");
+    emitHack("@ARG");
+    emitHack("D=M");
+    emitHack("@SP");
+    emitHack("M=D");
+    char *restored[3] = {"THAT", "THIS", "ARG"};
+    for (int i = 0; i < 3; ++i) {
+        emitHack("@LCL");
+        emitHack("AM=M-1");
+        emitHack("D=M");
+        emitHack("@%s", restored[i]);
+        emitHack("M=D");
+    }
+    emitHack("@LCL"); // return address at LCL - 5, the caller's LCL at LCL - 4
+    emitHack("AM=M-1");
+    emitHack("A=A-1");
+    emitHack("D=M");
+    emitHack("@R14");
+    emitHack("M=D");
+    emitHack("@LCL");
+    emitHack("A=M");
+    emitHack("D=M");
+    emitHack("@LCL");
+    emitHack("M=D");
+    emitHack("@R15");
+    emitHack("D=M");
+    emitHack("@R14");
+    emitHack("A=M");
+    emitHack("0;JMP");
+}
+
+/** ----------------- Output ----------------- **/
+
+int OutputHackProgram(char *code, char *filename) {
+    // the commands, and which subroutines are defined and called
+    int capacity = 1;
+    for (char *c = code; *c; ++c) {
+        capacity += *c == '\n';
+    }
+    if (capacity > HACK_MAX_COMMANDS) {
+        printf("Hack error: more than %d vm commands\n", HACK_MAX_COMMANDS);
+        return 0;
+    }
+    hackCommands = malloc((capacity + 1) * sizeof(HackCommand));
+    hackCommandCount = 0;
+    char line[256];
+    char *cursor = code;
+    HackCommand *command = hackCommands;
+    while (readVMCommand(&cursor, line, command->command, command->arg, &command->index)) {
+        command = &hackCommands[++hackCommandCount];
+    }
+    hackVMCommands = hackCommandCount;
+
+    static char defined[HACK_MAX_FUNCTIONS][128], called[HACK_MAX_FUNCTIONS][128];
+    int definedCount = 0, calledCount = 0, hasSysInit = 0;
+    for (int i = 0; i < hackCommandCount; ++i) {
+        if (strcmp(hackCommands[i].command, "function") == 0 && definedCount < HACK_MAX_FUNCTIONS) {
+            strcpy(defined[definedCount++], hackCommands[i].arg);
+            hasSysInit |= strcmp(hackCommands[i].arg, "Sys.init") == 0;
+        }
+    }
+    char *entry = hasSysInit ? "Sys.init" : "Main.main";
+    for (int i = -1; i < hackCommandCount; ++i) { // -1 is the call of the bootstrap
+        if (i >= 0 && strcmp(hackCommands[i].command, "call") != 0) {
+            continue;
+        }
+        char *function = i < 0 ? entry : hackCommands[i].arg;
+        int known = 0;
+        for (int j = 0; j < definedCount && !known; ++j) {
+            known = strcmp(defined[j], function) == 0;
+        }
+        for (int j = 0; j < calledCount && !known; ++j) {
+            known = strcmp(called[j], function) == 0;
+        }
+        if (!known && calledCount < HACK_MAX_FUNCTIONS) {
+            strcpy(called[calledCount++], function);
+        }
+    }
+
+    hackFile = fopen(filename, "wb");
+    if (hackFile == NULL) {
+        printf("Could not process hack assembly output file.\n");
+        free(hackCommands);
+        return 0;
+    }
+    hackInstructions = 0;
+    hackLabels = 0;
+    hackCache = HACK_RAM;
+    strcpy(hackFunction, "$bootstrap");
+    strcpy(hackClass, "$bootstrap");
+
+    // bootstrap -- Sys.init when the program has the OS, Main.main otherwise
+    emitHack("@256");
+    emitHack("D=A");
+    emitHack("@SP");
+    emitHack("M=D");
+    translateHackCall(entry, 0);
+    emitHackLabel("$HALT");
+    emitHack("@$HALT");
+    emitHack("0;JMP");
+    emitTrampolines();
+
+    for (int i = 0; i < hackCommandCount;) {
+        HackCommand *command = &hackCommands[i];
+        int used = 1;
+        if (strcmp(command->command, "push") == 0) {
+            translateHackPush(command);
+        }
+        else if (strcmp(command->command, "pop") == 0) {
+            translateHackPop(command);
+        }
+        else if (strcmp(command->command, "add") == 0) {
+            translateHackBinary("+");
+        }
+        else if (strcmp(command->command, "sub") == 0) {
+            translateHackBinary("-");
+        }
+        else if (strcmp(command->command, "and") == 0) {
+            translateHackBinary("&");
+        }
+        else if (strcmp(command->command, "or") == 0) {
+            translateHackBinary("|");
+        }
+        else if (strcmp(command->command, "neg") == 0 || strcmp(command->command, "not") == 0) {
+            translateHackUnary(command->command);
+        }
+        else if (strcmp(command->command, "eq") == 0 || strcmp(command->command, "gt") == 0 || strcmp(command->command, "lt") == 0) {
+            used = translateHackCompare(i);
+        }
+        else if (strcmp(command->command, "label") == 0) {
+            flushHack();
+            emitHackLabel("%s$%s", hackFunction, command->arg);
+        }
+        else if (strcmp(command->command, "goto") == 0) {
+            flushHack();
+            emitHack("@%s$%s", hackFunction, command->arg);
+            emitHack("0;JMP");
+        }
+        else if (strcmp(command->command, "if-goto") == 0) {
+            if (hackCache == HACK_CONSTANT || hackCache == HACK_D_CONSTANT) {
+                int taken = hackConstant != 0;
+                hackCache = hackCache == HACK_D_CONSTANT ? HACK_D : HACK_RAM;
+                flushHack();
+                if (taken) {
+                    emitHack("@%s$%s", hackFunction, command->arg);
+                    emitHack("0;JMP");
+                }
+            }
+            else {
+                topToD();
+                emitHack("@%s$%s", hackFunction, command->arg);
+                emitHack("D;JNE");
+                hackCache = HACK_RAM;
+            }
+        }
+        else if (strcmp(command->command, "function") == 0) {
+            flushHack();
+            strcpy(hackFunction, command->arg);
+            strcpy(hackClass, command->arg);
+            char *dot = strchr(hackClass, '.');
+            if (dot) {
+                *dot = '\0';
+            }
+            emitHackLabel("%s", command->arg);
+            if (command->index == 1) {
+                pushConstant(0);
+            }
+            else if (command->index > 1) {
+                emitHack("@SP");
+                emitHack("A=M");
+                emitHack("M=0");
+                for (int local = 1; local < command->index; ++local) {
+                    emitHack("A=A+1");
+                    emitHack("M=0");
+                }
+                emitHack("D=A+1");
+                emitHack("@SP");
+                emitHack("M=D");
+            }
+        }
+        else if (strcmp(command->command, "call") == 0) {
+            translateHackCall(command->arg, command->index);
+        }
+        else if (strcmp(command->command, "return") == 0) {
+            topToD();
+            emitHack("@$RETURN");
+            emitHack("0;JMP");
+            hackCache = HACK_RAM;
+        }
+        else {
+            printf("Hack error: unknown vm command %s\n", command->command);
+        }
+        i += used;
+    }
+
+    int status = !ferror(hackFile);
+    fclose(hackFile);
+    hackFile = NULL;
+    free(hackCommands);
+    hackCommands = NULL;
+    if (!status) {
+        printf("Could not write the hack assembly output file.\n");
+        return 0;
+    }
+    if (calledCount > 0) {
+        printf("Hack: %d called subroutines are not in the program and have to be added to code.asm:", calledCount);
+        for (int i = 0; i < calledCount; ++i) {
+            printf(" %s", called[i]);
+        }
+        printf("\n");
+    }
+    if (hackInstructions > HACK_ROM_SIZE) {
+        printf("Hack: %ld instructions do not fit in the %d words of the rom\n", hackInstructions, HACK_ROM_SIZE);
+    }
+    return 1;
+}
+
+void PrintHackReport() {
+    printf("hack: %ld instructions for %d vm commands (%.1f%% of the rom)\n", hackInstructions, hackVMCommands,
+        100.0 * hackInstructions / HACK_ROM_SIZE);
+}
@@ -0,0 +1,12 @@
+#ifndef HACK_H
+#define HACK_H
+
+#define HACK_ROM_SIZE 32768 // instructions the hack computer can hold
+#define HACK_MAX_COMMANDS 262144 // vm commands of a program
+#define HACK_MAX_FUNCTIONS 4096 // subroutines defined or called by a program
+#define HACK_UNROLL_LIMIT 6 // furthest local / argument / this / that index reached by incrementing A instead of adding it
+
+int OutputHackProgram(char *code, char *filename); // translates the vm code of a whole program to hack assembly, returns 0 if it cannot
+void PrintHackReport(); // rom size of the translation
+
+#endif
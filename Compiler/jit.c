@@ -0,0 +1,634 @@
+/************************************************************************
+University of Leeds
+School of Computing
+COMP2932- Compiler Design and Construction
+The JIT Module
+
+Compiles the instructions loaded by the vm module to x86-64 machine code in
+an mmap'd buffer and runs it on the same hack ram and built-in OS.
+Within a basic block the top of the vm stack is kept in host registers
+(constants are folded) and only written to the ram stack at the end of the
+block, before calls and when the registers run out.
+Registers: rbx ram, r12 sp, r13 lcl, r14 arg, r15 instruction budget left,
+rbp host stack on entry; rcx, rdx, rsi, rdi and r8..r11 hold stack values.
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "vm.h"
+#include "jit.h"
+
+extern int16_t vmRam[VM_RAM_SIZE]; // from os.c
+extern VMInstruction *vmInstructions; // from vm.c
+extern int vmInstructionCount; // from vm.c
+extern VMBuiltin vmBuiltins[]; // from os.c
+extern int vmHalted; // from os.c
+extern int vmStatus; // from os.c
+extern long vmSteps; // from vm.c
+extern double vmSeconds; // from vm.c
+extern int vmStepLimitReached; // from vm.c
+double vmClock(); // from vm.c
+
+size_t jitBytes; // machine code size of the last compile
+double jitCompileSeconds;
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+enum {RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15, NONE = -1};
+
+// why the machine code returned
+enum {JIT_HALT, JIT_STEP_LIMIT, JIT_STACK_OVERFLOW};
+
+// a cached stack value -- a constant or a host register
+typedef struct {
+    int isConstant;
+    int value; // the constant or the register
+} JitSlot;
+
+// a rel32 to fill in once every instruction has its address
+typedef struct {
+    int position; // of the rel32
+    int target; // vm instruction index
+} JitPatch;
+
+unsigned char *jitCode;
+int jitLength;
+int *jitAddresses; // code offset of every vm instruction
+JitPatch *jitPatches;
+int jitPatchCount;
+long jitRemaining; // budget left when the machine code returned
+
+JitSlot jitStack[JIT_CACHE_SLOTS]; // cached values above the ram stack pointer, bottom first
+int jitDepth;
+int jitRegisterUsed[16];
+int jitPool[8] = {RCX, RDX, RSI, RDI, R8, R9, R10, R11};
+
+void emitByte(int byte);
+void emit16(int value);
+void emit32(int value);
+void emitOpcode(int opcode); // one byte, or two for 0x0Fxx
+void emitMemory(int operand16, int wide, int opcode, int reg, int base, int index, int disp); // op reg, [base + index * 2 + disp]
+void emitRegister(int wide, int opcode, int reg, int rm); // op rm, reg (or op reg, rm, depending on the opcode)
+void emitMoveImmediate(int reg, int value); // mov reg32, imm32
+void emitJump(int opcode, int target); // jmp / jcc / call rel32 to a vm instruction
+void emitJumpTo(int opcode, int offset); // jmp / jcc rel32 to a known code offset
+
+int allocateRegister();
+void freeSlot(JitSlot slot);
+void flushStack(); // writes the cached values to the ram stack
+void dropStack(); // forgets the cached values
+void pushSlot(JitSlot slot);
+JitSlot popSlot();
+JitSlot slotToRegister(JitSlot slot);
+void storeSlot(JitSlot slot, int base, int index, int disp); // mov word [base + index * 2 + disp], slot
+int segmentAddress(VMInstruction *instruction, int *base, int *index, int *disp); // operand of a this / that / pointer / temp / static access
+
+void compileBinary(VMOpcode opcode);
+void compileUnary(VMOpcode opcode);
+void compileInstruction(int i, int exitHalt, int exitOverflow);
+
+/** ----------------- x86-64 Encoding ----------------- **/
+
+void emitByte(int byte) {
+    jitCode[jitLength++] = (unsigned char)byte;
+}
+
+void emit16(int value) {
+    emitByte(value);
+    emitByte(value >> 8);
+}
+
+void emit32(int value) {
+    memcpy(jitCode + jitLength, &value, 4);
+    jitLength += 4;
+}
+
+void emitOpcode(int opcode) {
+    if (opcode > 0xFF) {
+        emitByte(opcode >> 8);
+    }
+    emitByte(opcode);
+}
+
+// always the [base + index * 2 + disp32] form with a sib byte, so rsp / r12 / rbp / r13 need no special cases
+void emitMemory(int operand16, int wide, int opcode, int reg, int base, int index, int disp) {
+    if (operand16) {
+        emitByte(0x66);
+    }
+    int rex = 0x40 | wide << 3 | (reg >> 3) << 2 | (index == NONE ? 0 : (index >> 3) << 1) | base >> 3;
+    if (rex != 0x40) {
+        emitByte(rex);
+    }
+    emitOpcode(opcode);
+    emitByte(0x80 | (reg & 7) << 3 | 4);
+    emitByte(index == NONE ? (4 << 3 | (base & 7)) : (1 << 6 | (index & 7) << 3 | (base & 7)));
+    emit32(disp);
+}
+
+void emitRegister(int wide, int opcode, int reg, int rm) {
+    int rex = 0x40 | wide << 3 | (reg >> 3) << 2 | rm >> 3;
+    if (rex != 0x40) {
+        emitByte(rex);
+    }
+    emitOpcode(opcode);
+    emitByte(0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+void emitMoveImmediate(int reg, int value) {
+    if (reg >= R8) {
+        emitByte(0x41);
+    }
+    emitByte(0xB8 + (reg & 7));
+    emit32(value);
+}
+
+void emitJump(int opcode, int target) {
+    emitOpcode(opcode);
+    jitPatches[jitPatchCount].position = jitLength;
+    jitPatches[jitPatchCount].target = target;
+    jitPatchCount++;
+    emit32(0);
+}
+
+void emitJumpTo(int opcode, int offset) {
+    emitOpcode(opcode);
+    emit32(offset - (jitLength + 4));
+}
+
+/** ----------------- Stack Cache ----------------- **/
+
+int allocateRegister() {
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < 8; ++i) {
+            if (!jitRegisterUsed[jitPool[i]]) {
+                jitRegisterUsed[jitPool[i]] = 1;
+                return jitPool[i];
+            }
+        }
+        flushStack();
+    }
+    return RAX; // not reached -- at most two popped values are held outside the cache
+}
+
+void freeSlot(JitSlot slot) {
+    if (!slot.isConstant) {
+        jitRegisterUsed[slot.value] = 0;
+    }
+}
+
+void flushStack() {
+    for (int i = 0; i < jitDepth; ++i) {
+        storeSlot(jitStack[i], RBX, R12, 2 * i);
+        freeSlot(jitStack[i]);
+    }
+    if (jitDepth > 0) {
+        emitRegister(1, 0x81, 0, R12); // add r12, depth
+        emit32(jitDepth);
+    }
+    jitDepth = 0;
+}
+
+void dropStack() {
+    for (int i = 0; i < jitDepth; ++i) {
+        freeSlot(jitStack[i]);
+    }
+    jitDepth = 0;
+}
+
+void pushSlot(JitSlot slot) {
+    if (jitDepth == JIT_CACHE_SLOTS) { // the new value is not in the cache yet, so its register is kept
+        flushStack();
+    }
+    jitStack[jitDepth++] = slot;
+}
+
+JitSlot popSlot() {
+    if (jitDepth > 0) {
+        return jitStack[--jitDepth];
+    }
+    emitRegister(1, 0x81, 5, R12); // sub r12, 1
+    emit32(1);
+    JitSlot slot = {0, allocateRegister()};
+    emitMemory(0, 0, 0x0FBF, slot.value, RBX, R12, 0); // movsx reg, word [rbx + r12 * 2]
+    return slot;
+}
+
+JitSlot slotToRegister(JitSlot slot) {
+    if (!slot.isConstant) {
+        return slot;
+    }
+    JitSlot registerSlot = {0, allocateRegister()};
+    emitMoveImmediate(registerSlot.value, slot.value);
+    return registerSlot;
+}
+
+void storeSlot(JitSlot slot, int base, int index, int disp) {
+    if (slot.isConstant) {
+        emitMemory(1, 0, 0xC7, 0, base, index, disp);
+        emit16(slot.value);
+    }
+    else {
+        emitMemory(1, 0, 0x89, slot.value, base, index, disp);
+    }
+}
+
+// leaves the address in rax for this / that, returns 0 for local / argument (addressed off r13 / r14)
+int segmentAddress(VMInstruction *instruction, int *base, int *index, int *disp) {
+    *base = RBX;
+    *index = NONE;
+    switch (instruction->opcode) {
+        case VM_PUSH_THIS: case VM_POP_THIS:
+        case VM_PUSH_THAT: case VM_POP_THAT: {
+            int pointer = (instruction->opcode == VM_PUSH_THIS || instruction->opcode == VM_POP_THIS) ? 6 : 8;
+            emitMemory(0, 0, 0x0FB7, RAX, RBX, NONE, pointer); // movzx eax, word [rbx + pointer]
+            if (instruction->arg != 0) {
+                emitRegister(0, 0x81, 0, RAX); // add eax, index
+                emit32(instruction->arg);
+                emitRegister(0, 0x0FB7, RAX, RAX); // movzx eax, ax -- addresses wrap at 16 bits
+            }
+            *index = RAX;
+            *disp = 0;
+            return 1;
+        }
+        case VM_PUSH_LOCAL: case VM_POP_LOCAL:
+            *index = R13;
+            *disp = 2 * instruction->arg;
+            return 0;
+        case VM_PUSH_ARGUMENT: case VM_POP_ARGUMENT:
+            *index = R14;
+            *disp = 2 * instruction->arg;
+            return 0;
+        case VM_PUSH_POINTER: case VM_POP_POINTER:
+            *disp = 2 * (3 + instruction->arg);
+            return 1;
+        case VM_PUSH_TEMP: case VM_POP_TEMP:
+            *disp = 2 * (5 + instruction->arg);
+            return 1;
+        default: // static
+            *disp = 2 * instruction->arg;
+            return 1;
+    }
+}
+
+/** ----------------- Instructions ----------------- **/
+
+void compileBinary(VMOpcode opcode) {
+    JitSlot b = popSlot();
+    JitSlot a = popSlot();
+    if (a.isConstant && b.isConstant) {
+        int16_t x = a.value, y = b.value, result = 0;
+        switch (opcode) {
+            case VM_ADD: result = (int16_t)(x + y); break;
+            case VM_SUB: result = (int16_t)(x - y); break;
+            case VM_AND: result = x & y; break;
+            case VM_OR: result = x | y; break;
+            case VM_EQ: result = -(x == y); break;
+            case VM_GT: result = -(x > y); break;
+            default: result = -(x < y); break;
+        }
+        pushSlot((JitSlot){1, result});
+        return;
+    }
+
+    // op r/m32, r32 and the /digit of op r/m32, imm32, indexed like the opcodes add .. or
+    int registerOpcodes[9] = {0x01, 0x29, 0, 0x39, 0x39, 0x39, 0x21, 0x09, 0};
+    int immediateDigits[9] = {0, 5, 0, 7, 7, 7, 4, 1, 0};
+    int conditions[9] = {0, 0, 0, 0x94, 0x9F, 0x9C, 0, 0, 0}; // sete, setg, setl
+    int operation = opcode - VM_ADD;
+
+    a = slotToRegister(a);
+    if (b.isConstant) {
+        emitRegister(0, 0x81, immediateDigits[operation], a.value);
+        emit32(b.value);
+    }
+    else {
+        emitRegister(0, registerOpcodes[operation], b.value, a.value);
+        freeSlot(b);
+    }
+    if (opcode == VM_ADD || opcode == VM_SUB) {
+        emitRegister(0, 0x0FBF, a.value, a.value); // movsx reg, reg16 -- wrap to 16 bits
+    }
+    else if (conditions[operation]) {
+        emitRegister(0, 0x0F00 | conditions[operation], 0, RAX); // setcc al
+        emitRegister(0, 0x0FB6, RAX, RAX); // movzx eax, al
+        emitRegister(0, 0xF7, 3, RAX); // neg eax -- true is -1
+        emitRegister(0, 0x89, RAX, a.value); // mov reg, eax
+    }
+    pushSlot(a);
+}
+
+void compileUnary(VMOpcode opcode) {
+    JitSlot a = popSlot();
+    if (a.isConstant) {
+        pushSlot((JitSlot){1, opcode == VM_NEG ? (int16_t)-a.value : (int16_t)~a.value});
+        return;
+    }
+    emitRegister(0, 0xF7, opcode == VM_NEG ? 3 : 2, a.value); // neg / not
+    if (opcode == VM_NEG) {
+        emitRegister(0, 0x0FBF, a.value, a.value);
+    }
+    pushSlot(a);
+}
+
+void compileInstruction(int i, int exitHalt, int exitOverflow) {
+    VMInstruction *instruction = &vmInstructions[i];
+    int base, index, disp;
+    JitSlot slot;
+
+    switch (instruction->opcode) {
+        case VM_PUSH_CONSTANT:
+            pushSlot((JitSlot){1, instruction->arg});
+            break;
+        case VM_PUSH_LOCAL: case VM_PUSH_ARGUMENT: case VM_PUSH_THIS: case VM_PUSH_THAT:
+        case VM_PUSH_POINTER: case VM_PUSH_TEMP: case VM_PUSH_STATIC:
+            slot.isConstant = 0;
+            slot.value = allocateRegister();
+            segmentAddress(instruction, &base, &index, &disp);
+            emitMemory(0, 0, 0x0FBF, slot.value, base, index, disp); // movsx reg, word [address]
+            pushSlot(slot);
+            break;
+        case VM_POP_LOCAL: case VM_POP_ARGUMENT: case VM_POP_THIS: case VM_POP_THAT:
+        case VM_POP_POINTER: case VM_POP_TEMP: case VM_POP_STATIC:
+            slot = popSlot();
+            segmentAddress(instruction, &base, &index, &disp);
+            storeSlot(slot, base, index, disp);
+            freeSlot(slot);
+            break;
+        case VM_ADD: case VM_SUB: case VM_EQ: case VM_GT: case VM_LT: case VM_AND: case VM_OR:
+            compileBinary(instruction->opcode);
+            break;
+        case VM_NEG: case VM_NOT:
+            compileUnary(instruction->opcode);
+            break;
+        case VM_GOTO:
+            flushStack();
+            emitJump(0xE9, instruction->arg);
+            break;
+        case VM_IF_GOTO:
+            slot = popSlot();
+            flushStack();
+            if (slot.isConstant) {
+                if (slot.value != 0) {
+                    emitJump(0xE9, instruction->arg);
+                }
+                break;
+            }
+            emitRegister(0, 0x85, slot.value, slot.value); // test reg, reg
+            freeSlot(slot);
+            emitJump(0x0F85, instruction->arg); // jnz
+            break;
+        case VM_CALL:
+            flushStack();
+            // the frame of the hack vm (return address, lcl, arg, this, that), so the ram looks the same as when interpreted
+            emitMemory(1, 0, 0xC7, 0, RBX, R12, 0);
+            emit16(i + 1);
+            emitMemory(1, 0, 0x89, R13, RBX, R12, 2);
+            emitMemory(1, 0, 0x89, R14, RBX, R12, 4);
+            emitMemory(0, 0, 0x0FB7, RAX, RBX, NONE, 6);
+            emitMemory(1, 0, 0x89, RAX, RBX, R12, 6);
+            emitMemory(0, 0, 0x0FB7, RAX, RBX, NONE, 8);
+            emitMemory(1, 0, 0x89, RAX, RBX, R12, 8);
+            emitRegister(1, 0x81, 0, R12); // add r12, 5
+            emit32(5);
+            emitMemory(0, 1, 0x8D, R14, R12, NONE, -5 - instruction->extra); // lea r14, [r12 - 5 - args] -- no index, so no scaling
+            emitRegister(1, 0x89, R12, R13); // mov r13, r12
+            emitJump(0xE8, instruction->arg); // call -- the host stack keeps the return addresses
+            break;
+        case VM_CALL_BUILTIN:
+            flushStack();
+            emitMemory(1, 0, 0x89, R12, RBX, NONE, 0); // sp, lcl and arg for the OS
+            emitMemory(1, 0, 0x89, R13, RBX, NONE, 2);
+            emitMemory(1, 0, 0x89, R14, RBX, NONE, 4);
+            if (vmBuiltins[instruction->arg].args > 0) {
+                emitRegister(1, 0x81, 5, R12); // sub r12, args
+                emit32(vmBuiltins[instruction->arg].args);
+            }
+            emitMemory(0, 1, 0x8D, RDI, RBX, R12, 0); // lea rdi, [rbx + r12 * 2]
+            // align the host stack for the c call, keeping the old rsp on it
+            emitRegister(1, 0x89, RSP, RAX); // mov rax, rsp
+            emitRegister(1, 0x83, 4, RSP); // and rsp, -16
+            emitByte(0xF0);
+            emitRegister(1, 0x83, 5, RSP); // sub rsp, 16
+            emitByte(16);
+            emitMemory(0, 1, 0x89, RAX, RSP, NONE, 0); // mov [rsp], rax
+            emitByte(0x48); // mov rax, imm64
+            emitByte(0xB8);
+            {
+                void *function = (void *)vmBuiltins[instruction->arg].run;
+                memcpy(jitCode + jitLength, &function, 8);
+                jitLength += 8;
+            }
+            emitByte(0xFF); // call rax
+            emitByte(0xD0);
+            emitMemory(0, 1, 0x8B, RSP, RSP, NONE, 0); // mov rsp, [rsp]
+            slot.isConstant = 0;
+            slot.value = allocateRegister();
+            emitRegister(0, 0x0FBF, slot.value, RAX); // movsx reg, ax
+            pushSlot(slot);
+            emitByte(0x48); // mov rax, &vmHalted
+            emitByte(0xB8);
+            {
+                int *halted = &vmHalted;
+                memcpy(jitCode + jitLength, &halted, 8);
+                jitLength += 8;
+            }
+            emitByte(0x83); // cmp dword [rax], 0
+            emitByte(0x38);
+            emitByte(0x00);
+            emitJumpTo(0x0F85, exitHalt);
+            break;
+        case VM_FUNCTION:
+            emitMemory(0, 1, 0x8D, RAX, R12, NONE, instruction->arg + JIT_STACK_MARGIN); // lea rax, [r12 + locals + margin]
+            emitRegister(1, 0x81, 7, RAX); // cmp rax, ram size
+            emit32(VM_RAM_SIZE);
+            emitJumpTo(0x0F83, exitOverflow); // jae
+            for (int local = 0; local < instruction->arg; ++local) {
+                emitMemory(1, 0, 0xC7, 0, RBX, R12, 2 * local);
+                emit16(0);
+            }
+            if (instruction->arg > 0) {
+                emitRegister(1, 0x81, 0, R12);
+                emit32(instruction->arg);
+            }
+            break;
+        case VM_RETURN:
+            slot = popSlot();
+            dropStack();
+            storeSlot(slot, RBX, R14, 0); // ram[arg] = value
+            freeSlot(slot);
+            emitMemory(0, 1, 0x8D, R12, R14, NONE, 1); // lea r12, [r14 + 1]
+            emitMemory(0, 0, 0x0FB7, RAX, RBX, R13, -2); // that
+            emitMemory(1, 0, 0x89, RAX, RBX, NONE, 8);
+            emitMemory(0, 0, 0x0FB7, RAX, RBX, R13, -4); // this
+            emitMemory(1, 0, 0x89, RAX, RBX, NONE, 6);
+            emitMemory(0, 0, 0x0FB7, R14, RBX, R13, -6); // arg
+            emitMemory(0, 0, 0x0FB7, R13, RBX, R13, -8); // lcl, last as r13 is the frame
+            emitByte(0xC3); // ret
+            break;
+        default: // halt
+            flushStack();
+            emitJumpTo(0xE9, exitHalt);
+            break;
+    }
+}
+
+/** ----------------- Running ----------------- **/
+
+int RunJitProgram(long maxSteps) {
+    if (vmInstructions == NULL) {
+        return 0;
+    }
+    double compileStart = vmClock();
+
+    // basic blocks -- subroutine entries, jump targets and what follows a jump, call or return start one
+    int count = vmInstructionCount;
+    char *leader = calloc(count + 1, 1);
+    int *blockLength = calloc(count + 1, sizeof(int));
+    leader[0] = 1;
+    for (int i = 0; i < count; ++i) {
+        VMOpcode opcode = vmInstructions[i].opcode;
+        if (opcode == VM_FUNCTION) {
+            leader[i] = 1;
+        }
+        if (opcode == VM_GOTO || opcode == VM_IF_GOTO) {
+            leader[vmInstructions[i].arg] = 1;
+        }
+        if (opcode == VM_GOTO || opcode == VM_IF_GOTO || opcode == VM_CALL || opcode == VM_RETURN || opcode == VM_HALT) {
+            leader[i + 1] = 1;
+        }
+    }
+    for (int i = count - 1, length = 0; i >= 0; --i) {
+        length++;
+        if (leader[i]) {
+            blockLength[i] = length;
+            length = 0;
+        }
+    }
+
+    size_t size = (size_t)count * JIT_BYTES_PER_INSTRUCTION + 4096;
+    jitCode = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jitCode == MAP_FAILED) {
+        printf("JIT error: could not map a code buffer\n");
+        free(leader);
+        free(blockLength);
+        return 0;
+    }
+    jitLength = 0;
+    jitAddresses = malloc(count * sizeof(int));
+    jitPatches = malloc((count + 1) * sizeof(JitPatch));
+    jitPatchCount = 0;
+    jitDepth = 0;
+    memset(jitRegisterUsed, 0, sizeof jitRegisterUsed);
+
+    // exits -- eax holds the reason, r15 the budget left
+    int exit = jitLength;
+    emitMemory(1, 0, 0x89, R12, RBX, NONE, 0);
+    emitMemory(1, 0, 0x89, R13, RBX, NONE, 2);
+    emitMemory(1, 0, 0x89, R14, RBX, NONE, 4);
+    emitByte(0x48); // mov rdx, &jitRemaining
+    emitByte(0xBA);
+    {
+        long *remaining = &jitRemaining;
+        memcpy(jitCode + jitLength, &remaining, 8);
+        jitLength += 8;
+    }
+    emitMemory(0, 1, 0x89, R15, RDX, NONE, 0); // mov [rdx], r15
+    emitRegister(1, 0x89, RBP, RSP); // mov rsp, rbp
+    int saved[6] = {RBX, RBP, R12, R13, R14, R15};
+    for (int i = 5; i >= 0; --i) {
+        if (saved[i] >= R8) {
+            emitByte(0x41);
+        }
+        emitByte(0x58 + (saved[i] & 7)); // pop
+    }
+    emitByte(0xC3);
+    int exitHalt = jitLength;
+    emitMoveImmediate(RAX, JIT_HALT);
+    emitJumpTo(0xE9, exit);
+    int exitLimit = jitLength;
+    emitMoveImmediate(RAX, JIT_STEP_LIMIT);
+    emitJumpTo(0xE9, exit);
+    int exitOverflow = jitLength;
+    emitMoveImmediate(RAX, JIT_STACK_OVERFLOW);
+    emitJumpTo(0xE9, exit);
+
+    // entry -- int entry(int16_t *ram, long budget)
+    int entry = jitLength;
+    for (int i = 0; i < 6; ++i) {
+        if (saved[i] >= R8) {
+            emitByte(0x41);
+        }
+        emitByte(0x50 + (saved[i] & 7)); // push
+    }
+    emitRegister(1, 0x89, RSP, RBP); // mov rbp, rsp
+    emitRegister(1, 0x89, RDI, RBX); // mov rbx, rdi
+    emitRegister(1, 0x89, RSI, R15); // mov r15, rsi
+    emitMoveImmediate(R12, VM_STACK_BASE);
+    emitMoveImmediate(R13, VM_STACK_BASE);
+    emitMoveImmediate(R14, VM_STACK_BASE);
+
+    for (int i = 0; i < count; ++i) {
+        if (leader[i]) {
+            flushStack();
+            jitAddresses[i] = jitLength;
+            emitRegister(1, 0x81, 5, R15); // sub r15, block length
+            emit32(blockLength[i]);
+            emitJumpTo(0x0F8C, exitLimit); // jl
+        }
+        else {
+            jitAddresses[i] = jitLength;
+        }
+        compileInstruction(i, exitHalt, exitOverflow);
+    }
+    for (int i = 0; i < jitPatchCount; ++i) {
+        int rel = jitAddresses[jitPatches[i].target] - (jitPatches[i].position + 4);
+        memcpy(jitCode + jitPatches[i].position, &rel, 4);
+    }
+    free(leader);
+    free(blockLength);
+    free(jitAddresses);
+    free(jitPatches);
+    jitBytes = jitLength;
+
+    if (mprotect(jitCode, size, PROT_READ | PROT_EXEC) != 0) {
+        printf("JIT error: could not make the code buffer executable\n");
+        munmap(jitCode, size);
+        return 0;
+    }
+    jitCompileSeconds = vmClock() - compileStart;
+
+    BootOS();
+    long budget = maxSteps > 0 ? maxSteps : LONG_MAX;
+    int (*run)(int16_t *ram, long budget) = (int (*)(int16_t *, long))(jitCode + entry);
+    double start = vmClock();
+    int reason = run(vmRam, budget);
+    vmSeconds = vmClock() - start;
+    vmSteps = jitRemaining < 0 ? budget : budget - jitRemaining;
+    vmStepLimitReached = reason == JIT_STEP_LIMIT;
+    if (reason == JIT_STACK_OVERFLOW) {
+        printf("VM error: stack overflow\n");
+        vmStatus = 0;
+    }
+    fflush(stdout);
+    munmap(jitCode, size);
+    jitCode = NULL;
+    return vmStatus && reason == JIT_HALT;
+}
+
+#else
+
+int RunJitProgram(long maxSteps) {
+    printf("The JIT only targets x86-64, running on the interpreter instead.\n");
+    return RunVMProgram(maxSteps, 0);
+}
+
+#endif
+
+void PrintJitReport() {
+    printf("jit: %zu bytes of machine code in %.3f ms\n", jitBytes, jitCompileSeconds * 1000);
+}
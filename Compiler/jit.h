@@ -0,0 +1,11 @@
+#ifndef JIT_H
+#define JIT_H
+
+#define JIT_CACHE_SLOTS 8 // top of stack values kept in host registers within a basic block
+#define JIT_BYTES_PER_INSTRUCTION 256 // upper bound of the machine code for one vm instruction
+#define JIT_STACK_MARGIN 1024 // stack words a subroutine may use above its locals, checked at entry
+
+int RunJitProgram(long maxSteps); // compiles the loaded vm program to x86-64 and runs Main.main -- 1 if it ended normally
+void PrintJitReport(); // size and compile time of the machine code
+
+#endif
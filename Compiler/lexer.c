@@ -27,17 +27,18 @@ Date Work Commenced: 15.02.2021
 
 // YOU CAN ADD YOUR OWN FUNCTIONS, DECLARATIONS AND VARIABLES HERE
 
-// File reading related variables
-FILE * fp;
-char filename[512];
-char * code;
-int n = 0;
-int emptyFileFlag = 0;
+// File reading related variables (per thread, files are lexed concurrently)
+_Thread_local FILE * fp;
+_Thread_local char filename[512];
+_Thread_local char tokenFile[32]; // the name of the file without its directory, as it is put in tokens (Token.fl)
+_Thread_local char * code;
+_Thread_local int n = 0;
+_Thread_local int emptyFileFlag = 0;
 
 // Scanning and tokenising related variables
-int lineNumber = -1;
-int peekLineNumber = -1;
-int charCounter = 0;
+_Thread_local int lineNumber = -1;
+_Thread_local int peekLineNumber = -1;
+_Thread_local int charCounter = 0;
 
 // Terminal consts
 const char symbols[20] = "()[]{},;=.+-*/&|~<>";
@@ -68,21 +69,11 @@ const char keywords[22][20] = {
 
 // Util functions
 int checkFilename(char * file_name) {
-  // Check file format (.jack extension)
-  char extension[strlen(file_name)];
-  strcpy(extension, file_name);
-  extension[strlen(file_name)] = '\0';
-  int index = 0;
-  for (int i = 0; i < strlen(file_name); ++i) {
-    if (i > 0 && file_name[i] == '.') { // check extension
-      for (int j = i; j < strlen(file_name); ++j) {
-        extension[index++] = file_name[j];
-      }
-      extension[index] = 0;
-      break;
-    }
-  }
-  if (strcmp(extension, ".jack") == 0) { // has .jack extension
+  // Check file format (.jack extension) -- of the name after the directories, which may have dots of their own
+  char *name = strrchr(file_name, '/');
+  name = name == NULL ? file_name : name + 1;
+  char *extension = strrchr(name, '.');
+  if (extension != NULL && extension > name && strcmp(extension, ".jack") == 0) { // has .jack extension
     return 1;
   }
   return 0;
@@ -143,8 +134,9 @@ int InitLexer(char * file_name) {
     return 0;
   }
 
-  strcpy(filename, file_name);
-  filename[strlen(file_name)] = '\0';
+  snprintf(filename, sizeof filename, "%s", file_name);
+  char *name = strrchr(file_name, '/');
+  snprintf(tokenFile, sizeof tokenFile, "%s", name == NULL ? file_name : name + 1);
 
   // init line numbering and char array
   lineNumber = 1;
@@ -190,7 +182,7 @@ Token GetNextToken() {
     t.tp = EOFile;
     t.ln = lineNumber;
     strcpy(t.lx, "End of File\0");
-    strcpy(t.fl, filename);
+    strcpy(t.fl, tokenFile);
     
     charCounter = -1; // scanning complete
     return t;
@@ -250,7 +242,7 @@ Token GetNextToken() {
           t.ec = EofInCom;
           t.lx[strlen(t.lx)] = '\0';
           t.ln = lineNumber;
-          strcpy(t.fl, filename);
+          strcpy(t.fl, tokenFile);
           
           charCounter = i;
           return t;
@@ -279,7 +271,7 @@ Token GetNextToken() {
       // build token
       strcpy(t.lx, integer);
       t.lx[strlen(t.lx)] = '\0';
-      strcpy(t.fl, filename);
+      strcpy(t.fl, tokenFile);
       t.tp = INT;
       t.ln = lineNumber;
       
@@ -312,7 +304,7 @@ Token GetNextToken() {
       strcpy(t.lx, result);
       t.lx[strlen(t.lx)] = '\0';
       t.ln = lineNumber;
-      strcpy(t.fl, filename);
+      strcpy(t.fl, tokenFile);
       
       return t;
     }
@@ -328,7 +320,7 @@ Token GetNextToken() {
         t.ec = EofInStr;
         t.lx[strlen(t.lx)] = '\0';
         t.ln = lineNumber;
-        strcpy(t.fl, filename);
+        strcpy(t.fl, tokenFile);
         
         charCounter = i;
         return t;
@@ -345,7 +337,7 @@ Token GetNextToken() {
             t.ec = NewLnInStr;
             t.lx[strlen(t.lx)] = '\0';
             t.ln = lineNumber;
-            strcpy(t.fl, filename);          
+            strcpy(t.fl, tokenFile);          
             
             charCounter = i;
             return t;
@@ -355,7 +347,7 @@ Token GetNextToken() {
             t.ec = EofInStr;
             t.lx[strlen(t.lx)] = '\0';
             t.ln = lineNumber;
-            strcpy(t.fl, filename);
+            strcpy(t.fl, tokenFile);
             
             charCounter = i;
             return t;
@@ -379,7 +371,7 @@ Token GetNextToken() {
         t.tp = STRING;
         t.lx[strlen(t.lx)] = '\0';
         t.ln = lineNumber;
-        strcpy(t.fl, filename);
+        strcpy(t.fl, tokenFile);
         
         return t;
       }
@@ -394,7 +386,7 @@ Token GetNextToken() {
       strcpy(t.lx, symbolLxm);
       t.lx[strlen(t.lx)] = '\0';
       t.tp = SYMBOL;
-      strcpy(t.fl, filename);
+      strcpy(t.fl, tokenFile);
       t.ln = lineNumber;
       charCounter = i + 1;
       
@@ -407,7 +399,7 @@ Token GetNextToken() {
       strcpy(t.lx, "Error: illegal symbol in source file\0");
       t.tp = ERR;
       t.ec = IllSym;
-      strcpy(t.fl, filename);
+      strcpy(t.fl, tokenFile);
       t.ln = lineNumber;
       charCounter = i + 1;
       
@@ -420,7 +412,7 @@ Token GetNextToken() {
       t.tp = EOFile;
       t.ln = lineNumber;
       strcpy(t.lx, "End of File\0");
-      strcpy(t.fl, filename);
+      strcpy(t.fl, tokenFile);
       charCounter = i + 1; // scanning complete
       
       return t;
@@ -440,7 +432,7 @@ Token PeekNextToken() {
     t.tp = EOFile;
     t.ln = lineNumberLocal;
     strcpy(t.lx, "End of File\0");
-    strcpy(t.fl, filename);
+    strcpy(t.fl, tokenFile);
     
     return t;
   }
@@ -493,7 +485,7 @@ Token PeekNextToken() {
           t.ec = EofInCom;
           t.lx[strlen(t.lx)] = '\0';
           t.ln = lineNumberLocal;
-          strcpy(t.fl, filename);
+          strcpy(t.fl, tokenFile);
           
           return t;
         }   
@@ -519,7 +511,7 @@ Token PeekNextToken() {
       // build token
       strcpy(t.lx, integer);
       t.lx[strlen(t.lx)] = '\0';
-      strcpy(t.fl, filename);
+      strcpy(t.fl, tokenFile);
       t.tp = INT;
       t.ln = lineNumberLocal;
       
@@ -551,7 +543,7 @@ Token PeekNextToken() {
       strcpy(t.lx, result);
       t.lx[strlen(t.lx)] = '\0';
       t.ln = lineNumberLocal;
-      strcpy(t.fl, filename);
+      strcpy(t.fl, tokenFile);
       
       return t;
     }
@@ -567,7 +559,7 @@ Token PeekNextToken() {
         t.ec = EofInStr;
         t.lx[strlen(t.lx)] = '\0';
         t.ln = lineNumberLocal;
-        strcpy(t.fl, filename);
+        strcpy(t.fl, tokenFile);
         
         return t;
       } else { // build string
@@ -582,7 +574,7 @@ Token PeekNextToken() {
             t.ec = NewLnInStr;
             t.lx[strlen(t.lx)] = '\0';
             t.ln = lineNumberLocal;
-            strcpy(t.fl, filename);          
+            strcpy(t.fl, tokenFile);          
             
             return t;
           } else if (code[i] == '\0' || i == n) {
@@ -591,7 +583,7 @@ Token PeekNextToken() {
             t.ec = EofInStr;
             t.lx[strlen(t.lx)] = '\0';
             t.ln = lineNumberLocal;
-            strcpy(t.fl, filename);
+            strcpy(t.fl, tokenFile);
             
             return t;
           }
@@ -613,7 +605,7 @@ Token PeekNextToken() {
         t.tp = STRING;
         t.lx[strlen(t.lx)] = '\0';
         t.ln = lineNumberLocal;
-        strcpy(t.fl, filename);
+        strcpy(t.fl, tokenFile);
         
         return t;
       }
@@ -627,7 +619,7 @@ Token PeekNextToken() {
       symbolLxm[1] = '\0';
       strcpy(t.lx, symbolLxm);
       t.tp = SYMBOL;
-      strcpy(t.fl, filename);
+      strcpy(t.fl, tokenFile);
       t.ln = lineNumberLocal;
       
       return t;
@@ -639,7 +631,7 @@ Token PeekNextToken() {
       strcpy(t.lx, "error: illegal symbol in source file\0");
       t.tp = ERR;
       t.ec = IllSym;
-      strcpy(t.fl, filename);
+      strcpy(t.fl, tokenFile);
       t.ln = lineNumberLocal;
       
       return t;
@@ -651,7 +643,7 @@ Token PeekNextToken() {
       t.tp = EOFile;
       t.ln = lineNumberLocal;
       strcpy(t.lx, "End of File\0");
-      strcpy(t.fl, filename);
+      strcpy(t.fl, tokenFile);
       
       return t;
     }
@@ -0,0 +1,333 @@
+/************************************************************************
+University of Leeds
+School of Computing
+COMP2932- Compiler Design and Construction
+The Manifest Module
+
+Incremental builds (-incremental): the build manifest (code.manifest, in
+the -o directory or else in the project directory, as code.vm is shared by
+every project built from the same directory) keeps, for every source file
+of the last build,
+- the hash of its source,
+- its symbol tables (pass 1) and its vm code (pass 3),
+- the classes declaring the names its semantic checks found outside the
+  file (pass 2), with the hash of the interface of each class at the
+  time: its subroutines (names, kinds, arities) and its field and static
+  layout.
+A file whose source did not change is not parsed again. It is only checked
+and compiled again (passes 2 and 3) if the interface of a class it depends
+on changed. The code of a file does not depend on other classes, the
+whole program passes are run on every build. The manifest is only used by
+a build with the same optimisation passes. The daemon (daemon.c) keeps the
+manifest of every project it builds in memory instead, -incremental or not.
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include "manifest.h"
+#include "optimiser.h"
+
+extern SymbolTable programTables[MAX_SYMBOL_TABLES]; // from parser.c
+extern int programTableCount; // from parser.c
+extern OptimiserPass passes[]; // from optimiser.c
+extern int passesCount; // from optimiser.c
+double vmClock(); // from vm.c
+
+#define MANIFEST_TABLE_HEADER (sizeof(SymbolTable) - offsetof(SymbolTable, count)) // a table is written without its unused symbols
+
+int manifestFiles; // files of the last build
+int manifestReused; // files not parsed again
+int manifestDependents; // unchanged files checked and compiled again for a changed dependency
+double manifestLoadSeconds;
+double manifestSaveSeconds;
+
+// 64-bit FNV-1a, continuing from hash
+unsigned long hashBytes(unsigned long hash, void *data, size_t length) {
+	unsigned char *bytes = data;
+	for (size_t i = 0; i < length; ++i) {
+		hash = (hash ^ bytes[i]) * 1099511628211UL;
+	}
+	return hash;
+}
+
+#define HASH_START 14695981039346656037UL
+
+unsigned long hashString(unsigned long hash, char *string) {
+	return hashBytes(hash, string, strlen(string) + 1);
+}
+
+unsigned long hashFile(char *path) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return 0;
+	}
+	unsigned long hash = HASH_START;
+	char buffer[65536];
+	size_t length;
+	while ((length = fread(buffer, 1, sizeof buffer, fp)) > 0) {
+		hash = hashBytes(hash, buffer, length);
+	}
+	fclose(fp);
+	return hash;
+}
+
+// the interface of a class as the other files see it, from the program's tables (after pass 1)
+unsigned long interfaceHash(char *className) {
+	unsigned long hash = hashString(HASH_START, className);
+	for (int i = 1; i <= programTableCount; ++i) {
+		SymbolTable *table = &programTables[i];
+		if (strcmp(table->className, className) == 0) { // fields and statics
+			for (int j = 0; j < table->count; ++j) {
+				hash = hashString(hash, table->symbols[j].name);
+				hash = hashString(hash, table->symbols[j].type);
+				hash = hashBytes(hash, &table->symbols[j].kind, sizeof table->symbols[j].kind);
+				hash = hashBytes(hash, &table->symbols[j].offset, sizeof table->symbols[j].offset);
+			}
+		}
+		else if (strlen(table->functionName) && strcmp(table->parentClass, className) == 0) { // subroutines
+			hash = hashString(hash, table->functionName);
+			hash = hashBytes(hash, &table->isMethod, sizeof table->isMethod);
+			for (int j = 0; j < table->count; ++j) {
+				if (table->symbols[j].kind == ARGUMENT) {
+					hash = hashString(hash, table->symbols[j].type);
+				}
+			}
+		}
+	}
+	return hash;
+}
+
+// the optimisation passes of the build, a manifest written with others is not used
+void buildOptions(char *options) {
+	strcpy(options, "");
+	for (int i = 0; i < passesCount; ++i) {
+		if (PassEnabled(passes[i].name)) {
+			strcat(options, passes[i].name);
+			strcat(options, " ");
+		}
+	}
+}
+
+int writeString(FILE *fp, char *string) {
+	int length = strlen(string);
+	return fwrite(&length, sizeof length, 1, fp) == 1 && fwrite(string, 1, length, fp) == (size_t)length;
+}
+
+// reads a string written by writeString, 0 if it does not fit in capacity bytes
+int readString(FILE *fp, char *string, int capacity) {
+	int length;
+	if (fread(&length, sizeof length, 1, fp) != 1 || length < 0 || length >= capacity || fread(string, 1, length, fp) != (size_t)length) {
+		return 0;
+	}
+	string[length] = '\0';
+	return 1;
+}
+
+// reads the tables, dependencies and code of a file into context, or skips them if context is NULL -- 0 if the
+// manifest is cut short
+int readManifestFile(FILE *fp, ParserContext *context) {
+	static SymbolTable skipped;
+	int tableCount;
+	if (fread(&tableCount, sizeof tableCount, 1, fp) != 1 || tableCount < 0 || tableCount >= MAX_SYMBOL_TABLES) {
+		return 0;
+	}
+	if (context) {
+		context->tableCapacity = tableCount + 1;
+		context->tables = calloc(context->tableCapacity, sizeof(SymbolTable));
+		context->tableCount = tableCount;
+	}
+	for (int i = 1; i <= tableCount; ++i) {
+		SymbolTable *table = context ? &context->tables[i] : &skipped;
+		if (fread(&table->count, MANIFEST_TABLE_HEADER, 1, fp) != 1 || table->count < 0 || table->count > (int)(sizeof table->symbols / sizeof table->symbols[0])
+			|| fread(table->symbols, sizeof(Symbol), table->count, fp) != (size_t)table->count) {
+			return 0;
+		}
+	}
+
+	int dependencyCount;
+	if (fread(&dependencyCount, sizeof dependencyCount, 1, fp) != 1 || dependencyCount < 0 || dependencyCount >= MAX_SYMBOL_TABLES) {
+		return 0;
+	}
+	ClassDependency *dependencies = malloc((dependencyCount + 1) * sizeof(ClassDependency));
+	if (fread(dependencies, sizeof(ClassDependency), dependencyCount, fp) != (size_t)dependencyCount) {
+		free(dependencies);
+		return 0;
+	}
+	char pooledClass[128];
+	int pooledStrings, codeLength;
+	if (!readString(fp, pooledClass, sizeof pooledClass) || fread(&pooledStrings, sizeof pooledStrings, 1, fp) != 1 || pooledStrings < 0
+		|| fread(&codeLength, sizeof codeLength, 1, fp) != 1 || codeLength < 0) {
+		free(dependencies);
+		return 0;
+	}
+	char *code = malloc(codeLength + 1);
+	if (fread(code, 1, codeLength, fp) != (size_t)codeLength) {
+		free(dependencies);
+		free(code);
+		return 0;
+	}
+	code[codeLength] = '\0';
+
+	if (context == NULL) {
+		free(dependencies);
+		free(code);
+		return 1;
+	}
+	context->dependencies = dependencies;
+	context->dependencyCount = dependencyCount;
+	context->dependencyCapacity = dependencyCount + 1;
+	strcpy(context->pooledClass, pooledClass);
+	context->pooledStrings = pooledStrings;
+	context->code = code;
+	context->codeLength = codeLength;
+	context->codeCapacity = codeLength + 1;
+	return 1;
+}
+
+int LoadBuildManifest(FILE *fp, SourceFile *files, int count) {
+	double start = vmClock();
+	manifestFiles = count;
+	manifestReused = 0;
+	manifestDependents = 0;
+	char (*paths)[PATH_MAX] = malloc(count * sizeof *paths);
+	for (int i = 0; i < count; ++i) {
+		files[i].contentHash = hashFile(files[i].path);
+		if (realpath(files[i].path, paths[i]) == NULL) {
+			strcpy(paths[i], "");
+		}
+	}
+
+	char magic[4];
+	int version;
+	char options[1024], manifestOptions[1024];
+	buildOptions(options);
+	int manifestCount;
+	if (fp == NULL || fread(magic, 1, 4, fp) != 4 || memcmp(magic, "JMAN", 4) != 0 || fread(&version, sizeof version, 1, fp) != 1
+		|| version != MANIFEST_VERSION || !readString(fp, manifestOptions, sizeof manifestOptions) || strcmp(options, manifestOptions) != 0
+		|| fread(&manifestCount, sizeof manifestCount, 1, fp) != 1) {
+		if (fp) {
+			fclose(fp);
+		}
+		free(paths);
+		manifestLoadSeconds = vmClock() - start;
+		return 0;
+	}
+
+	for (int entry = 0; entry < manifestCount; ++entry) {
+		char path[PATH_MAX];
+		unsigned long contentHash;
+		if (!readString(fp, path, sizeof path) || fread(&contentHash, sizeof contentHash, 1, fp) != 1) {
+			break;
+		}
+		SourceFile *file = NULL;
+		for (int i = 0; i < count; ++i) {
+			if (files[i].reused == 0 && files[i].contentHash == contentHash && strcmp(paths[i], path) == 0) {
+				file = &files[i];
+				break;
+			}
+		}
+		if (file) {
+			FreeParserContext(&file->context);
+		}
+		if (!readManifestFile(fp, file ? &file->context : NULL)) { // the manifest was cut short, the file is compiled
+			if (file) {
+				FreeParserContext(&file->context);
+			}
+			break;
+		}
+		if (file) {
+			file->reused = 3;
+			manifestReused++;
+		}
+	}
+	fclose(fp);
+	free(paths);
+	manifestLoadSeconds = vmClock() - start;
+	return manifestReused;
+}
+
+void CheckBuildDependencies(SourceFile *files, int count) {
+	int pooledStrings = 0; // static words taken by the literals of the kept files
+	for (int i = 0; i < count; ++i) {
+		ParserContext *context = &files[i].context;
+		for (int j = 0; files[i].reused == 3 && j < context->dependencyCount; ++j) {
+			if (interfaceHash(context->dependencies[j].className) != context->dependencies[j].interfaceHash) {
+				files[i].reused = 1;
+				manifestReused--;
+				manifestDependents++;
+			}
+		}
+		if (files[i].reused == 3) {
+			pooledStrings += context->pooledStrings;
+		}
+	}
+
+	// the statics declared since (or a removed Main.main) may leave too few words for the literals pooled then -- the
+	// kept files which pooled some are compiled again, to share the words out as a full build does
+	for (int i = 0; pooledStrings > StringStaticWords() && i < count; ++i) {
+		if (files[i].reused == 3 && files[i].context.pooledStrings > 0) {
+			files[i].reused = 1;
+			manifestReused--;
+			manifestDependents++;
+		}
+	}
+}
+
+int WriteBuildManifest(FILE *fp, SourceFile *files, int count) {
+	double start = vmClock();
+	char options[1024];
+	buildOptions(options);
+	int version = MANIFEST_VERSION;
+	int ok = fwrite("JMAN", 1, 4, fp) == 4 && fwrite(&version, sizeof version, 1, fp) == 1 && writeString(fp, options)
+		&& fwrite(&count, sizeof count, 1, fp) == 1;
+	for (int i = 0; ok && i < count; ++i) {
+		ParserContext *context = &files[i].context;
+		char path[PATH_MAX];
+		if (realpath(files[i].path, path) == NULL) {
+			strcpy(path, "");
+		}
+		for (int j = 0; j < context->dependencyCount; ++j) {
+			context->dependencies[j].interfaceHash = interfaceHash(context->dependencies[j].className);
+		}
+		ok = writeString(fp, path) && fwrite(&files[i].contentHash, sizeof files[i].contentHash, 1, fp) == 1
+			&& fwrite(&context->tableCount, sizeof context->tableCount, 1, fp) == 1;
+		for (int j = 1; ok && j <= context->tableCount; ++j) {
+			SymbolTable *table = &context->tables[j];
+			ok = fwrite(&table->count, MANIFEST_TABLE_HEADER, 1, fp) == 1 && fwrite(table->symbols, sizeof(Symbol), table->count, fp) == (size_t)table->count;
+		}
+		ok = ok && fwrite(&context->dependencyCount, sizeof context->dependencyCount, 1, fp) == 1
+			&& fwrite(context->dependencies, sizeof(ClassDependency), context->dependencyCount, fp) == (size_t)context->dependencyCount
+			&& writeString(fp, context->pooledClass) && fwrite(&context->pooledStrings, sizeof context->pooledStrings, 1, fp) == 1
+			&& fwrite(&context->codeLength, sizeof context->codeLength, 1, fp) == 1
+			&& fwrite(context->code, 1, context->codeLength, fp) == (size_t)context->codeLength;
+	}
+	manifestSaveSeconds = vmClock() - start;
+	return ok;
+}
+
+int SaveBuildManifest(char *filename, SourceFile *files, int count) {
+	char temporary[PATH_MAX];
+	snprintf(temporary, sizeof temporary, "%s.tmp", filename);
+	FILE *fp = fopen(temporary, "wb");
+	if (fp == NULL) {
+		printf("Could not write the build manifest %s.\n", filename);
+		return 0;
+	}
+	int ok = WriteBuildManifest(fp, files, count);
+	if (fclose(fp) != 0 || !ok || rename(temporary, filename) != 0) { // written whole or not at all
+		printf("Could not write the build manifest %s.\n", filename);
+		remove(temporary);
+		return 0;
+	}
+	return 1;
+}
+
+void PrintManifestReport() {
+	printf("manifest: %d files, %d reused, %d compiled again for a changed dependency, %d changed (load %.1f ms, save %.1f ms)\n",
+		manifestFiles, manifestReused, manifestDependents, manifestFiles - manifestReused - manifestDependents,
+		manifestLoadSeconds * 1000, manifestSaveSeconds * 1000);
+}
@@ -0,0 +1,16 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdio.h>
+
+#include "compiler.h"
+
+#define MANIFEST_VERSION 2 // of the build manifest layout -- bump when it or SymbolTable changes
+
+int LoadBuildManifest(FILE *fp, SourceFile *files, int count); // gives the files unchanged since the last build their tables, code and dependencies (reused = 3) from the manifest read from fp (closed, NULL for none), returns how many
+void CheckBuildDependencies(SourceFile *files, int count); // after pass 1: the reused files depending on a class whose interface changed are checked and compiled again (reused = 1), as are the ones whose pooled literals no longer fit
+int WriteBuildManifest(FILE *fp, SourceFile *files, int count); // writes what the build gave for every file to fp, returns 0 if it cannot
+int SaveBuildManifest(char *filename, SourceFile *files, int count); // writes the manifest to filename, whole or not at all -- returns 0 if it cannot
+void PrintManifestReport(); // files reused and compiled again, load and save times
+
+#endif
@@ -0,0 +1,513 @@
+/************************************************************************
+University of Leeds
+School of Computing
+COMP2932- Compiler Design and Construction
+The Native Module
+
+Translates the instructions loaded by the vm module ahead of time to x86-64
+gnu assembly (intel syntax), to be linked with Runtime/runtime.c and the
+OS in os.c into a standalone executable:
+    gcc -O2 -o program code.s Runtime/runtime.c os.c
+The code follows the JIT: the hack ram and frames are kept as when
+interpreted and within a basic block the top of the vm stack is cached in
+host registers (constants are folded). There is no step budget.
+Registers: rbx ram, r12 sp, r13 lcl, r14 arg, rbp host stack on entry;
+rcx, rdx, rsi, rdi and r8..r11 hold stack values.
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdarg.h>
+
+#include "vm.h"
+#include "native.h"
+
+extern VMInstruction *vmInstructions; // from vm.c
+extern int vmInstructionCount; // from vm.c
+extern VMBuiltin vmBuiltins[]; // from os.c
+char *functionName(int function); // from vm.c
+double vmClock(); // from vm.c
+
+enum {RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15, NONE = -1};
+
+char *registers64[16] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+char *registers32[16] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+char *registers16[16] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+    "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"};
+
+// a cached stack value -- a constant or a host register
+typedef struct {
+    int isConstant;
+    int value; // the constant or the register
+} NativeSlot;
+
+FILE *nativeFile;
+long nativeLines; // assembly instructions written by the last translation
+double nativeSeconds;
+
+NativeSlot nativeStack[NATIVE_CACHE_SLOTS]; // cached values above the ram stack pointer, bottom first
+int nativeDepth;
+int nativeRegisterUsed[16];
+int nativePool[8] = {RCX, RDX, RSI, RDI, R8, R9, R10, R11};
+
+void emit(char *format, ...);
+char *memory(char *operand, int base, int index, int disp); // formats [base + index * 2 + disp]
+
+int allocateNativeRegister();
+void freeNativeSlot(NativeSlot slot);
+void flushNativeStack(); // writes the cached values to the ram stack
+void dropNativeStack(); // forgets the cached values
+void pushNativeSlot(NativeSlot slot);
+NativeSlot popNativeSlot();
+NativeSlot nativeSlotToRegister(NativeSlot slot);
+void storeNativeSlot(NativeSlot slot, int base, int index, int disp); // mov word ptr [base + index * 2 + disp], slot
+void nativeSegmentAddress(VMInstruction *instruction, int *base, int *index, int *disp);
+
+void translateBinary(VMOpcode opcode);
+void translateUnary(VMOpcode opcode);
+void translateMultiply(); // Math.multiply, inlined
+void translateInstruction(int i);
+
+/** ----------------- Assembly Output ----------------- **/
+
+void emit(char *format, ...) {
+    va_list list;
+    va_start(list, format);
+    fprintf(nativeFile, "\t");
+    vfprintf(nativeFile, format, list);
+    fprintf(nativeFile, "\n");
+    va_end(list);
+    nativeLines++;
+}
+
+char *memory(char *operand, int base, int index, int disp) {
+    int length = sprintf(operand, "[%s", registers64[base]);
+    if (index != NONE) {
+        length += sprintf(operand + length, " + %s * 2", registers64[index]);
+    }
+    if (disp != 0) {
+        length += sprintf(operand + length, " %c %d", disp < 0 ? '-' : '+', abs(disp));
+    }
+    sprintf(operand + length, "]");
+    return operand;
+}
+
+/** ----------------- Stack Cache ----------------- **/
+
+int allocateNativeRegister() {
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < 8; ++i) {
+            if (!nativeRegisterUsed[nativePool[i]]) {
+                nativeRegisterUsed[nativePool[i]] = 1;
+                return nativePool[i];
+            }
+        }
+        flushNativeStack();
+    }
+    return RAX; // not reached -- at most two popped values are held outside the cache
+}
+
+void freeNativeSlot(NativeSlot slot) {
+    if (!slot.isConstant) {
+        nativeRegisterUsed[slot.value] = 0;
+    }
+}
+
+void flushNativeStack() {
+    for (int i = 0; i < nativeDepth; ++i) {
+        storeNativeSlot(nativeStack[i], RBX, R12, 2 * i);
+        freeNativeSlot(nativeStack[i]);
+    }
+    if (nativeDepth > 0) {
+        emit("add r12, %d", nativeDepth);
+    }
+    nativeDepth = 0;
+}
+
+void dropNativeStack() {
+    for (int i = 0; i < nativeDepth; ++i) {
+        freeNativeSlot(nativeStack[i]);
+    }
+    nativeDepth = 0;
+}
+
+void pushNativeSlot(NativeSlot slot) {
+    if (nativeDepth == NATIVE_CACHE_SLOTS) { // the new value is not in the cache yet, so its register is kept
+        flushNativeStack();
+    }
+    nativeStack[nativeDepth++] = slot;
+}
+
+NativeSlot popNativeSlot() {
+    if (nativeDepth > 0) {
+        return nativeStack[--nativeDepth];
+    }
+    char operand[64];
+    emit("sub r12, 1");
+    NativeSlot slot = {0, allocateNativeRegister()};
+    emit("movsx %s, word ptr %s", registers32[slot.value], memory(operand, RBX, R12, 0));
+    return slot;
+}
+
+NativeSlot nativeSlotToRegister(NativeSlot slot) {
+    if (!slot.isConstant) {
+        return slot;
+    }
+    NativeSlot registerSlot = {0, allocateNativeRegister()};
+    emit("mov %s, %d", registers32[registerSlot.value], slot.value);
+    return registerSlot;
+}
+
+void storeNativeSlot(NativeSlot slot, int base, int index, int disp) {
+    char operand[64];
+    if (slot.isConstant) {
+        emit("mov word ptr %s, %d", memory(operand, base, index, disp), slot.value);
+    }
+    else {
+        emit("mov word ptr %s, %s", memory(operand, base, index, disp), registers16[slot.value]);
+    }
+}
+
+// leaves the address in rax for this / that
+void nativeSegmentAddress(VMInstruction *instruction, int *base, int *index, int *disp) {
+    char operand[64];
+    *base = RBX;
+    *index = NONE;
+    switch (instruction->opcode) {
+        case VM_PUSH_THIS: case VM_POP_THIS:
+        case VM_PUSH_THAT: case VM_POP_THAT: {
+            int pointer = (instruction->opcode == VM_PUSH_THIS || instruction->opcode == VM_POP_THIS) ? 6 : 8;
+            emit("movzx eax, word ptr %s", memory(operand, RBX, NONE, pointer));
+            if (instruction->arg != 0) {
+                emit("add eax, %d", instruction->arg);
+                emit("movzx eax, ax"); // addresses wrap at 16 bits
+            }
+            *index = RAX;
+            *disp = 0;
+            break;
+        }
+        case VM_PUSH_LOCAL: case VM_POP_LOCAL:
+            *index = R13;
+            *disp = 2 * instruction->arg;
+            break;
+        case VM_PUSH_ARGUMENT: case VM_POP_ARGUMENT:
+            *index = R14;
+            *disp = 2 * instruction->arg;
+            break;
+        case VM_PUSH_POINTER: case VM_POP_POINTER:
+            *disp = 2 * (3 + instruction->arg);
+            break;
+        case VM_PUSH_TEMP: case VM_POP_TEMP:
+            *disp = 2 * (5 + instruction->arg);
+            break;
+        default: // static
+            *disp = 2 * instruction->arg;
+            break;
+    }
+}
+
+/** ----------------- Instructions ----------------- **/
+
+void translateBinary(VMOpcode opcode) {
+    NativeSlot b = popNativeSlot();
+    NativeSlot a = popNativeSlot();
+    if (a.isConstant && b.isConstant) {
+        int16_t x = a.value, y = b.value, result = 0;
+        switch (opcode) {
+            case VM_ADD: result = (int16_t)(x + y); break;
+            case VM_SUB: result = (int16_t)(x - y); break;
+            case VM_AND: result = x & y; break;
+            case VM_OR: result = x | y; break;
+            case VM_EQ: result = -(x == y); break;
+            case VM_GT: result = -(x > y); break;
+            default: result = -(x < y); break;
+        }
+        pushNativeSlot((NativeSlot){1, result});
+        return;
+    }
+
+    // indexed like the opcodes add .. or
+    char *mnemonics[9] = {"add", "sub", "", "cmp", "cmp", "cmp", "and", "or", ""};
+    char *conditions[9] = {"", "", "", "sete", "setg", "setl", "", "", ""};
+    int operation = opcode - VM_ADD;
+
+    a = nativeSlotToRegister(a);
+    if (b.isConstant) {
+        emit("%s %s, %d", mnemonics[operation], registers32[a.value], b.value);
+    }
+    else {
+        emit("%s %s, %s", mnemonics[operation], registers32[a.value], registers32[b.value]);
+        freeNativeSlot(b);
+    }
+    if (opcode == VM_ADD || opcode == VM_SUB) {
+        emit("movsx %s, %s", registers32[a.value], registers16[a.value]); // wrap to 16 bits
+    }
+    else if (conditions[operation][0]) {
+        emit("%s al", conditions[operation]);
+        emit("movzx eax, al");
+        emit("neg eax"); // true is -1
+        emit("mov %s, eax", registers32[a.value]);
+    }
+    pushNativeSlot(a);
+}
+
+void translateUnary(VMOpcode opcode) {
+    NativeSlot a = popNativeSlot();
+    if (a.isConstant) {
+        pushNativeSlot((NativeSlot){1, opcode == VM_NEG ? (int16_t)-a.value : (int16_t)~a.value});
+        return;
+    }
+    emit("%s %s", opcode == VM_NEG ? "neg" : "not", registers32[a.value]);
+    if (opcode == VM_NEG) {
+        emit("movsx %s, %s", registers32[a.value], registers16[a.value]);
+    }
+    pushNativeSlot(a);
+}
+
+void translateMultiply() {
+    NativeSlot b = popNativeSlot();
+    NativeSlot a = popNativeSlot();
+    if (a.isConstant && b.isConstant) {
+        pushNativeSlot((NativeSlot){1, (int16_t)(a.value * b.value)});
+        return;
+    }
+    a = nativeSlotToRegister(a);
+    if (b.isConstant) {
+        emit("imul %s, %s, %d", registers32[a.value], registers32[a.value], b.value);
+    }
+    else {
+        emit("imul %s, %s", registers32[a.value], registers32[b.value]);
+        freeNativeSlot(b);
+    }
+    emit("movsx %s, %s", registers32[a.value], registers16[a.value]);
+    pushNativeSlot(a);
+}
+
+void translateInstruction(int i) {
+    VMInstruction *instruction = &vmInstructions[i];
+    char operand[64];
+    int base, index, disp;
+    NativeSlot slot;
+
+    switch (instruction->opcode) {
+        case VM_PUSH_CONSTANT:
+            pushNativeSlot((NativeSlot){1, instruction->arg});
+            break;
+        case VM_PUSH_LOCAL: case VM_PUSH_ARGUMENT: case VM_PUSH_THIS: case VM_PUSH_THAT:
+        case VM_PUSH_POINTER: case VM_PUSH_TEMP: case VM_PUSH_STATIC:
+            slot.isConstant = 0;
+            slot.value = allocateNativeRegister();
+            nativeSegmentAddress(instruction, &base, &index, &disp);
+            emit("movsx %s, word ptr %s", registers32[slot.value], memory(operand, base, index, disp));
+            pushNativeSlot(slot);
+            break;
+        case VM_POP_LOCAL: case VM_POP_ARGUMENT: case VM_POP_THIS: case VM_POP_THAT:
+        case VM_POP_POINTER: case VM_POP_TEMP: case VM_POP_STATIC:
+            slot = popNativeSlot();
+            nativeSegmentAddress(instruction, &base, &index, &disp);
+            storeNativeSlot(slot, base, index, disp);
+            freeNativeSlot(slot);
+            break;
+        case VM_ADD: case VM_SUB: case VM_EQ: case VM_GT: case VM_LT: case VM_AND: case VM_OR:
+            translateBinary(instruction->opcode);
+            break;
+        case VM_NEG: case VM_NOT:
+            translateUnary(instruction->opcode);
+            break;
+        case VM_GOTO:
+            flushNativeStack();
+            emit("jmp .L%d", instruction->arg);
+            break;
+        case VM_IF_GOTO:
+            slot = popNativeSlot();
+            flushNativeStack();
+            if (slot.isConstant) {
+                if (slot.value != 0) {
+                    emit("jmp .L%d", instruction->arg);
+                }
+                break;
+            }
+            emit("test %s, %s", registers32[slot.value], registers32[slot.value]);
+            freeNativeSlot(slot);
+            emit("jnz .L%d", instruction->arg);
+            break;
+        case VM_CALL:
+            flushNativeStack();
+            // the frame of the hack vm (return address, lcl, arg, this, that), so the ram looks the same as when interpreted
+            emit("mov word ptr %s, %d", memory(operand, RBX, R12, 0), i + 1);
+            emit("mov word ptr %s, r13w", memory(operand, RBX, R12, 2));
+            emit("mov word ptr %s, r14w", memory(operand, RBX, R12, 4));
+            emit("movzx eax, word ptr [rbx + 6]");
+            emit("mov word ptr %s, ax", memory(operand, RBX, R12, 6));
+            emit("movzx eax, word ptr [rbx + 8]");
+            emit("mov word ptr %s, ax", memory(operand, RBX, R12, 8));
+            emit("add r12, 5");
+            emit("lea r14, [r12 - %d]", 5 + instruction->extra);
+            emit("mov r13, r12");
+            emit("call .L%d", instruction->arg); // the host stack keeps the return addresses
+            break;
+        case VM_CALL_BUILTIN:
+            if (strcmp(vmBuiltins[instruction->arg].name, "Math.multiply") == 0) {
+                translateMultiply();
+                break;
+            }
+            flushNativeStack();
+            emit("mov word ptr [rbx], r12w"); // sp, lcl and arg for the OS
+            emit("mov word ptr [rbx + 2], r13w");
+            emit("mov word ptr [rbx + 4], r14w");
+            if (vmBuiltins[instruction->arg].args > 0) {
+                emit("sub r12, %d", vmBuiltins[instruction->arg].args);
+            }
+            emit("lea rdi, [rbx + r12 * 2]");
+            // align the host stack for the c call, keeping the old rsp on it
+            emit("mov rax, rsp");
+            emit("and rsp, -16");
+            emit("sub rsp, 16");
+            emit("mov qword ptr [rsp], rax");
+            // the runtime links the same os.c, so the table has the same layout as here
+            emit("call qword ptr [rip + vmBuiltins + %d] # %s", (int)(instruction->arg * sizeof(VMBuiltin) + offsetof(VMBuiltin, run)),
+                vmBuiltins[instruction->arg].name);
+            emit("mov rsp, qword ptr [rsp]");
+            slot.isConstant = 0;
+            slot.value = allocateNativeRegister();
+            emit("movsx %s, ax", registers32[slot.value]);
+            pushNativeSlot(slot);
+            emit("cmp dword ptr [rip + vmHalted], 0");
+            emit("jne jack_halt");
+            break;
+        case VM_FUNCTION:
+            emit("lea rax, [r12 + %d]", instruction->arg + NATIVE_STACK_MARGIN);
+            emit("cmp rax, %d", VM_RAM_SIZE);
+            emit("jae jack_overflow");
+            for (int local = 0; local < instruction->arg; ++local) {
+                emit("mov word ptr %s, 0", memory(operand, RBX, R12, 2 * local));
+            }
+            if (instruction->arg > 0) {
+                emit("add r12, %d", instruction->arg);
+            }
+            break;
+        case VM_RETURN:
+            slot = popNativeSlot();
+            dropNativeStack();
+            storeNativeSlot(slot, RBX, R14, 0); // ram[arg] = value
+            freeNativeSlot(slot);
+            emit("lea r12, [r14 + 1]");
+            emit("movzx eax, word ptr [rbx + r13 * 2 - 2]"); // that
+            emit("mov word ptr [rbx + 8], ax");
+            emit("movzx eax, word ptr [rbx + r13 * 2 - 4]"); // this
+            emit("mov word ptr [rbx + 6], ax");
+            emit("movzx r14d, word ptr [rbx + r13 * 2 - 6]"); // arg
+            emit("movzx r13d, word ptr [rbx + r13 * 2 - 8]"); // lcl, last as r13 is the frame
+            emit("ret");
+            break;
+        default: // halt
+            flushNativeStack();
+            emit("jmp jack_halt");
+            break;
+    }
+}
+
+/** ----------------- Output ----------------- **/
+
+int OutputNativeProgram(char *filename) {
+    if (vmInstructions == NULL) {
+        return 0;
+    }
+    nativeFile = fopen(filename, "wb");
+    if (nativeFile == NULL) {
+        printf("Could not process native code output file.\n");
+        return 0;
+    }
+    double start = vmClock();
+
+    // basic blocks -- subroutine entries, jump targets and what follows a jump, call or return start one
+    int count = vmInstructionCount;
+    char *leader = calloc(count + 1, 1);
+    leader[0] = 1;
+    for (int i = 0; i < count; ++i) {
+        VMOpcode opcode = vmInstructions[i].opcode;
+        if (opcode == VM_FUNCTION) {
+            leader[i] = 1;
+        }
+        if (opcode == VM_GOTO || opcode == VM_IF_GOTO) {
+            leader[vmInstructions[i].arg] = 1;
+        }
+        if (opcode == VM_GOTO || opcode == VM_IF_GOTO || opcode == VM_CALL || opcode == VM_RETURN || opcode == VM_HALT) {
+            leader[i + 1] = 1;
+        }
+    }
+    nativeLines = 0;
+    nativeDepth = 0;
+    memset(nativeRegisterUsed, 0, sizeof nativeRegisterUsed);
+
+    fprintf(nativeFile, "# generated by the Jack compiler from %d vm instructions\n", count);
+    fprintf(nativeFile, "\t.intel_syntax noprefix\n\t.text\n");
+
+    // entry -- int jack_run(int16_t *ram), returns NATIVE_HALT or NATIVE_STACK_OVERFLOW
+    fprintf(nativeFile, "\t.globl jack_run\n\t.type jack_run, @function\njack_run:\n");
+    int saved[6] = {RBX, RBP, R12, R13, R14, R15};
+    for (int i = 0; i < 6; ++i) {
+        emit("push %s", registers64[saved[i]]);
+    }
+    emit("mov rbp, rsp");
+    emit("mov rbx, rdi");
+    emit("mov r12d, %d", VM_STACK_BASE);
+    emit("mov r13d, %d", VM_STACK_BASE);
+    emit("mov r14d, %d", VM_STACK_BASE);
+    emit("jmp .L0");
+
+    // exits -- eax holds the reason
+    fprintf(nativeFile, "jack_halt:\n");
+    emit("mov eax, %d", NATIVE_HALT);
+    emit("jmp jack_exit");
+    fprintf(nativeFile, "jack_overflow:\n");
+    emit("mov eax, %d", NATIVE_STACK_OVERFLOW);
+    fprintf(nativeFile, "jack_exit:\n");
+    emit("mov word ptr [rbx], r12w");
+    emit("mov word ptr [rbx + 2], r13w");
+    emit("mov word ptr [rbx + 4], r14w");
+    emit("mov rsp, rbp");
+    for (int i = 5; i >= 0; --i) {
+        emit("pop %s", registers64[saved[i]]);
+    }
+    emit("ret");
+
+    for (int i = 0; i < count; ++i) {
+        if (leader[i]) {
+            flushNativeStack();
+            if (vmInstructions[i].opcode == VM_FUNCTION) {
+                // Class.subroutine as a symbol for debuggers and profilers ($ is not allowed in intel syntax names)
+                char name[160] = "jack.";
+                strcat(name, functionName(vmInstructions[i].extra));
+                for (char *c = name; *c; ++c) {
+                    if (*c == '$') {
+                        *c = '.';
+                    }
+                }
+                fprintf(nativeFile, "%s:\n", name);
+            }
+            fprintf(nativeFile, ".L%d:\n", i);
+        }
+        translateInstruction(i);
+    }
+    fprintf(nativeFile, "\t.size jack_run, . - jack_run\n");
+    fprintf(nativeFile, "\t.section .note.GNU-stack, \"\", @progbits\n");
+    free(leader);
+
+    int status = !ferror(nativeFile);
+    fclose(nativeFile);
+    nativeFile = NULL;
+    nativeSeconds = vmClock() - start;
+    if (!status) {
+        printf("Could not write the native code output file.\n");
+    }
+    return status;
+}
+
+void PrintNativeReport() {
+    printf("native: %ld assembly instructions in %.3f ms\n", nativeLines, nativeSeconds * 1000);
+}
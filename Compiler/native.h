@@ -0,0 +1,13 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#define NATIVE_CACHE_SLOTS 8 // top of stack values kept in host registers within a basic block
+#define NATIVE_STACK_MARGIN 1024 // stack words a subroutine may use above its locals, checked at entry
+
+// why jack_run returned
+enum {NATIVE_HALT, NATIVE_STACK_OVERFLOW};
+
+int OutputNativeProgram(char *filename); // writes the loaded vm program as x86-64 gnu assembly, returns 0 if it cannot
+void PrintNativeReport(); // size and compile time of the assembly
+
+#endif
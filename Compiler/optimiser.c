@@ -0,0 +1,2112 @@
+/************************************************************************
+University of Leeds
+School of Computing
+COMP2932- Compiler Design and Construction
+The Optimiser Module
+
+Works on the vm code produced by the parser for one subroutine at a time.
+The code is split into VMCommand structs, transformed, then written back.
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "optimiser.h"
+
+// the buffers of the passes are per thread, as the parser may compile several files at once -- each holds
+// MAX_VM_COMMANDS entries (MAX_LOCAL_SLOTS for interference), allocated by allocateBuffers on first use
+_Thread_local VMCommand *optimiserCommands; // working buffer for OptimiseSubroutine
+pthread_mutex_t passStatisticsLock = PTHREAD_MUTEX_INITIALIZER; // taken by OptimiseSubroutine to add to passes[]
+
+extern int optimisationLevel; // from compiler.c
+
+int isJump(VMCommand command); // 1 if goto or if-goto
+int findLabel(VMCommand *commands, int count, char *label); // index of label command or -1
+int removeCommands(VMCommand *commands, int count, int from, int n); // removes n commands starting at from, returns new count
+void allocateBuffers(); // allocates the buffers of the calling thread if it has none yet
+
+/** ----------------- VM Code Text <-> Commands ----------------- **/
+int ParseVMCode(char *code, VMCommand *commands) {
+    int count = 0;
+    char *line = code;
+    while (*line != '\0') {
+        char *end = strchr(line, '\n');
+        size_t length = end ? (size_t)(end - line) : strlen(line);
+
+        char buffer[256];
+        if (length > sizeof buffer - 1) {
+            length = sizeof buffer - 1;
+        }
+        memcpy(buffer, line, length);
+        buffer[length] = '\0';
+
+        VMCommand command;
+        strcpy(command.command, "");
+        strcpy(command.arg, "");
+        command.index = 0;
+        if (sscanf(buffer, "%15s %127s %d", command.command, command.arg, &command.index) >= 1) {
+            if (count == MAX_VM_COMMANDS) {
+                return -1;
+            }
+            commands[count] = command;
+            count++;
+        }
+
+        if (!end) {
+            break;
+        }
+        line = end + 1;
+    }
+    return count;
+}
+
+// writes one command as a line of vm code (nothing if size is 0), returns its length
+int writeVMCommand(VMCommand *command, char *line, size_t size) {
+    if (strcmp(command -> command, "function") == 0) {
+        return snprintf(line, size, "function %s %d\n", command -> arg, command -> index);
+    }
+    else if (strcmp(command -> command, "label") == 0) {
+        return snprintf(line, size, "label %s\n", command -> arg);
+    }
+    else if (strcmp(command -> command, "goto") == 0 || strcmp(command -> command, "if-goto") == 0) {
+        return snprintf(line, size, " %s %s\n", command -> command, command -> arg);
+    }
+    else if (strlen(command -> arg)) { // push, pop, call
+        return snprintf(line, size, " %s %s %d\n", command -> command, command -> arg, command -> index);
+    }
+    else { // arithmetic, logical, return
+        return snprintf(line, size, " %s\n", command -> command);
+    }
+}
+
+void WriteVMCode(VMCommand *commands, int count, char *code) {
+    char *end = code; // write position, avoids rescanning the code with strcat
+    *end = '\0';
+    for (int i = 0; i < count; ++i) {
+        end += writeVMCommand(&commands[i], end, 256); // a command line is shorter than 256 chars
+    }
+}
+
+int VMCodeLength(VMCommand *commands, int count) {
+    int length = 0;
+    for (int i = 0; i < count; ++i) {
+        length += writeVMCommand(&commands[i], NULL, 0);
+    }
+    return length;
+}
+
+/** ----------------- Helpers ----------------- **/
+int isJump(VMCommand command) {
+    return strcmp(command.command, "goto") == 0 || strcmp(command.command, "if-goto") == 0;
+}
+
+int findLabel(VMCommand *commands, int count, char *label) {
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(commands[i].command, "label") == 0 && strcmp(commands[i].arg, label) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int removeCommands(VMCommand *commands, int count, int from, int n) {
+    memmove(&commands[from], &commands[from + n], (count - from - n) * sizeof(VMCommand));
+    return count - n;
+}
+
+/** ----------------- Passes ----------------- **/
+
+// dead code elimination
+// 1. if-goto on a constant condition (push constant c followed by not / neg only) becomes a goto or is dropped
+// 2. commands that cannot be reached from the subroutine entry are removed
+// 3. labels that no goto / if-goto refers to are removed
+// repeated until nothing changes, since each step can expose more work for the others
+int EliminateDeadCode(VMCommand *commands, int count) {
+
+    char *reachable = malloc(MAX_VM_COMMANDS);
+    int *worklist = malloc(MAX_VM_COMMANDS * sizeof(int));
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        // constant conditions
+        for (int i = 0; i < count; ++i) {
+            if (strcmp(commands[i].command, "if-goto") != 0) {
+                continue;
+            }
+            int start = i - 1;
+            while (start >= 0 && (strcmp(commands[start].command, "not") == 0 || strcmp(commands[start].command, "neg") == 0)) {
+                start--;
+            }
+            if (start < 0 || strcmp(commands[start].command, "push") != 0 || strcmp(commands[start].arg, "constant") != 0) {
+                continue;
+            }
+
+            short value = commands[start].index;
+            for (int j = start + 1; j < i; ++j) {
+                value = strcmp(commands[j].command, "not") == 0 ? ~value : -value;
+            }
+
+            if (value) { // always taken
+                strcpy(commands[start].command, "goto");
+                strcpy(commands[start].arg, commands[i].arg);
+                commands[start].index = 0;
+                count = removeCommands(commands, count, start + 1, i - start);
+            }
+            else { // never taken
+                count = removeCommands(commands, count, start, i - start + 1);
+            }
+            i = start;
+            changed = 1;
+        }
+
+        // unreachable code
+        memset(reachable, 0, count);
+        int pending = 0;
+        if (count > 0) {
+            reachable[0] = 1;
+            worklist[pending++] = 0;
+        }
+        while (pending > 0) {
+            int i = worklist[--pending];
+            int successors[2];
+            int successorsCount = 0;
+
+            if (strcmp(commands[i].command, "return") == 0) {
+                ;
+            }
+            else if (isJump(commands[i])) {
+                int target = findLabel(commands, count, commands[i].arg);
+                if (target >= 0) {
+                    successors[successorsCount++] = target;
+                }
+                if (strcmp(commands[i].command, "if-goto") == 0 && i + 1 < count) {
+                    successors[successorsCount++] = i + 1;
+                }
+            }
+            else if (i + 1 < count) {
+                successors[successorsCount++] = i + 1;
+            }
+
+            for (int j = 0; j < successorsCount; ++j) {
+                if (!reachable[successors[j]]) {
+                    reachable[successors[j]] = 1;
+                    worklist[pending++] = successors[j];
+                }
+            }
+        }
+        int kept = 0;
+        for (int i = 0; i < count; ++i) {
+            if (reachable[i]) {
+                commands[kept++] = commands[i];
+            }
+        }
+        if (kept != count) {
+            count = kept;
+            changed = 1;
+        }
+
+        // unused labels
+        for (int i = 0; i < count; ++i) {
+            if (strcmp(commands[i].command, "label") != 0) {
+                continue;
+            }
+            int used = 0;
+            for (int j = 0; j < count; ++j) {
+                if (isJump(commands[j]) && strcmp(commands[j].arg, commands[i].arg) == 0) {
+                    used = 1;
+                    break;
+                }
+            }
+            if (!used) {
+                count = removeCommands(commands, count, i, 1);
+                i--;
+                changed = 1;
+            }
+        }
+    }
+
+    free(reachable);
+    free(worklist);
+    return count;
+}
+
+/** ----------------- Jumps And Labels ----------------- **/
+
+void retargetJumps(VMCommand *commands, int count, char *from, char *to); // points jumps to label from at label to
+
+void retargetJumps(VMCommand *commands, int count, char *from, char *to) {
+    for (int i = 0; i < count; ++i) {
+        if (isJump(commands[i]) && strcmp(commands[i].arg, from) == 0) {
+            strcpy(commands[i].arg, to);
+        }
+    }
+}
+
+// jump threading
+// 1. labels next to each other are merged into the first one
+// 2. a jump to a label followed by a goto jumps straight to the goto's target
+// 3. a goto to the label right after it is removed
+// 4. labels left unused are removed
+// repeated until nothing changes
+int ThreadJumps(VMCommand *commands, int count) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        for (int i = 0; i + 1 < count; ++i) {
+            if (strcmp(commands[i].command, "label") == 0 && strcmp(commands[i + 1].command, "label") == 0) {
+                retargetJumps(commands, count, commands[i + 1].arg, commands[i].arg);
+                count = removeCommands(commands, count, i + 1, 1);
+                i--;
+                changed = 1;
+            }
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (!isJump(commands[i])) {
+                continue;
+            }
+            char *destination = commands[i].arg;
+            int hops = 0;
+            while (hops < count) { // more hops than commands means a cycle of gotos
+                int target = findLabel(commands, count, destination);
+                if (target < 0 || target + 1 >= count || strcmp(commands[target + 1].command, "goto") != 0) {
+                    break;
+                }
+                destination = commands[target + 1].arg;
+                hops++;
+            }
+            if (hops > 0 && hops < count && strcmp(destination, commands[i].arg) != 0) {
+                strcpy(commands[i].arg, destination);
+                changed = 1;
+            }
+        }
+
+        for (int i = 0; i + 1 < count; ++i) {
+            if (strcmp(commands[i].command, "goto") == 0 && strcmp(commands[i + 1].command, "label") == 0
+                && strcmp(commands[i].arg, commands[i + 1].arg) == 0) {
+                count = removeCommands(commands, count, i, 1);
+                i--;
+                changed = 1;
+            }
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (strcmp(commands[i].command, "label") != 0) {
+                continue;
+            }
+            int used = 0;
+            for (int j = 0; j < count && !used; ++j) {
+                used = isJump(commands[j]) && strcmp(commands[j].arg, commands[i].arg) == 0;
+            }
+            if (!used) {
+                count = removeCommands(commands, count, i, 1);
+                i--;
+                changed = 1;
+            }
+        }
+    }
+    return count;
+}
+
+// labels only need to be unique inside their function (the vm translator scopes them), so they are
+// renamed L0, L1, ... in order of appearance
+void NumberLabels(VMCommand *commands, int count) {
+    int labels = 0;
+    char name[32];
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(commands[i].command, "label") != 0 || commands[i].arg[0] == '$') {
+            continue;
+        }
+        sprintf(name, "$%d", labels++); // temporary names, so a new name never clashes with an old one
+        retargetJumps(commands, count, commands[i].arg, name);
+        strcpy(commands[i].arg, name);
+    }
+    for (int i = 0; i < count; ++i) {
+        if ((strcmp(commands[i].command, "label") == 0 || isJump(commands[i])) && commands[i].arg[0] == '$') {
+            sprintf(name, "L%s", commands[i].arg + 1);
+            strcpy(commands[i].arg, name);
+        }
+    }
+}
+
+/** ----------------- Short Circuit Conditions ----------------- **/
+
+// node of the expression tree rebuilt from the postfix vm code of a condition
+typedef struct {
+    char op[16]; // vm command of the operator, "push" for leaves
+    int left;
+    int right;
+    int start; // commands [start, end) evaluate this subtree
+    int end;
+} ConditionNode;
+
+_Thread_local ConditionNode *conditionNodes;
+_Thread_local VMCommand *conditionCommands;
+_Thread_local VMCommand *branchCommands;
+_Thread_local int branchCount;
+
+int isBooleanNode(int node); // 1 if the node can only evaluate to true (-1) or false (0)
+void addBranchCommand(char *command, char *arg, int index);
+void addLabelCommand(char *command, int label);
+void branchIfFalse(int node, int label, int *labelCounter);
+void branchIfTrue(int node, int label, int *labelCounter);
+
+int isBooleanNode(int node) {
+    ConditionNode n = conditionNodes[node];
+    if (strcmp(n.op, "eq") == 0 || strcmp(n.op, "gt") == 0 || strcmp(n.op, "lt") == 0) {
+        return 1;
+    }
+    if (strcmp(n.op, "and") == 0 || strcmp(n.op, "or") == 0) {
+        return isBooleanNode(n.left) && isBooleanNode(n.right);
+    }
+    if (strcmp(n.op, "not") == 0) {
+        return isBooleanNode(n.left);
+    }
+    if (strcmp(n.op, "push") == 0) { // false
+        return strcmp(conditionCommands[n.start].arg, "constant") == 0 && conditionCommands[n.start].index == 0;
+    }
+    return 0;
+}
+
+void addBranchCommand(char *command, char *arg, int index) {
+    strcpy(branchCommands[branchCount].command, command);
+    strcpy(branchCommands[branchCount].arg, arg);
+    branchCommands[branchCount].index = index;
+    branchCount++;
+}
+
+void addLabelCommand(char *command, int label) {
+    char labelName[32];
+    sprintf(labelName, "L%d", label);
+    addBranchCommand(command, labelName, 0);
+}
+
+// jump to label if node is false, fall through otherwise
+void branchIfFalse(int node, int label, int *labelCounter) {
+    ConditionNode n = conditionNodes[node];
+    int booleanOperands = strcmp(n.op, "push") != 0 && isBooleanNode(node);
+
+    if (booleanOperands && strcmp(n.op, "and") == 0) {
+        branchIfFalse(n.left, label, labelCounter);
+        branchIfFalse(n.right, label, labelCounter);
+    }
+    else if (booleanOperands && strcmp(n.op, "or") == 0) {
+        int trueLabel = ++(*labelCounter);
+        branchIfTrue(n.left, trueLabel, labelCounter);
+        branchIfFalse(n.right, label, labelCounter);
+        addLabelCommand("label", trueLabel);
+    }
+    else if (booleanOperands && strcmp(n.op, "not") == 0) {
+        branchIfTrue(n.left, label, labelCounter);
+    }
+    else {
+        for (int i = n.start; i < n.end; ++i) {
+            branchCommands[branchCount++] = conditionCommands[i];
+        }
+        addBranchCommand("not", "", 0);
+        addLabelCommand("if-goto", label);
+    }
+}
+
+// jump to label if node is true, fall through otherwise
+void branchIfTrue(int node, int label, int *labelCounter) {
+    ConditionNode n = conditionNodes[node];
+    int booleanOperands = strcmp(n.op, "push") != 0 && isBooleanNode(node);
+
+    if (booleanOperands && strcmp(n.op, "and") == 0) {
+        int falseLabel = ++(*labelCounter);
+        branchIfFalse(n.left, falseLabel, labelCounter);
+        branchIfTrue(n.right, label, labelCounter);
+        addLabelCommand("label", falseLabel);
+    }
+    else if (booleanOperands && strcmp(n.op, "or") == 0) {
+        branchIfTrue(n.left, label, labelCounter);
+        branchIfTrue(n.right, label, labelCounter);
+    }
+    else if (booleanOperands && strcmp(n.op, "not") == 0) {
+        branchIfFalse(n.left, label, labelCounter);
+    }
+    else {
+        for (int i = n.start; i < n.end; ++i) {
+            branchCommands[branchCount++] = conditionCommands[i];
+        }
+        addLabelCommand("if-goto", label);
+    }
+}
+
+// rewrites the vm code of a condition into a chain of if-gotos jumping to falseLabel when the condition is false
+// only done for side effect free conditions (pushes and arithmetic / logical commands), since the jumps
+// skip evaluating the rest of an & / | chain -- and only where & / | combine boolean operands (comparisons,
+// true, false), as for other values they are bitwise operators
+// returns 1 if condition was rewritten (if-goto included), 0 if it was left alone
+int ShortCircuitCondition(char *condition, int size, int falseLabel, int *labelCounter) {
+    allocateBuffers();
+
+    int count = ParseVMCode(condition, conditionCommands);
+    int stack[MAX_VM_COMMANDS];
+    int top = 0;
+
+    for (int i = 0; i < count; ++i) {
+        ConditionNode node;
+        strcpy(node.op, conditionCommands[i].command);
+        node.left = -1;
+        node.right = -1;
+        node.end = i + 1;
+
+        if (strcmp(node.op, "push") == 0) {
+            node.start = i;
+        }
+        else if (strcmp(node.op, "not") == 0 || strcmp(node.op, "neg") == 0) {
+            if (top < 1) {
+                return 0;
+            }
+            node.left = stack[--top];
+            node.start = conditionNodes[node.left].start;
+        }
+        else if (strcmp(node.op, "add") == 0 || strcmp(node.op, "sub") == 0 || strcmp(node.op, "eq") == 0 || strcmp(node.op, "gt") == 0
+            || strcmp(node.op, "lt") == 0 || strcmp(node.op, "and") == 0 || strcmp(node.op, "or") == 0) {
+            if (top < 2) {
+                return 0;
+            }
+            node.right = stack[--top];
+            node.left = stack[--top];
+            node.start = conditionNodes[node.left].start;
+        }
+        else { // calls, pops etc. -- not side effect free
+            return 0;
+        }
+
+        conditionNodes[i] = node;
+        stack[top++] = i;
+    }
+
+    if (top != 1) {
+        return 0;
+    }
+
+    // nothing to gain unless the condition is a boolean &, | or ~
+    int root = stack[0];
+    char *rootOp = conditionNodes[root].op;
+    if (!(strcmp(rootOp, "and") == 0 || strcmp(rootOp, "or") == 0 || strcmp(rootOp, "not") == 0) || !isBooleanNode(root)) {
+        return 0;
+    }
+
+    branchCount = 0;
+    branchIfFalse(root, falseLabel, labelCounter);
+    if (VMCodeLength(branchCommands, branchCount) >= size) {
+        return 0;
+    }
+    WriteVMCode(branchCommands, branchCount, condition);
+    return 1;
+}
+
+/** ----------------- Loop Invariant Code Motion ----------------- **/
+
+#define MAX_HOISTED_VALUES 8 // most locals added to one subroutine to hold hoisted values
+
+// a value on the stack simulated while scanning a loop
+typedef struct {
+    int start; // commands [start, end) compute the value
+    int end;
+    int invariant; // 1 if the value is the same on every iteration of the loop
+    int operators; // arithmetic / logical commands in the value, 0 for a single push
+    int variables; // pushes of anything but constants in the value
+} LoopValue;
+
+_Thread_local LoopValue *loopStack;
+_Thread_local LoopValue *hoistRanges;
+_Thread_local int *hoistLocals; // local holding each hoisted range, -1 if it stays in the loop
+_Thread_local VMCommand *preheaderCommands;
+
+int sameCommands(VMCommand *a, VMCommand *b, int n); // 1 if the n commands at a and b are the same
+int isUnaryCommand(char *command);
+int isBinaryCommand(char *command);
+int isPureCall(VMCommand command); // 1 for OS functions that neither write memory nor can fail
+int isLoopInvariantPush(VMCommand *commands, int header, int backEdge, VMCommand push);
+int isSingleEntryLoop(VMCommand *commands, int count, int header, int backEdge);
+int hoistFromLoop(VMCommand *commands, int *count, int header, int backEdge, int *nextLocal, int lastLocal);
+
+int sameCommands(VMCommand *a, VMCommand *b, int n) {
+    for (int i = 0; i < n; ++i) {
+        if (strcmp(a[i].command, b[i].command) != 0 || strcmp(a[i].arg, b[i].arg) != 0 || a[i].index != b[i].index) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int isUnaryCommand(char *command) {
+    return strcmp(command, "not") == 0 || strcmp(command, "neg") == 0;
+}
+
+int isBinaryCommand(char *command) {
+    return strcmp(command, "add") == 0 || strcmp(command, "sub") == 0 || strcmp(command, "eq") == 0 || strcmp(command, "gt") == 0
+        || strcmp(command, "lt") == 0 || strcmp(command, "and") == 0 || strcmp(command, "or") == 0;
+}
+
+int isPureCall(VMCommand command) {
+    return strcmp(command.command, "call") == 0 && (strcmp(command.arg, "Math.multiply") == 0 || strcmp(command.arg, "Math.abs") == 0
+        || strcmp(command.arg, "Math.min") == 0 || strcmp(command.arg, "Math.max") == 0);
+}
+
+// a pushed value is invariant if nothing inside the loop can write it
+// fields can also be written through 'that' or by a called method, statics by any called subroutine
+int isLoopInvariantPush(VMCommand *commands, int header, int backEdge, VMCommand push) {
+    if (strcmp(push.arg, "constant") == 0) {
+        return 1;
+    }
+    if (strcmp(push.arg, "that") == 0 || strcmp(push.arg, "temp") == 0) {
+        return 0;
+    }
+    int isField = strcmp(push.arg, "this") == 0;
+    int isStatic = strcmp(push.arg, "static") == 0;
+    for (int i = header; i <= backEdge; ++i) {
+        if (strcmp(commands[i].command, "call") == 0 && !isPureCall(commands[i]) && (isField || isStatic)) {
+            return 0;
+        }
+        if (strcmp(commands[i].command, "pop") != 0) {
+            continue;
+        }
+        if (strcmp(commands[i].arg, push.arg) == 0 && commands[i].index == push.index) {
+            return 0;
+        }
+        if (isField && (strcmp(commands[i].arg, "that") == 0 || (strcmp(commands[i].arg, "pointer") == 0 && commands[i].index == 0))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 1 if the loop can only be entered by falling into its header label, so code placed above the header runs first
+int isSingleEntryLoop(VMCommand *commands, int count, int header, int backEdge) {
+    for (int i = 0; i < count; ++i) {
+        if (!isJump(commands[i]) || (i >= header && i <= backEdge)) {
+            continue;
+        }
+        int target = findLabel(commands, count, commands[i].arg);
+        if (target >= header && target <= backEdge) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// replaces the largest invariant subexpressions of the loop [header, backEdge] by reads of new locals
+// which are computed once above the loop header, returns the number of subexpressions replaced
+int hoistFromLoop(VMCommand *commands, int *count, int header, int backEdge, int *nextLocal, int lastLocal) {
+
+    // rebuild the expressions of the loop from its postfix code, any subexpression that is invariant and
+    // used by a command that is not is a candidate -- a single push or an expression of constants only
+    // is not worth a local
+    int top = 0;
+    int rangesCount = 0;
+    for (int i = header + 1; i < backEdge; ++i) {
+        char *command = commands[i].command;
+        if (strcmp(command, "push") == 0) {
+            LoopValue value = {i, i + 1, isLoopInvariantPush(commands, header, backEdge, commands[i]), 0, strcmp(commands[i].arg, "constant") != 0};
+            loopStack[top++] = value;
+            continue;
+        }
+
+        int consumed;
+        int produces = 1;
+        int arithmetic = 0;
+        if (isUnaryCommand(command) || isBinaryCommand(command)) {
+            consumed = isUnaryCommand(command) ? 1 : 2;
+            arithmetic = 1;
+        }
+        else if (isPureCall(commands[i])) {
+            consumed = commands[i].index;
+            arithmetic = 1;
+        }
+        else if (strcmp(command, "call") == 0) {
+            consumed = commands[i].index;
+        }
+        else if (strcmp(command, "pop") == 0 || strcmp(command, "if-goto") == 0) {
+            consumed = 1;
+            produces = 0;
+        }
+        else { // label, goto, return -- values left on the stack cannot be followed any further
+            top = 0;
+            continue;
+        }
+
+        LoopValue value = {i, i + 1, arithmetic, 0, 0};
+        int base = top - consumed;
+        if (base < 0) { // operands computed before the loop
+            value.invariant = 0;
+            base = 0;
+        }
+        else if (consumed > 0) {
+            value.start = loopStack[base].start;
+        }
+        for (int j = base; j < top; ++j) {
+            value.invariant = value.invariant && loopStack[j].invariant;
+            value.operators += loopStack[j].operators;
+            value.variables += loopStack[j].variables;
+        }
+        for (int j = base; j < top && !value.invariant; ++j) {
+            if (loopStack[j].invariant && loopStack[j].operators > 0 && loopStack[j].variables > 0) {
+                hoistRanges[rangesCount++] = loopStack[j];
+            }
+        }
+        value.operators += arithmetic;
+        top = base;
+        if (produces) {
+            loopStack[top++] = value;
+        }
+    }
+    if (rangesCount == 0) {
+        return 0;
+    }
+
+    // candidates are found when their user is, sort them back into code order
+    for (int i = 1; i < rangesCount; ++i) {
+        LoopValue range = hoistRanges[i];
+        int j = i - 1;
+        while (j >= 0 && hoistRanges[j].start > range.start) {
+            hoistRanges[j + 1] = hoistRanges[j];
+            j--;
+        }
+        hoistRanges[j + 1] = range;
+    }
+
+    // build the preheader, identical expressions share a local
+    int preheaderCount = 0;
+    int hoistedCount = 0;
+    for (int i = 0; i < rangesCount; ++i) {
+        int length = hoistRanges[i].end - hoistRanges[i].start;
+        hoistLocals[i] = -1;
+        for (int j = 0; j < i && hoistLocals[i] < 0; ++j) {
+            if (hoistLocals[j] >= 0 && hoistRanges[j].end - hoistRanges[j].start == length
+                && sameCommands(&commands[hoistRanges[j].start], &commands[hoistRanges[i].start], length)) {
+                hoistLocals[i] = hoistLocals[j];
+            }
+        }
+        if (hoistLocals[i] < 0) {
+            if (*nextLocal > lastLocal || *count + preheaderCount + length + 1 > MAX_VM_COMMANDS) {
+                continue; // out of locals, left in the loop
+            }
+            hoistLocals[i] = (*nextLocal)++;
+            memcpy(&preheaderCommands[preheaderCount], &commands[hoistRanges[i].start], length * sizeof(VMCommand));
+            preheaderCount += length;
+            VMCommand pop = {"pop", "local", hoistLocals[i]};
+            preheaderCommands[preheaderCount++] = pop;
+        }
+        hoistedCount++;
+    }
+    if (hoistedCount == 0) {
+        return 0;
+    }
+
+    // replace the ranges from the last one so earlier positions stay valid, then insert the preheader
+    for (int i = rangesCount - 1; i >= 0; --i) {
+        if (hoistLocals[i] < 0) {
+            continue;
+        }
+        VMCommand push = {"push", "local", hoistLocals[i]};
+        commands[hoistRanges[i].start] = push;
+        *count = removeCommands(commands, *count, hoistRanges[i].start + 1, hoistRanges[i].end - hoistRanges[i].start - 1);
+    }
+    memmove(&commands[header + preheaderCount], &commands[header], (*count - header) * sizeof(VMCommand));
+    memcpy(&commands[header], preheaderCommands, preheaderCount * sizeof(VMCommand));
+    *count += preheaderCount;
+    return hoistedCount;
+}
+
+// loop invariant code motion
+// a loop is a label with a goto below it jumping back to it (a while statement), invariant side effect free
+// computations (expressions of fields / variables not written in the loop, array element addresses,
+// Math.multiply etc.) are moved into new locals computed just above the loop -- inner loops first, so their
+// hoisted code can move further out of the enclosing loops
+int MoveLoopInvariants(VMCommand *commands, int count) {
+    allocateBuffers();
+    if (count == 0 || strcmp(commands[0].command, "function") != 0) {
+        return count;
+    }
+
+    // new locals go after the declared ones and any local the code already uses
+    int nextLocal = commands[0].index;
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(commands[i].arg, "local") == 0 && commands[i].index >= nextLocal) {
+            nextLocal = commands[i].index + 1;
+        }
+    }
+    int firstLocal = nextLocal;
+    int lastLocal = nextLocal + MAX_HOISTED_VALUES - 1;
+
+    int *headers = malloc(MAX_VM_COMMANDS * sizeof(int));
+    int *backEdges = malloc(MAX_VM_COMMANDS * sizeof(int));
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        // find the loops, smallest first -- found again after each change since hoisting moves the code
+        int loopsCount = 0;
+        for (int i = 0; i < count; ++i) {
+            int header = strcmp(commands[i].command, "goto") == 0 ? findLabel(commands, count, commands[i].arg) : -1;
+            if (header < 0 || header >= i) {
+                continue;
+            }
+            int j = loopsCount - 1;
+            while (j >= 0 && backEdges[j] - headers[j] > i - header) {
+                headers[j + 1] = headers[j];
+                backEdges[j + 1] = backEdges[j];
+                j--;
+            }
+            headers[j + 1] = header;
+            backEdges[j + 1] = i;
+            loopsCount++;
+        }
+
+        for (int i = 0; i < loopsCount && !changed; ++i) {
+            if (isSingleEntryLoop(commands, count, headers[i], backEdges[i])) {
+                changed = hoistFromLoop(commands, &count, headers[i], backEdges[i], &nextLocal, lastLocal) > 0;
+            }
+        }
+    }
+    free(headers);
+    free(backEdges);
+
+    if (nextLocal > firstLocal) {
+        commands[0].index = nextLocal;
+    }
+    return count;
+}
+
+/** ----------------- Common Subexpression Elimination ----------------- **/
+
+// a value number: a push (left = right = -1) or an arithmetic / logical command applied to earlier value numbers
+typedef struct {
+    VMCommand command;
+    int left;
+    int right;
+    int killed; // pushes only -- the slot was written after it was read, so a new push is a new value
+    int variables; // 1 if the value reads anything but constants
+    int memory; // 1 if the value reads through 'that' or temp
+    int first; // occurrence that computes the value first
+    int temp; // temp caching the value, -1 if not cached
+} ValueNumber;
+
+// an expression evaluated in a basic block
+typedef struct {
+    int start; // commands [start, end) compute the value
+    int end;
+    int value; // value number, -1 if not known (operands computed before the block)
+} Occurrence;
+
+_Thread_local ValueNumber *valueNumbers;
+_Thread_local Occurrence *occurrences;
+_Thread_local int *occurrenceStack;
+_Thread_local int *replacedTemp; // temp read instead of the occurrence starting at a command, -1 if none
+_Thread_local int *replacedEnd;
+_Thread_local int *savedTemp; // temp the value ending at a command is saved in, -1 if none
+_Thread_local VMCommand *cseCommands;
+
+int numberValue(VMCommand command, int left, int right, int blockStart, int *valuesCount);
+void killValues(VMCommand pop, int blockStart, int valuesCount);
+
+// returns the value number of command applied to left / right in the current block, adding it if it is new
+int numberValue(VMCommand command, int left, int right, int blockStart, int *valuesCount) {
+    int isPush = strcmp(command.command, "push") == 0;
+    for (int i = blockStart; i < *valuesCount; ++i) {
+        ValueNumber v = valueNumbers[i];
+        if (!v.killed && v.left == left && v.right == right && strcmp(v.command.command, command.command) == 0
+            && (!isPush || (strcmp(v.command.arg, command.arg) == 0 && v.command.index == command.index))) {
+            return i;
+        }
+    }
+
+    ValueNumber v = {command, left, right, 0, 0, 0, -1, -1};
+    if (isPush) {
+        v.variables = strcmp(command.arg, "constant") != 0;
+        v.memory = strcmp(command.arg, "that") == 0 || strcmp(command.arg, "temp") == 0;
+    }
+    else {
+        v.variables = valueNumbers[left].variables || (right >= 0 && valueNumbers[right].variables);
+        v.memory = valueNumbers[left].memory || (right >= 0 && valueNumbers[right].memory);
+    }
+    valueNumbers[*valuesCount] = v;
+    return (*valuesCount)++;
+}
+
+// marks the pushes of the block that pop may have overwritten
+void killValues(VMCommand pop, int blockStart, int valuesCount) {
+    for (int i = blockStart; i < valuesCount; ++i) {
+        VMCommand push = valueNumbers[i].command;
+        if (strcmp(push.command, "push") != 0) {
+            continue;
+        }
+        if ((strcmp(push.arg, pop.arg) == 0 && push.index == pop.index)
+            || (strcmp(pop.arg, "pointer") == 0 && pop.index == 0 && strcmp(push.arg, "this") == 0)
+            || (strcmp(pop.arg, "pointer") == 0 && pop.index == 1 && strcmp(push.arg, "that") == 0)
+            || (strcmp(pop.arg, "that") == 0 && (strcmp(push.arg, "this") == 0 || strcmp(push.arg, "that") == 0))) {
+            valueNumbers[i].killed = 1;
+        }
+    }
+}
+
+// local common subexpression elimination
+// every expression of a basic block gets a value number, equal numbers are equal values -- when a value
+// (with an operator and a variable in it, array element addresses mostly) is computed again in the same
+// block, the first computation is saved in a free temp and the later ones read it back
+// calls end a block, as do jumps and labels, so a temp is never live across a call
+int EliminateCommonSubexpressions(VMCommand *commands, int count) {
+    allocateBuffers();
+
+    int tempUsed[8] = {0};
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(commands[i].arg, "temp") == 0 && commands[i].index >= 0 && commands[i].index < 8) {
+            tempUsed[commands[i].index] = 1;
+        }
+    }
+
+    // number the values
+    int valuesCount = 0;
+    int blockStart = 0;
+    int occurrencesCount = 0;
+    int top = 0;
+    for (int i = 0; i < count; ++i) {
+        char *command = commands[i].command;
+        replacedTemp[i] = -1;
+        savedTemp[i] = -1;
+
+        Occurrence occurrence = {i, i + 1, -1};
+        if (strcmp(command, "push") == 0) {
+            occurrence.value = numberValue(commands[i], -1, -1, blockStart, &valuesCount);
+        }
+        else if (isUnaryCommand(command) || isBinaryCommand(command)) {
+            int operands = isUnaryCommand(command) ? 1 : 2;
+            if (top < operands) { // operands computed before the block
+                top = 0;
+            }
+            else {
+                Occurrence right = operands == 2 ? occurrences[occurrenceStack[--top]] : occurrence;
+                Occurrence left = occurrences[occurrenceStack[--top]];
+                occurrence.start = left.start;
+                if (left.value >= 0 && (operands == 1 || right.value >= 0)) {
+                    occurrence.value = numberValue(commands[i], left.value, operands == 2 ? right.value : -1, blockStart, &valuesCount);
+                }
+            }
+        }
+        else if (strcmp(command, "pop") == 0) {
+            if (top > 0) {
+                top--;
+            }
+            killValues(commands[i], blockStart, valuesCount);
+            continue;
+        }
+        else { // label, goto, if-goto, call, return -- the block ends
+            blockStart = valuesCount;
+            top = 0;
+            continue;
+        }
+
+        if (occurrence.value >= 0 && valueNumbers[occurrence.value].first < 0) {
+            valueNumbers[occurrence.value].first = occurrencesCount;
+        }
+        occurrences[occurrencesCount] = occurrence;
+        occurrenceStack[top++] = occurrencesCount++;
+    }
+
+    // replace the repeated values, outermost first -- an expression inside a replaced one is gone already
+    int replaced = 0;
+    int added = 0; // saves of the first computations
+    for (int i = occurrencesCount - 1; i >= 0; --i) {
+        Occurrence occurrence = occurrences[i];
+        if (occurrence.value < 0 || valueNumbers[occurrence.value].first == i) {
+            continue;
+        }
+        ValueNumber *v = &valueNumbers[occurrence.value];
+        if (occurrence.end - occurrence.start < 3 || !v->variables || v->memory) { // not worth a temp
+            continue;
+        }
+        int inside = 0;
+        for (int j = 0; j <= occurrence.start && !inside; ++j) {
+            inside = replacedTemp[j] >= 0 && replacedEnd[j] >= occurrence.end;
+        }
+        if (inside) {
+            continue;
+        }
+        if (v->temp < 0) {
+            for (int t = 0; t < 8 && v->temp < 0; ++t) {
+                if (!tempUsed[t]) {
+                    tempUsed[t] = 1;
+                    v->temp = t;
+                }
+            }
+            if (v->temp < 0 || count + added + 2 > MAX_VM_COMMANDS) { // no free temp left
+                continue;
+            }
+            savedTemp[occurrences[v->first].end - 1] = v->temp;
+            added += 2;
+        }
+        replacedTemp[occurrence.start] = v->temp;
+        replacedEnd[occurrence.start] = occurrence.end;
+        replaced++;
+    }
+    if (replaced == 0) {
+        return count;
+    }
+
+    // rewrite
+    int newCount = 0;
+    for (int i = 0; i < count; ) {
+        if (replacedTemp[i] >= 0) {
+            VMCommand push = {"push", "temp", replacedTemp[i]};
+            cseCommands[newCount++] = push;
+            i = replacedEnd[i];
+            continue;
+        }
+        cseCommands[newCount++] = commands[i];
+        if (savedTemp[i] >= 0) {
+            VMCommand pop = {"pop", "temp", savedTemp[i]};
+            VMCommand push = {"push", "temp", savedTemp[i]};
+            cseCommands[newCount++] = pop;
+            cseCommands[newCount++] = push;
+        }
+        i++;
+    }
+    memcpy(commands, cseCommands, newCount * sizeof(VMCommand));
+    return newCount;
+}
+
+/** ----------------- Local Slot Allocation ----------------- **/
+
+#define MAX_LOCAL_SLOTS 256 // locals a subroutine can have for slot allocation to run
+
+typedef unsigned long long LocalSet[MAX_LOCAL_SLOTS / 64]; // bit set of local slots
+
+_Thread_local LocalSet *liveIn;
+_Thread_local LocalSet *liveOut;
+_Thread_local LocalSet *interference;
+
+int inLocalSet(LocalSet set, int slot);
+void addToLocalSet(LocalSet set, int slot);
+
+int inLocalSet(LocalSet set, int slot) {
+    return (set[slot / 64] >> (slot % 64)) & 1;
+}
+
+void addToLocalSet(LocalSet set, int slot) {
+    set[slot / 64] |= 1ULL << (slot % 64);
+}
+
+// local slot allocation
+// a local is live where its value may still be read, two locals that are never live at the same time
+// can share a slot -- the slots are recoloured with as few colours as possible and the function's local
+// count shrinks to match, smaller frames mean fewer zeroes pushed per call and less stack for recursion
+// locals read before they are written rely on the zero the frame starts with, they keep a slot of their own
+int AllocateLocalSlots(VMCommand *commands, int count) {
+    allocateBuffers();
+    if (count == 0 || strcmp(commands[0].command, "function") != 0) {
+        return count;
+    }
+    int slots = 0;
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(commands[i].arg, "local") == 0 && commands[i].index >= slots) {
+            slots = commands[i].index + 1;
+        }
+    }
+    if (slots > MAX_LOCAL_SLOTS) {
+        return count;
+    }
+    if (slots == 0) { // declared locals that are never used
+        commands[0].index = 0;
+        return count;
+    }
+
+    int *targets = malloc(count * sizeof(int)); // jump targets, found once
+    for (int i = 0; i < count; ++i) {
+        targets[i] = isJump(commands[i]) ? findLabel(commands, count, commands[i].arg) : -1;
+    }
+
+    // liveness, backwards over the control flow graph until nothing changes
+    memset(liveIn, 0, count * sizeof(LocalSet));
+    memset(liveOut, 0, count * sizeof(LocalSet));
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = count - 1; i >= 0; --i) {
+            LocalSet out = {0};
+            int successors[2];
+            int successorsCount = 0;
+            if (isJump(commands[i])) {
+                if (targets[i] >= 0) {
+                    successors[successorsCount++] = targets[i];
+                }
+                if (strcmp(commands[i].command, "if-goto") == 0 && i + 1 < count) {
+                    successors[successorsCount++] = i + 1;
+                }
+            }
+            else if (strcmp(commands[i].command, "return") != 0 && i + 1 < count) {
+                successors[successorsCount++] = i + 1;
+            }
+            for (int j = 0; j < successorsCount; ++j) {
+                for (int k = 0; k < MAX_LOCAL_SLOTS / 64; ++k) {
+                    out[k] |= liveIn[successors[j]][k];
+                }
+            }
+
+            LocalSet in;
+            memcpy(in, out, sizeof(LocalSet));
+            if (strcmp(commands[i].arg, "local") == 0) {
+                int slot = commands[i].index;
+                if (strcmp(commands[i].command, "pop") == 0) {
+                    in[slot / 64] &= ~(1ULL << (slot % 64));
+                }
+                else {
+                    addToLocalSet(in, slot);
+                }
+            }
+            if (memcmp(in, liveIn[i], sizeof(LocalSet)) != 0 || memcmp(out, liveOut[i], sizeof(LocalSet)) != 0) {
+                memcpy(liveIn[i], in, sizeof(LocalSet));
+                memcpy(liveOut[i], out, sizeof(LocalSet));
+                changed = 1;
+            }
+        }
+    }
+
+    free(targets);
+
+    // a local written interferes with every other local live after the write
+    memset(interference, 0, slots * sizeof(LocalSet));
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(commands[i].command, "pop") != 0 || strcmp(commands[i].arg, "local") != 0) {
+            continue;
+        }
+        int slot = commands[i].index;
+        for (int other = 0; other < slots; ++other) {
+            if (other != slot && inLocalSet(liveOut[i], other)) {
+                addToLocalSet(interference[slot], other);
+                addToLocalSet(interference[other], slot);
+            }
+        }
+    }
+    for (int slot = 0; slot < slots; ++slot) {
+        if (!inLocalSet(liveIn[0], slot)) {
+            continue;
+        }
+        for (int other = 0; other < slots; ++other) {
+            if (other != slot) {
+                addToLocalSet(interference[slot], other);
+                addToLocalSet(interference[other], slot);
+            }
+        }
+    }
+
+    // greedy colouring in slot order, so locals keep their slot where they can
+    int colour[MAX_LOCAL_SLOTS];
+    int colours = 0;
+    for (int slot = 0; slot < slots; ++slot) {
+        colour[slot] = 0;
+        int taken = 1;
+        while (taken) {
+            taken = 0;
+            for (int other = 0; other < slot && !taken; ++other) {
+                taken = inLocalSet(interference[slot], other) && colour[other] == colour[slot];
+            }
+            if (taken) {
+                colour[slot]++;
+            }
+        }
+        if (colour[slot] + 1 > colours) {
+            colours = colour[slot] + 1;
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(commands[i].arg, "local") == 0) {
+            commands[i].index = colour[commands[i].index];
+        }
+    }
+    commands[0].index = colours;
+    return count;
+}
+
+/** ----------------- Constant Folding ----------------- **/
+
+int constantBefore(VMCommand *commands, int end, int *start, short *value); // 1 if commands [start, end) only push a constant
+int constantCommands(short value, VMCommand *commands); // writes the commands pushing value, returns how many
+
+int constantBefore(VMCommand *commands, int end, int *start, short *value) {
+    int i = end - 1;
+    while (i >= 0 && (strcmp(commands[i].command, "not") == 0 || strcmp(commands[i].command, "neg") == 0)) {
+        i--;
+    }
+    if (i < 0 || strcmp(commands[i].command, "push") != 0 || strcmp(commands[i].arg, "constant") != 0) {
+        return 0;
+    }
+    *start = i;
+    *value = commands[i].index;
+    for (int j = i + 1; j < end; ++j) {
+        *value = strcmp(commands[j].command, "not") == 0 ? ~*value : -*value;
+    }
+    return 1;
+}
+
+int constantCommands(short value, VMCommand *commands) {
+    VMCommand push = {"push", "constant", value >= 0 ? value : ~value};
+    commands[0] = push;
+    if (value >= 0) {
+        return 1;
+    }
+    VMCommand not = {"not", "", 0}; // ~value is never negative, so negative values are one not away
+    commands[1] = not;
+    return 2;
+}
+
+// constant folding
+// 1. a constant stored in a temp is forwarded to the reads of the temp up to the end of the block, and the
+//    store dropped -- the generated code only uses temps as scratch inside a block
+// 2. arithmetic / logical commands on two constants are replaced by the (16 bit) result, so that
+//    conditions on constants become constant conditions for dead code elimination
+int FoldConstants(VMCommand *commands, int count) {
+    for (int i = 0; i < count; ++i) {
+        int start;
+        short value;
+        if (strcmp(commands[i].command, "pop") != 0 || strcmp(commands[i].arg, "temp") != 0 || !constantBefore(commands, i, &start, &value)) {
+            continue;
+        }
+        VMCommand constant[2];
+        int n = constantCommands(value, constant);
+        int end = i + 1;
+        int forwarded = 1;
+        while (end < count && !isJump(commands[end]) && strcmp(commands[end].command, "label") != 0
+            && strcmp(commands[end].command, "call") != 0 && strcmp(commands[end].command, "return") != 0
+            && !(strcmp(commands[end].command, "pop") == 0 && strcmp(commands[end].arg, "temp") == 0 && commands[end].index == commands[i].index)) {
+            if (strcmp(commands[end].command, "push") == 0 && strcmp(commands[end].arg, "temp") == 0 && commands[end].index == commands[i].index) {
+                if (count + n - 1 > MAX_VM_COMMANDS) {
+                    forwarded = 0;
+                    break;
+                }
+                memmove(&commands[end + n], &commands[end + 1], (count - end - 1) * sizeof(VMCommand));
+                memcpy(&commands[end], constant, n * sizeof(VMCommand));
+                count += n - 1;
+                end += n - 1;
+            }
+            end++;
+        }
+        if (forwarded) {
+            count = removeCommands(commands, count, start, i + 1 - start);
+            i = start - 1;
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (!isBinaryCommand(commands[i].command)) {
+            continue;
+        }
+        int rightStart;
+        int leftStart;
+        short right;
+        short left;
+        if (!constantBefore(commands, i, &rightStart, &right) || !constantBefore(commands, rightStart, &leftStart, &left)) {
+            continue;
+        }
+
+        char *op = commands[i].command;
+        short result;
+        if (strcmp(op, "add") == 0) {
+            result = left + right;
+        }
+        else if (strcmp(op, "sub") == 0) {
+            result = left - right;
+        }
+        else if (strcmp(op, "eq") == 0) {
+            result = left == right ? -1 : 0;
+        }
+        else if (strcmp(op, "gt") == 0) {
+            result = left > right ? -1 : 0;
+        }
+        else if (strcmp(op, "lt") == 0) {
+            result = left < right ? -1 : 0;
+        }
+        else if (strcmp(op, "and") == 0) {
+            result = left & right;
+        }
+        else {
+            result = left | right;
+        }
+
+        VMCommand folded[2];
+        int n = constantCommands(result, folded);
+        count = removeCommands(commands, count, leftStart, i + 1 - leftStart - n);
+        for (int j = 0; j < n; ++j) {
+            commands[leftStart + j] = folded[j];
+        }
+        i = leftStart + n - 1;
+    }
+    return count;
+}
+
+/** ----------------- Push / Pop Cancellation ----------------- **/
+
+int isBlockEnd(VMCommand command); // 1 for commands ending a basic block (labels, jumps, calls, return)
+int tempReadLater(VMCommand *commands, int count, int from, int index); // 1 if temp index is read before the block ends or it is written again
+
+int isBlockEnd(VMCommand command) {
+    return isJump(command) || strcmp(command.command, "label") == 0 || strcmp(command.command, "call") == 0
+        || strcmp(command.command, "return") == 0 || strcmp(command.command, "function") == 0;
+}
+
+int tempReadLater(VMCommand *commands, int count, int from, int index) {
+    for (int i = from; i < count && !isBlockEnd(commands[i]); ++i) {
+        if (strcmp(commands[i].arg, "temp") == 0 && commands[i].index == index) {
+            return strcmp(commands[i].command, "push") == 0;
+        }
+    }
+    return 0;
+}
+
+// push / pop cancellation
+// 1. a push followed by a pop of the same segment and index changes nothing
+// 2. a value popped into a temp and pushed straight back can stay on the stack if the temp is not read again
+// 3. a push stored into a temp that is never read is dropped together with the store
+// temps are only scratch inside a block in the generated code, so their values die at the end of it
+int CancelPushPop(VMCommand *commands, int count) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i + 1 < count; ++i) {
+            VMCommand first = commands[i];
+            VMCommand second = commands[i + 1];
+            int samePlace = strcmp(first.arg, second.arg) == 0 && first.index == second.index;
+            int cancel = 0;
+            if (strcmp(first.command, "push") == 0 && strcmp(second.command, "pop") == 0 && samePlace) {
+                cancel = 1;
+            }
+            else if (strcmp(first.command, "pop") == 0 && strcmp(second.command, "push") == 0 && samePlace
+                && strcmp(first.arg, "temp") == 0 && !tempReadLater(commands, count, i + 2, first.index)) {
+                cancel = 1;
+            }
+            else if (strcmp(first.command, "push") == 0 && strcmp(second.command, "pop") == 0 && strcmp(second.arg, "temp") == 0
+                && !tempReadLater(commands, count, i + 2, second.index)) {
+                cancel = 1;
+            }
+            if (cancel) {
+                count = removeCommands(commands, count, i, 2);
+                i = i > 0 ? i - 2 : -1;
+                changed = 1;
+            }
+        }
+    }
+    return count;
+}
+
+/** ----------------- Whole Program ----------------- **/
+VMFunction programFunctions[MAX_VM_FUNCTIONS];
+
+int findFunction(VMFunction *functions, int count, char *name); // index of function with given name or -1
+void readName(char *text, char *name); // copies the word text starts with (at most 127 chars)
+
+int findFunction(VMFunction *functions, int count, char *name) {
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(functions[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// sscanf on the program's code would take the length of all the code after text on every call
+void readName(char *text, char *name) {
+    int length = strcspn(text, " \t\r\n");
+    if (length > 127) {
+        length = 127;
+    }
+    memcpy(name, text, length);
+    name[length] = '\0';
+}
+
+int SplitVMFunctions(char *code, VMFunction *functions) {
+    int count = 0;
+    char *line = code;
+    while (*line != '\0') {
+        if (strncmp(line, "function ", 9) == 0 && count < MAX_VM_FUNCTIONS) {
+            if (count > 0) {
+                functions[count - 1].length = line - functions[count - 1].start;
+            }
+            readName(line + 9, functions[count].name);
+            functions[count].start = line;
+            functions[count].reachable = 0;
+            count++;
+        }
+        char *end = strchr(line, '\n');
+        if (!end) {
+            line += strlen(line);
+            break;
+        }
+        line = end + 1;
+    }
+    if (count > 0) {
+        functions[count - 1].length = line - functions[count - 1].start;
+    }
+    return count;
+}
+
+// link style reachability over the call graph, starting from the program entry points
+// subroutines (user and standard library alike) that are never called are dropped from the output
+int EliminateUnusedSubroutines(char *code) {
+
+    int count = SplitVMFunctions(code, programFunctions);
+    if (count == 0) {
+        return 0;
+    }
+
+    int *worklist = malloc(MAX_VM_FUNCTIONS * sizeof(int));
+    int pending = 0;
+
+    char *entryPoints[2] = {"Main.main", "Sys.init"};
+    for (int i = 0; i < 2; ++i) {
+        int entry = findFunction(programFunctions, count, entryPoints[i]);
+        if (entry >= 0) {
+            programFunctions[entry].reachable = 1;
+            worklist[pending++] = entry;
+        }
+    }
+    if (pending == 0) { // no entry point (eg: compiling a library on its own) -- keep everything
+        free(worklist);
+        return 0;
+    }
+
+    while (pending > 0) {
+        VMFunction *function = &programFunctions[worklist[--pending]];
+        char *end = function -> start + function -> length;
+        char *call = function -> start;
+        while ((call = strstr(call, " call ")) != NULL && call < end) {
+            char callee[128];
+            readName(call + 6, callee);
+            int index = findFunction(programFunctions, count, callee);
+            if (index >= 0 && !programFunctions[index].reachable) {
+                programFunctions[index].reachable = 1;
+                worklist[pending++] = index;
+            }
+            call += 6;
+        }
+    }
+    free(worklist);
+
+    // rebuild the code with the reachable subroutines only (anything before the first subroutine is kept)
+    char *linked = malloc(strlen(code) + 1);
+    int prefix = programFunctions[0].start - code;
+    int length = prefix;
+    int removed = 0;
+    strncpy(linked, code, prefix);
+    for (int i = 0; i < count; ++i) {
+        if (programFunctions[i].reachable) {
+            memcpy(linked + length, programFunctions[i].start, programFunctions[i].length);
+            length += programFunctions[i].length;
+        }
+        else {
+            removed++;
+        }
+    }
+    linked[length] = '\0';
+    strcpy(code, linked);
+    free(linked);
+
+    return removed;
+}
+
+/** ----------------- Inlining ----------------- **/
+
+// a subroutine small enough to be substituted at its call sites
+typedef struct {
+    char name[128]; // Class.subroutine
+    char className[128];
+    int isMethod; // 1 if the body started with the push argument 0, pop pointer 0 prologue
+    int usesStatic; // statics belong to the callee's class, so it can only be inlined inside that class
+    VMCommand body[INLINE_MAX_COMMANDS]; // prologue and final return left out
+    int size;
+} InlineCandidate;
+
+VMCommand inlineBuffer[MAX_VM_COMMANDS]; // output buffer of the inliner for one subroutine
+
+int makeInlineCandidate(VMFunction function, InlineCandidate *candidate); // 1 if function can be inlined (candidate filled)
+int findInlineCandidate(InlineCandidate *candidates, int count, char *name); // index of candidate or -1
+void appendCode(char **code, int *length, int *capacity, char *text, int n); // appends n chars to a growing buffer
+
+int makeInlineCandidate(VMFunction function, InlineCandidate *candidate) {
+
+    char *text = malloc(function.length + 1);
+    strncpy(text, function.start, function.length);
+    text[function.length] = '\0';
+    int count = ParseVMCode(text, optimiserCommands);
+    free(text);
+
+    // function Class.name 0 ... return -- no locals, a single return at the end
+    if (count < 2 || optimiserCommands[0].index != 0 || strcmp(optimiserCommands[count - 1].command, "return") != 0) {
+        return 0;
+    }
+
+    int start = 1;
+    candidate -> isMethod = 0;
+    if (count >= 3 && strcmp(optimiserCommands[1].command, "push") == 0 && strcmp(optimiserCommands[1].arg, "argument") == 0 && optimiserCommands[1].index == 0
+        && strcmp(optimiserCommands[2].command, "pop") == 0 && strcmp(optimiserCommands[2].arg, "pointer") == 0 && optimiserCommands[2].index == 0) {
+        candidate -> isMethod = 1;
+        start = 3;
+    }
+
+    candidate -> size = count - 1 - start;
+    if (candidate -> size > INLINE_MAX_COMMANDS) {
+        return 0;
+    }
+
+    candidate -> usesStatic = 0;
+    for (int i = start; i < count - 1; ++i) {
+        VMCommand command = optimiserCommands[i];
+        // leaf subroutines only (so never recursive) and straight line code
+        if (strcmp(command.command, "call") == 0 || strcmp(command.command, "return") == 0 || strcmp(command.command, "label") == 0 || isJump(command)) {
+            return 0;
+        }
+        // a real call restores the caller's THIS / THAT, so the body must not change them
+        if (strcmp(command.command, "pop") == 0 && strcmp(command.arg, "pointer") == 0) {
+            return 0;
+        }
+        if (strcmp(command.arg, "local") == 0 || (strcmp(command.arg, "temp") == 0 && command.index >= INLINE_FIRST_TEMP)) {
+            return 0;
+        }
+        if (strcmp(command.arg, "static") == 0) {
+            candidate -> usesStatic = 1;
+        }
+        candidate -> body[i - start] = command;
+    }
+
+    strcpy(candidate -> name, function.name);
+    strcpy(candidate -> className, function.name);
+    char *dot = strchr(candidate -> className, '.');
+    if (dot) {
+        *dot = '\0';
+    }
+    return 1;
+}
+
+int findInlineCandidate(InlineCandidate *candidates, int count, char *name) {
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(candidates[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void appendCode(char **code, int *length, int *capacity, char *text, int n) {
+    if (*length + n + 1 > *capacity) {
+        *capacity = (*length + n + 1) * 2;
+        *code = realloc(*code, *capacity);
+    }
+    memcpy(*code + *length, text, n);
+    *length += n;
+    (*code)[*length] = '\0';
+}
+
+// substitutes the bodies of small leaf subroutines (getters, setters etc.) at their call sites
+// the arguments are popped into temp 5.. and 'argument k' in the body becomes 'temp 5+k'
+// for methods the caller's 'this' is saved in the next temp and restored after the body
+int InlineSubroutines(char *code) {
+    allocateBuffers();
+
+    int count = SplitVMFunctions(code, programFunctions);
+    if (count == 0) {
+        return 0;
+    }
+
+    InlineCandidate *candidates = malloc(count * sizeof(InlineCandidate));
+    int candidatesCount = 0;
+    for (int i = 0; i < count; ++i) {
+        if (makeInlineCandidate(programFunctions[i], &candidates[candidatesCount])) {
+            candidatesCount++;
+        }
+    }
+    if (candidatesCount == 0) {
+        free(candidates);
+        return 0;
+    }
+
+    int capacity = strlen(code) + 1;
+    int length = 0;
+    char *linked = malloc(capacity);
+    linked[0] = '\0';
+    appendCode(&linked, &length, &capacity, code, programFunctions[0].start - code); // anything before the first subroutine
+
+    int inlined = 0;
+    for (int i = 0; i < count; ++i) {
+
+        char *text = malloc(programFunctions[i].length + 1);
+        strncpy(text, programFunctions[i].start, programFunctions[i].length);
+        text[programFunctions[i].length] = '\0';
+        int commandsCount = ParseVMCode(text, optimiserCommands);
+
+        char callerClass[128];
+        strcpy(callerClass, programFunctions[i].name);
+        char *dot = strchr(callerClass, '.');
+        if (dot) {
+            *dot = '\0';
+        }
+
+        int outputCount = 0;
+        int changed = 0;
+        for (int j = 0; j < commandsCount; ++j) {
+            VMCommand command = optimiserCommands[j];
+            int index = strcmp(command.command, "call") == 0 ? findInlineCandidate(candidates, candidatesCount, command.arg) : -1;
+            InlineCandidate *candidate = index >= 0 ? &candidates[index] : NULL;
+            int arguments = command.index;
+
+            if (candidate == NULL || arguments + candidate -> isMethod > 8 - INLINE_FIRST_TEMP
+                || (candidate -> usesStatic && strcmp(candidate -> className, callerClass) != 0)
+                || outputCount + candidate -> size + 2 * arguments + 6 >= MAX_VM_COMMANDS) {
+                inlineBuffer[outputCount++] = command;
+                continue;
+            }
+
+            VMCommand inlinedCommand;
+            inlinedCommand.index = 0;
+
+            // arguments -> temps (last argument is on top of the stack)
+            for (int k = arguments - 1; k >= 0; --k) {
+                strcpy(inlinedCommand.command, "pop");
+                strcpy(inlinedCommand.arg, "temp");
+                inlinedCommand.index = INLINE_FIRST_TEMP + k;
+                inlineBuffer[outputCount++] = inlinedCommand;
+            }
+
+            // save caller's this, point this to the object
+            if (candidate -> isMethod) {
+                VMCommand prologue[4] = {
+                    {"push", "pointer", 0}, {"pop", "temp", INLINE_FIRST_TEMP + arguments},
+                    {"push", "temp", INLINE_FIRST_TEMP}, {"pop", "pointer", 0}
+                };
+                for (int k = 0; k < 4; ++k) {
+                    inlineBuffer[outputCount++] = prologue[k];
+                }
+            }
+
+            for (int k = 0; k < candidate -> size; ++k) {
+                inlinedCommand = candidate -> body[k];
+                if (strcmp(inlinedCommand.arg, "argument") == 0) {
+                    strcpy(inlinedCommand.arg, "temp");
+                    inlinedCommand.index += INLINE_FIRST_TEMP;
+                }
+                inlineBuffer[outputCount++] = inlinedCommand;
+            }
+
+            // restore caller's this
+            if (candidate -> isMethod) {
+                VMCommand epilogue[2] = {{"push", "temp", INLINE_FIRST_TEMP + arguments}, {"pop", "pointer", 0}};
+                inlineBuffer[outputCount++] = epilogue[0];
+                inlineBuffer[outputCount++] = epilogue[1];
+            }
+
+            inlined++;
+            changed = 1;
+        }
+
+        if (changed) { // inlined bodies may have constant arguments to fold
+            outputCount = CleanUpSubroutine(inlineBuffer, outputCount);
+            char *output = malloc(outputCount * 160 + 1);
+            WriteVMCode(inlineBuffer, outputCount, output);
+            appendCode(&linked, &length, &capacity, output, strlen(output));
+            free(output);
+        }
+        else {
+            appendCode(&linked, &length, &capacity, programFunctions[i].start, programFunctions[i].length);
+        }
+        free(text);
+    }
+
+    strcpy(code, linked);
+    free(linked);
+    free(candidates);
+    return inlined;
+}
+
+/** ----------------- Static Constants ----------------- **/
+
+#define STATIC_UNSAFE -1 // the static may be read before it is written
+#define STATIC_NOT_WRITTEN 0 // no write found on the straight line code followed
+#define STATIC_WRITTEN 1 // the static is certainly written before any read
+
+// a static with a single write in the program, of a constant
+typedef struct {
+    char className[128];
+    int index;
+    int writes;
+    int constant; // 1 if every write stores value
+    short value;
+    int writer; // function holding the write
+} StaticConstant;
+
+int *calleeStart; // callees of function i are callees[calleeStart[i] .. calleeStart[i + 1])
+int *callees;
+char *readsStatic; // 1 for functions reading the static being checked
+char *reachesReader; // 1 for functions that may lead to a read of it
+char *reachesWriter; // 1 for functions that may lead to its write
+char *visitedFunctions;
+
+void functionClass(char *name, char *className); // Class of Class.subroutine
+int parseFunction(VMFunction function, VMCommand *commands); // parses the vm code of one subroutine
+void markCallers(char *marks, int count); // extends marks to every function that calls a marked one
+int writtenBeforeRead(int function, StaticConstant *constant, int count); // STATIC_UNSAFE / STATIC_NOT_WRITTEN / STATIC_WRITTEN
+int optimiseFunctionText(VMFunction function, char **code, int *length, int *capacity, StaticConstant *constants, int constantsCount);
+
+void functionClass(char *name, char *className) {
+    strcpy(className, name);
+    char *dot = strchr(className, '.');
+    if (dot) {
+        *dot = '\0';
+    }
+}
+
+int parseFunction(VMFunction function, VMCommand *commands) {
+    char *text = malloc(function.length + 1);
+    strncpy(text, function.start, function.length);
+    text[function.length] = '\0';
+    int count = ParseVMCode(text, commands);
+    free(text);
+    return count;
+}
+
+void markCallers(char *marks, int count) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < count; ++i) {
+            for (int j = calleeStart[i]; j < calleeStart[i + 1] && !marks[i]; ++j) {
+                if (marks[callees[j]]) {
+                    marks[i] = 1;
+                    changed = 1;
+                }
+            }
+        }
+    }
+}
+
+// follows the straight line code at the start of function (and of the subroutines it calls there)
+// until the static is written, or something that may read it is found
+int writtenBeforeRead(int function, StaticConstant *constant, int count) {
+    if (visitedFunctions[function]) { // recursion -- give up
+        return STATIC_UNSAFE;
+    }
+    visitedFunctions[function] = 1;
+
+    char className[128];
+    functionClass(programFunctions[function].name, className);
+    int ownClass = strcmp(className, constant -> className) == 0;
+
+    VMCommand *commands = malloc(MAX_VM_COMMANDS * sizeof(VMCommand));
+    int commandsCount = parseFunction(programFunctions[function], commands);
+    int result = STATIC_NOT_WRITTEN;
+    for (int i = 1; i < commandsCount && result == STATIC_NOT_WRITTEN; ++i) {
+        VMCommand command = commands[i];
+        if (strcmp(command.command, "label") == 0 || isJump(command) || strcmp(command.command, "return") == 0) {
+            break;
+        }
+        if (ownClass && strcmp(command.arg, "static") == 0 && command.index == constant -> index) {
+            result = strcmp(command.command, "pop") == 0 ? STATIC_WRITTEN : STATIC_UNSAFE;
+        }
+        else if (strcmp(command.command, "call") == 0) {
+            int callee = findFunction(programFunctions, count, command.arg);
+            if (callee < 0) { // not in the program (standard library not emitted), cannot reach user code
+                continue;
+            }
+            if (reachesWriter[callee]) {
+                result = writtenBeforeRead(callee, constant, count);
+            }
+            if (result == STATIC_NOT_WRITTEN && reachesReader[callee]) {
+                result = STATIC_UNSAFE;
+            }
+        }
+    }
+    free(commands);
+    return result;
+}
+
+// rewrites one function with the constant statics of its class read as constants and cleans up after it
+// returns 1 if the function changed
+int optimiseFunctionText(VMFunction function, char **code, int *length, int *capacity, StaticConstant *constants, int constantsCount) {
+    char className[128];
+    functionClass(function.name, className);
+
+    int count = parseFunction(function, optimiserCommands);
+    int changed = 0;
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(optimiserCommands[i].command, "push") != 0 || strcmp(optimiserCommands[i].arg, "static") != 0) {
+            continue;
+        }
+        for (int j = 0; j < constantsCount; ++j) {
+            if (constants[j].index == optimiserCommands[i].index && strcmp(constants[j].className, className) == 0) {
+                VMCommand value[2];
+                int n = constantCommands(constants[j].value, value);
+                if (count + n - 1 > MAX_VM_COMMANDS) {
+                    break;
+                }
+                memmove(&optimiserCommands[i + n], &optimiserCommands[i + 1], (count - i - 1) * sizeof(VMCommand));
+                memcpy(&optimiserCommands[i], value, n * sizeof(VMCommand));
+                count += n - 1;
+                changed = 1;
+                break;
+            }
+        }
+    }
+    if (!changed) {
+        appendCode(code, length, capacity, function.start, function.length);
+        return 0;
+    }
+
+    count = CleanUpSubroutine(optimiserCommands, count);
+
+    char *output = malloc(count * 160 + 1);
+    WriteVMCode(optimiserCommands, count, output);
+    appendCode(code, length, capacity, output, strlen(output));
+    free(output);
+    return 1;
+}
+
+// interprocedural constant propagation of statics
+// a static whose only write in the program stores a constant (typically a setting made once by an init
+// function) is read as that constant, provided the write certainly happens before any read: following the
+// straight line start of Main.main (and of the subroutines it calls there) reaches the write before anything
+// that may read the static -- a static only ever set to 0 keeps its initial value, so needs no such check
+// the functions using them are then folded and dead code eliminated again, returns the number of statics
+int PropagateStaticConstants(char *code) {
+    allocateBuffers();
+
+    int count = SplitVMFunctions(code, programFunctions);
+    int entry = findFunction(programFunctions, count, "Main.main");
+    if (count == 0 || entry < 0) {
+        return 0;
+    }
+
+    // call graph
+    calleeStart = malloc((count + 1) * sizeof(int));
+    int edges = 0;
+    int edgesCapacity = 1024;
+    callees = malloc(edgesCapacity * sizeof(int));
+    for (int i = 0; i < count; ++i) {
+        calleeStart[i] = edges;
+        char *end = programFunctions[i].start + programFunctions[i].length;
+        char *call = programFunctions[i].start;
+        while ((call = strstr(call, " call ")) != NULL && call < end) {
+            char callee[128];
+            readName(call + 6, callee);
+            int index = findFunction(programFunctions, count, callee);
+            if (index >= 0) {
+                if (edges == edgesCapacity) {
+                    edgesCapacity *= 2;
+                    callees = realloc(callees, edgesCapacity * sizeof(int));
+                }
+                callees[edges++] = index;
+            }
+            call += 6;
+        }
+    }
+    calleeStart[count] = edges;
+
+    // writes of every static
+    int constantsCapacity = 64;
+    int constantsCount = 0;
+    StaticConstant *constants = malloc(constantsCapacity * sizeof(StaticConstant));
+    for (int i = 0; i < count; ++i) {
+        char className[128];
+        functionClass(programFunctions[i].name, className);
+        int commandsCount = parseFunction(programFunctions[i], optimiserCommands);
+        if (commandsCount < 0) { // too large to read, it may write any static of its class
+            constantsCount = 0;
+            break;
+        }
+        for (int j = 0; j < commandsCount; ++j) {
+            if (strcmp(optimiserCommands[j].command, "pop") != 0 || strcmp(optimiserCommands[j].arg, "static") != 0) {
+                continue;
+            }
+            int k = 0;
+            while (k < constantsCount && !(constants[k].index == optimiserCommands[j].index && strcmp(constants[k].className, className) == 0)) {
+                k++;
+            }
+            if (k == constantsCount) {
+                if (constantsCount == constantsCapacity) {
+                    constantsCapacity *= 2;
+                    constants = realloc(constants, constantsCapacity * sizeof(StaticConstant));
+                }
+                strcpy(constants[k].className, className);
+                constants[k].index = optimiserCommands[j].index;
+                constants[k].writes = 0;
+                constants[k].writer = i;
+                constantsCount++;
+            }
+            int start;
+            short value;
+            int isConstant = constantBefore(optimiserCommands, j, &start, &value);
+            constants[k].constant = (constants[k].writes == 0 || (constants[k].constant && constants[k].value == value)) && isConstant;
+            constants[k].value = value;
+            constants[k].writes++;
+        }
+    }
+
+    // keep the statics that are safe to read as constants
+    readsStatic = malloc(count);
+    reachesReader = malloc(count);
+    reachesWriter = malloc(count);
+    visitedFunctions = malloc(count);
+    int kept = 0;
+    for (int k = 0; k < constantsCount; ++k) {
+        StaticConstant *constant = &constants[k];
+        if (!constant -> constant || constant -> writes != 1) {
+            continue;
+        }
+        if (constant -> value != 0) {
+            char read[160];
+            sprintf(read, " push static %d\n", constant -> index);
+            for (int i = 0; i < count; ++i) {
+                char className[128];
+                functionClass(programFunctions[i].name, className);
+                char *found = strcmp(className, constant -> className) == 0 ? strstr(programFunctions[i].start, read) : NULL;
+                readsStatic[i] = found != NULL && found < programFunctions[i].start + programFunctions[i].length;
+            }
+            memcpy(reachesReader, readsStatic, count);
+            markCallers(reachesReader, count);
+            memset(reachesWriter, 0, count);
+            reachesWriter[constant -> writer] = 1;
+            markCallers(reachesWriter, count);
+            memset(visitedFunctions, 0, count);
+            if (writtenBeforeRead(entry, constant, count) != STATIC_WRITTEN) {
+                continue;
+            }
+        }
+        constants[kept++] = *constant;
+    }
+    free(readsStatic);
+    free(reachesReader);
+    free(reachesWriter);
+    free(visitedFunctions);
+    free(calleeStart);
+    free(callees);
+
+    if (kept > 0) {
+        int capacity = strlen(code) + 1;
+        int length = 0;
+        char *linked = malloc(capacity);
+        linked[0] = '\0';
+        appendCode(&linked, &length, &capacity, code, programFunctions[0].start - code); // anything before the first subroutine
+        for (int i = 0; i < count; ++i) {
+            optimiseFunctionText(programFunctions[i], &linked, &length, &capacity, constants, kept);
+        }
+        strcpy(code, linked);
+        free(linked);
+    }
+    free(constants);
+    return kept;
+}
+
+/** ----------------- Pipeline ----------------- **/
+
+int numberLabelsPass(VMCommand *commands, int count);
+int countVMCommands(char *code); // number of commands in vm code text
+double passClock(); // wall clock in seconds
+OptimiserPass *findPass(char *name);
+
+int numberLabelsPass(VMCommand *commands, int count) {
+    NumberLabels(commands, count);
+    return count;
+}
+
+// in pipeline order -- code generation passes are applied by the parser while it emits the code
+// level 3 passes are never run by an optimisation level, only when asked for
+OptimiserPass passes[] = {
+    {.name = "strength", .level = 1, .description = "multiplications by constants as shift-add sequences (code generation)"},
+    {.name = "shortcircuit", .level = 1, .description = "boolean & / | conditions as jump chains (code generation)"},
+    {.name = "strings", .level = 2, .description = "string literals built once per class (code generation)"},
+    {.name = "tailcalls", .level = 3, .description = "self tail calls as jumps (code generation, also -tailcalls)"},
+    {.name = "fold", .level = 1, .description = "constant folding", .subroutinePass = FoldConstants},
+    {.name = "peephole", .level = 1, .description = "push / pop cancellation", .subroutinePass = CancelPushPop},
+    {.name = "dce", .level = 1, .description = "constant branches, unreachable code and unused labels", .subroutinePass = EliminateDeadCode},
+    {.name = "jumps", .level = 1, .description = "jump threading", .subroutinePass = ThreadJumps},
+    {.name = "licm", .level = 2, .description = "loop invariant code motion", .subroutinePass = MoveLoopInvariants},
+    {.name = "cse", .level = 2, .description = "common subexpression elimination", .subroutinePass = EliminateCommonSubexpressions},
+    {.name = "slots", .level = 2, .description = "local slot sharing", .subroutinePass = AllocateLocalSlots},
+    {.name = "labels", .level = 1, .description = "labels numbered per subroutine", .subroutinePass = numberLabelsPass},
+    {.name = "statics", .level = 2, .description = "constant propagation of write-once statics", .programPass = PropagateStaticConstants},
+    {.name = "inline", .level = 2, .description = "inlining of small leaf subroutines", .programPass = InlineSubroutines},
+    {.name = "link", .level = 1, .description = "removal of unreachable subroutines", .programPass = EliminateUnusedSubroutines},
+};
+int passesCount = sizeof passes / sizeof passes[0];
+
+OptimiserPass *findPass(char *name) {
+    for (int i = 0; i < passesCount; ++i) {
+        if (strcmp(passes[i].name, name) == 0) {
+            return &passes[i];
+        }
+    }
+    return NULL;
+}
+
+int PassEnabled(char *name) {
+    OptimiserPass *pass = findPass(name);
+    if (pass == NULL) {
+        return 0;
+    }
+    return pass -> override ? pass -> override > 0 : optimisationLevel >= pass -> level;
+}
+
+int SetPassEnabled(char *name, int enabled) {
+    OptimiserPass *pass = findPass(name);
+    if (pass == NULL) {
+        return 0;
+    }
+    pass -> override = enabled ? 1 : -1;
+    return 1;
+}
+
+int countVMCommands(char *code) {
+    int count = 0;
+    for (char *line = code; *line != '\0'; ) {
+        char *end = strchr(line, '\n');
+        if (end != line) {
+            count++;
+        }
+        if (!end) {
+            break;
+        }
+        line = end + 1;
+    }
+    return count;
+}
+
+void allocateBuffers() {
+    if (optimiserCommands != NULL) {
+        return;
+    }
+    // calloc leaves the pages to be mapped as they are touched, most subroutines use few of them
+    optimiserCommands = calloc(MAX_VM_COMMANDS, sizeof(VMCommand));
+    conditionNodes = calloc(MAX_VM_COMMANDS, sizeof(ConditionNode));
+    conditionCommands = calloc(MAX_VM_COMMANDS, sizeof(VMCommand));
+    branchCommands = calloc(MAX_VM_COMMANDS, sizeof(VMCommand));
+    loopStack = calloc(MAX_VM_COMMANDS, sizeof(LoopValue));
+    hoistRanges = calloc(MAX_VM_COMMANDS, sizeof(LoopValue));
+    hoistLocals = calloc(MAX_VM_COMMANDS, sizeof(int));
+    preheaderCommands = calloc(MAX_VM_COMMANDS, sizeof(VMCommand));
+    valueNumbers = calloc(MAX_VM_COMMANDS, sizeof(ValueNumber));
+    occurrences = calloc(MAX_VM_COMMANDS, sizeof(Occurrence));
+    occurrenceStack = calloc(MAX_VM_COMMANDS, sizeof(int));
+    replacedTemp = calloc(MAX_VM_COMMANDS, sizeof(int));
+    replacedEnd = calloc(MAX_VM_COMMANDS, sizeof(int));
+    savedTemp = calloc(MAX_VM_COMMANDS, sizeof(int));
+    cseCommands = calloc(MAX_VM_COMMANDS, sizeof(VMCommand));
+    liveIn = calloc(MAX_VM_COMMANDS, sizeof(LocalSet));
+    liveOut = calloc(MAX_VM_COMMANDS, sizeof(LocalSet));
+    interference = calloc(MAX_LOCAL_SLOTS, sizeof(LocalSet));
+}
+
+void FreeOptimiserBuffers() {
+    free(optimiserCommands);
+    free(conditionNodes);
+    free(conditionCommands);
+    free(branchCommands);
+    free(loopStack);
+    free(hoistRanges);
+    free(hoistLocals);
+    free(preheaderCommands);
+    free(valueNumbers);
+    free(occurrences);
+    free(occurrenceStack);
+    free(replacedTemp);
+    free(replacedEnd);
+    free(savedTemp);
+    free(cseCommands);
+    free(liveIn);
+    free(liveOut);
+    free(interference);
+    optimiserCommands = NULL;
+}
+
+double passClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// the passes run again by the whole program passes on the subroutines they change (no statistics)
+int CleanUpSubroutine(VMCommand *commands, int count) {
+    char *cleanUp[5] = {"fold", "peephole", "dce", "jumps", "labels"};
+    for (int i = 0; i < 5; ++i) {
+        if (PassEnabled(cleanUp[i])) {
+            count = findPass(cleanUp[i]) -> subroutinePass(commands, count);
+        }
+    }
+    return count;
+}
+
+// a subroutine of more than MAX_VM_COMMANDS commands, or whose optimised code would not fit the buffer, is left as it is
+void OptimiseSubroutine(char *code, int size) {
+    allocateBuffers();
+    int count = ParseVMCode(code, optimiserCommands);
+    if (count < 0) {
+        return;
+    }
+    int changed = 0;
+    for (int i = 0; i < passesCount; ++i) {
+        OptimiserPass *pass = &passes[i];
+        if (pass -> subroutinePass == NULL || !PassEnabled(pass -> name)) {
+            continue;
+        }
+        double start = passClock();
+        int before = count;
+        count = pass -> subroutinePass(optimiserCommands, count);
+        double seconds = passClock() - start;
+        pthread_mutex_lock(&passStatisticsLock);
+        pass -> commandsBefore += before;
+        pass -> commandsAfter += count;
+        pass -> seconds += seconds;
+        pass -> runs++;
+        pthread_mutex_unlock(&passStatisticsLock);
+        changed = 1;
+    }
+    if (changed && VMCodeLength(optimiserCommands, count) < size) {
+        WriteVMCode(optimiserCommands, count, code);
+    }
+}
+
+void RunProgramPasses(char *code) {
+    for (int i = 0; i < passesCount; ++i) {
+        OptimiserPass *pass = &passes[i];
+        if (pass -> programPass == NULL || !PassEnabled(pass -> name)) {
+            continue;
+        }
+        double start = passClock();
+        pass -> commandsBefore += countVMCommands(code);
+        pass -> programPass(code);
+        pass -> commandsAfter += countVMCommands(code);
+        pass -> seconds += passClock() - start;
+        pass -> runs++;
+    }
+}
+
+void PrintPassReport() {
+    printf("%-14s %5s %6s %10s %10s %8s %10s\n", "pass", "level", "runs", "before", "after", "change", "time (ms)");
+    for (int i = 0; i < passesCount; ++i) {
+        OptimiserPass pass = passes[i];
+        char level[8];
+        sprintf(level, "%d%s", pass.level, pass.override > 0 ? "+" : pass.override < 0 ? "-" : ""); // + / - forced on / off
+        if (pass.subroutinePass == NULL && pass.programPass == NULL) {
+            printf("%-14s %5s %6s %10s %10s %8s %10s\n", pass.name, level, PassEnabled(pass.name) ? "on" : "off", "-", "-", "-", "-");
+            continue;
+        }
+        printf("%-14s %5s %6d %10ld %10ld %+8ld %10.3f\n", pass.name, level, pass.runs, pass.commandsBefore, pass.commandsAfter,
+            pass.commandsAfter - pass.commandsBefore, pass.seconds * 1000);
+    }
+}
+
+void ResetPassStatistics() {
+    for (int i = 0; i < passesCount; ++i) {
+        passes[i].runs = 0;
+        passes[i].commandsBefore = 0;
+        passes[i].commandsAfter = 0;
+        passes[i].seconds = 0;
+    }
+}
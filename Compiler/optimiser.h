@@ -0,0 +1,73 @@
+#ifndef OPTIMISER_H
+#define OPTIMISER_H
+
+#define MAX_VM_COMMANDS 16384 // max number of vm commands in a single subroutine
+
+// represents a single vm command (eg: push constant 5 -> command = push, arg = constant, index = 5)
+typedef struct {
+    char command[16]; // push, pop, add, label, goto, if-goto, function, call, return etc.
+    char arg[128]; // segment, label or function name -- empty for arithmetic / logical commands
+    int index; // segment index, number of locals or number of arguments -- 0 if not used
+} VMCommand;
+
+int ParseVMCode(char *code, VMCommand *commands); // splits vm code text into commands, returns the number of commands (-1 if more than MAX_VM_COMMANDS)
+void WriteVMCode(VMCommand *commands, int count, char *code); // writes the commands back as vm code text
+int VMCodeLength(VMCommand *commands, int count); // length of the text WriteVMCode writes for the commands
+
+int EliminateDeadCode(VMCommand *commands, int count); // removes constant branches, unreachable code and unused labels
+int MoveLoopInvariants(VMCommand *commands, int count); // hoists invariant computations out of loops into new locals
+int EliminateCommonSubexpressions(VMCommand *commands, int count); // reuses values computed earlier in the same basic block
+int AllocateLocalSlots(VMCommand *commands, int count); // lets locals with disjoint lifetimes share a slot, shrinking the frame
+int ThreadJumps(VMCommand *commands, int count); // merges adjacent labels, shortcuts jumps to gotos, removes gotos to the next command
+void NumberLabels(VMCommand *commands, int count); // renames the labels of a subroutine L0, L1, ... in order
+int FoldConstants(VMCommand *commands, int count); // replaces arithmetic / logical commands on constants by their result
+int CancelPushPop(VMCommand *commands, int count); // removes push / pop pairs that have no effect
+int ShortCircuitCondition(char *condition, int size, int falseLabel, int *labelCounter); // compiles a condition (in a buffer of size bytes) to a jump chain, 0 if not possible
+
+/** Whole program **/
+#define MAX_VM_FUNCTIONS 4096 // max number of subroutines in a program
+
+// represents one subroutine inside the program's vm code
+typedef struct {
+    char name[128]; // Class.subroutine
+    char *start; // start of the 'function' line inside the vm code
+    int length; // length of the subroutine code (function line included)
+    int reachable; // 1 if reachable from the program entry points
+} VMFunction;
+
+int SplitVMFunctions(char *code, VMFunction *functions); // indexes the subroutines in code, returns their number
+int EliminateUnusedSubroutines(char *code); // removes subroutines unreachable from Main.main / Sys.init, returns how many were removed
+
+#define INLINE_MAX_COMMANDS 8 // largest subroutine body (in vm commands) substituted at its call sites
+#define INLINE_FIRST_TEMP 5 // inlined arguments and the caller's saved 'this' live in temp 5..7
+
+int InlineSubroutines(char *code); // substitutes small leaf subroutines at their call sites, returns the number of calls inlined
+int PropagateStaticConstants(char *code); // reads statics written once with a constant as that constant, returns how many
+
+/** Pipeline **/
+
+// a pass of the optimisation pipeline, run from optimisation level 'level' up unless -f<name> / -fno-<name> say otherwise
+typedef struct {
+    char *name;
+    int level; // lowest -O level running the pass
+    char *description;
+    int (*subroutinePass)(VMCommand *commands, int count); // set for passes over one subroutine at a time
+    int (*programPass)(char *code); // set for passes over the vm code of the whole program
+    int override; // 1 if forced on, -1 if forced off, 0 to follow the optimisation level
+    // statistics
+    int runs;
+    long commandsBefore;
+    long commandsAfter;
+    double seconds;
+} OptimiserPass;
+
+int PassEnabled(char *name); // 1 if the pass runs with the current optimisation level and flags
+int SetPassEnabled(char *name, int enabled); // for -f<name> / -fno-<name>, returns 0 if there is no such pass
+void OptimiseSubroutine(char *code, int size); // runs the subroutine passes on the vm code of one subroutine (in place, in a buffer of size bytes)
+int CleanUpSubroutine(VMCommand *commands, int count); // folding, push / pop cancellation, dead code and jumps -- after whole program passes
+void RunProgramPasses(char *code); // runs the whole program passes on the vm code of the program (in place)
+void PrintPassReport(); // vm command counts before / after and time of every pass
+void ResetPassStatistics();
+void FreeOptimiserBuffers(); // frees the pass buffers of the calling thread, before it ends
+
+#endif
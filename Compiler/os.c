@@ -0,0 +1,481 @@
+/************************************************************************
+University of Leeds
+School of Computing
+COMP2932- Compiler Design and Construction
+The OS Module
+
+The standard library classes as native code on a 16 bit hack memory, shared by
+the vm interpreter, the JIT and the runtime of native executables.
+They are headless: Screen only draws into its memory map, Output prints to
+stdout and Keyboard reads stdin.
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "os.h"
+
+int16_t vmRam[VM_RAM_SIZE];
+int vmHalted; // set by Sys.halt, Sys.error and the OS errors
+int vmStatus; // 1 if the program ended normally
+int screenColor; // 1 black, 0 white
+int freeList; // first free heap segment, segments are [length, next, ...]
+
+int16_t vmError(int errorCode); // Sys.error -- prints ERR<errorCode> and halts
+int16_t heapAlloc(int size);
+void heapFree(int block);
+int integerSqrt(int x);
+void outputChar(int c);
+void setPixel(int x, int y);
+void drawSpan(int x1, int x2, int y); // pixels x1..x2 of row y
+
+int16_t vmError(int errorCode) {
+    printf("ERR%d\n", errorCode);
+    vmHalted = 1;
+    vmStatus = 0;
+    return 0;
+}
+
+// first fit over the free list -- blocks are carved from the end of a segment, the word before a block holds its length
+int16_t heapAlloc(int size) {
+    if (size <= 0) {
+        return vmError(5);
+    }
+    int previous = 0;
+    for (int segment = freeList; segment != 0; previous = segment, segment = (uint16_t)vmRam[segment + 1]) {
+        int length = vmRam[segment];
+        if (length >= size + 3) { // split, the rest stays a segment of at least [length, next]
+            vmRam[segment] = length - size - 1;
+            int block = segment + vmRam[segment] + 1;
+            vmRam[block - 1] = size + 1;
+            return block;
+        }
+        if (length >= size + 1) { // use the whole segment
+            if (previous) {
+                vmRam[previous + 1] = vmRam[segment + 1];
+            }
+            else {
+                freeList = (uint16_t)vmRam[segment + 1];
+            }
+            return segment + 1;
+        }
+    }
+    return vmError(6);
+}
+
+void heapFree(int block) {
+    int segment = (uint16_t)(block - 1);
+    vmRam[(uint16_t)(segment + 1)] = freeList;
+    freeList = segment;
+}
+
+int integerSqrt(int x) {
+    int y = 0;
+    for (int bit = 1 << 14; bit > 0; bit >>= 1) {
+        if ((y + bit) * (y + bit) <= x) {
+            y += bit;
+        }
+    }
+    return y;
+}
+
+int16_t osNothing(int16_t *args) {
+    return 0;
+}
+
+int16_t mathAbs(int16_t *args) {
+    return args[0] < 0 ? -args[0] : args[0];
+}
+
+int16_t mathMultiply(int16_t *args) {
+    return (int16_t)(args[0] * args[1]);
+}
+
+int16_t mathDivide(int16_t *args) {
+    if (args[1] == 0) {
+        return vmError(3);
+    }
+    return (int16_t)(args[0] / args[1]);
+}
+
+int16_t mathSqrt(int16_t *args) {
+    if (args[0] < 0) {
+        return vmError(4);
+    }
+    return integerSqrt(args[0]);
+}
+
+int16_t mathMax(int16_t *args) {
+    return args[0] > args[1] ? args[0] : args[1];
+}
+
+int16_t mathMin(int16_t *args) {
+    return args[0] < args[1] ? args[0] : args[1];
+}
+
+int16_t memoryPeek(int16_t *args) {
+    return vmRam[(uint16_t)args[0]];
+}
+
+int16_t memoryPoke(int16_t *args) {
+    vmRam[(uint16_t)args[0]] = args[1];
+    return 0;
+}
+
+int16_t memoryAlloc(int16_t *args) {
+    return heapAlloc(args[0]);
+}
+
+int16_t memoryDeAlloc(int16_t *args) {
+    heapFree(args[0]);
+    return 0;
+}
+
+int16_t arrayNew(int16_t *args) {
+    if (args[0] <= 0) {
+        return vmError(2);
+    }
+    return heapAlloc(args[0]);
+}
+
+// strings are [maxLength, length, characters...]
+int16_t stringNew(int16_t *args) {
+    if (args[0] < 0) {
+        return vmError(14);
+    }
+    int16_t string = heapAlloc(args[0] + 2);
+    if (!vmHalted) {
+        vmRam[(uint16_t)string] = args[0];
+        vmRam[(uint16_t)(string + 1)] = 0;
+    }
+    return string;
+}
+
+int16_t stringLength(int16_t *args) {
+    return vmRam[(uint16_t)(args[0] + 1)];
+}
+
+int16_t stringCharAt(int16_t *args) {
+    if (args[1] < 0 || args[1] >= vmRam[(uint16_t)(args[0] + 1)]) {
+        return vmError(15);
+    }
+    return vmRam[(uint16_t)(args[0] + 2 + args[1])];
+}
+
+int16_t stringSetCharAt(int16_t *args) {
+    if (args[1] < 0 || args[1] >= vmRam[(uint16_t)(args[0] + 1)]) {
+        return vmError(16);
+    }
+    vmRam[(uint16_t)(args[0] + 2 + args[1])] = args[2];
+    return 0;
+}
+
+int16_t stringAppendChar(int16_t *args) {
+    int16_t length = vmRam[(uint16_t)(args[0] + 1)];
+    if (length >= vmRam[(uint16_t)args[0]]) {
+        return vmError(17);
+    }
+    vmRam[(uint16_t)(args[0] + 2 + length)] = args[1];
+    vmRam[(uint16_t)(args[0] + 1)] = length + 1;
+    return args[0];
+}
+
+int16_t stringEraseLastChar(int16_t *args) {
+    if (vmRam[(uint16_t)(args[0] + 1)] == 0) {
+        return vmError(18);
+    }
+    vmRam[(uint16_t)(args[0] + 1)]--;
+    return 0;
+}
+
+int16_t stringIntValue(int16_t *args) {
+    int length = vmRam[(uint16_t)(args[0] + 1)];
+    int i = 0;
+    int negative = length > 0 && vmRam[(uint16_t)(args[0] + 2)] == '-';
+    int16_t value = 0;
+    for (i = negative; i < length; ++i) {
+        int c = vmRam[(uint16_t)(args[0] + 2 + i)];
+        if (c < '0' || c > '9') {
+            break;
+        }
+        value = (int16_t)(value * 10 + c - '0');
+    }
+    return negative ? -value : value;
+}
+
+int16_t stringSetInt(int16_t *args) {
+    char digits[16];
+    int length = sprintf(digits, "%d", args[1]);
+    if (length > vmRam[(uint16_t)args[0]]) {
+        return vmError(19);
+    }
+    for (int i = 0; i < length; ++i) {
+        vmRam[(uint16_t)(args[0] + 2 + i)] = digits[i];
+    }
+    vmRam[(uint16_t)(args[0] + 1)] = length;
+    return 0;
+}
+
+int16_t stringNewLine(int16_t *args) {
+    return 128;
+}
+
+int16_t stringBackSpace(int16_t *args) {
+    return 129;
+}
+
+int16_t stringDoubleQuote(int16_t *args) {
+    return 34;
+}
+
+void outputChar(int c) {
+    if (c == 128) {
+        putchar('\n');
+    }
+    else if (c == 129) {
+        putchar('\b');
+    }
+    else {
+        putchar(c);
+    }
+}
+
+int16_t outputMoveCursor(int16_t *args) {
+    if (args[0] < 0 || args[0] > 22 || args[1] < 0 || args[1] > 63) {
+        return vmError(20);
+    }
+    return 0; // headless -- there is no cursor on stdout
+}
+
+int16_t outputPrintChar(int16_t *args) {
+    outputChar(args[0]);
+    return 0;
+}
+
+int16_t outputPrintString(int16_t *args) {
+    int length = vmRam[(uint16_t)(args[0] + 1)];
+    for (int i = 0; i < length; ++i) {
+        outputChar(vmRam[(uint16_t)(args[0] + 2 + i)]);
+    }
+    return 0;
+}
+
+int16_t outputPrintInt(int16_t *args) {
+    printf("%d", args[0]);
+    return 0;
+}
+
+int16_t outputPrintln(int16_t *args) {
+    putchar('\n');
+    return 0;
+}
+
+int16_t outputBackSpace(int16_t *args) {
+    putchar('\b');
+    return 0;
+}
+
+void setPixel(int x, int y) {
+    int address = VM_SCREEN + y * 32 + x / 16;
+    int16_t bit = (int16_t)(1 << (x % 16));
+    if (screenColor) {
+        vmRam[address] |= bit;
+    }
+    else {
+        vmRam[address] &= ~bit;
+    }
+}
+
+void drawSpan(int x1, int x2, int y) {
+    int x = x1;
+    while (x <= x2) {
+        if (x % 16 == 0 && x + 15 <= x2) { // whole word
+            vmRam[VM_SCREEN + y * 32 + x / 16] = screenColor ? -1 : 0;
+            x += 16;
+        }
+        else {
+            setPixel(x, y);
+            x++;
+        }
+    }
+}
+
+int16_t screenClearScreen(int16_t *args) {
+    memset(vmRam + VM_SCREEN, 0, (VM_KEYBOARD - VM_SCREEN) * sizeof(int16_t));
+    return 0;
+}
+
+int16_t screenSetColor(int16_t *args) {
+    screenColor = args[0] != 0;
+    return 0;
+}
+
+int16_t screenDrawPixel(int16_t *args) {
+    if (args[0] < 0 || args[0] > 511 || args[1] < 0 || args[1] > 255) {
+        return vmError(7);
+    }
+    setPixel(args[0], args[1]);
+    return 0;
+}
+
+int16_t screenDrawLine(int16_t *args) {
+    int x1 = args[0], y1 = args[1], x2 = args[2], y2 = args[3];
+    if (x1 < 0 || x1 > 511 || x2 < 0 || x2 > 511 || y1 < 0 || y1 > 255 || y2 < 0 || y2 > 255) {
+        return vmError(8);
+    }
+    int dx = abs(x2 - x1), dy = -abs(y2 - y1);
+    int stepX = x1 < x2 ? 1 : -1, stepY = y1 < y2 ? 1 : -1;
+    int error = dx + dy;
+    while (1) {
+        setPixel(x1, y1);
+        if (x1 == x2 && y1 == y2) {
+            break;
+        }
+        int doubled = 2 * error; // both steps test the error from before either of them
+        if (doubled >= dy) {
+            error += dy;
+            x1 += stepX;
+        }
+        if (doubled <= dx) {
+            error += dx;
+            y1 += stepY;
+        }
+    }
+    return 0;
+}
+
+int16_t screenDrawRectangle(int16_t *args) {
+    if (args[0] > args[2] || args[1] > args[3] || args[0] < 0 || args[2] > 511 || args[1] < 0 || args[3] > 255) {
+        return vmError(9);
+    }
+    for (int y = args[1]; y <= args[3]; ++y) {
+        drawSpan(args[0], args[2], y);
+    }
+    return 0;
+}
+
+int16_t screenDrawCircle(int16_t *args) {
+    int x = args[0], y = args[1], r = args[2];
+    if (x < 0 || x > 511 || y < 0 || y > 255) {
+        return vmError(12);
+    }
+    if (r < 0 || r > 181) {
+        return vmError(13);
+    }
+    for (int dy = -r; dy <= r; ++dy) {
+        int half = integerSqrt(r * r - dy * dy);
+        int row = y + dy;
+        if (row >= 0 && row <= 255) {
+            drawSpan(x - half < 0 ? 0 : x - half, x + half > 511 ? 511 : x + half, row);
+        }
+    }
+    return 0;
+}
+
+int16_t keyboardKeyPressed(int16_t *args) {
+    return vmRam[VM_KEYBOARD]; // headless -- only set if the program pokes it
+}
+
+int16_t keyboardReadChar(int16_t *args) {
+    int c = getchar();
+    return (c == EOF || c == '\n') ? 128 : c;
+}
+
+int16_t keyboardReadLine(int16_t *args) {
+    outputPrintString(args);
+    int16_t maxLength = 80;
+    int16_t line = stringNew(&maxLength);
+    if (vmHalted) {
+        return 0;
+    }
+    int16_t c = keyboardReadChar(NULL);
+    while (c != 128) {
+        if (vmRam[(uint16_t)(line + 1)] < maxLength) {
+            int16_t appendArgs[2] = {line, c};
+            stringAppendChar(appendArgs);
+        }
+        c = keyboardReadChar(NULL);
+    }
+    return line;
+}
+
+int16_t keyboardReadInt(int16_t *args) {
+    int16_t line = keyboardReadLine(args);
+    if (vmHalted) {
+        return 0;
+    }
+    int16_t value = stringIntValue(&line);
+    heapFree(line);
+    return value;
+}
+
+int16_t sysHalt(int16_t *args) {
+    vmHalted = 1;
+    return 0;
+}
+
+int16_t sysError(int16_t *args) {
+    return vmError(args[0]);
+}
+
+int16_t sysWait(int16_t *args) {
+    if (args[0] < 0) {
+        return vmError(1);
+    }
+    return 0; // headless -- no frames to wait for
+}
+
+// calls to these are run by the vm, even when the program has vm code for them (the std lib sources are stubs)
+VMBuiltin vmBuiltins[] = {
+    {"Math.init", 0, osNothing}, {"Math.abs", 1, mathAbs}, {"Math.multiply", 2, mathMultiply}, {"Math.divide", 2, mathDivide},
+    {"Math.sqrt", 1, mathSqrt}, {"Math.max", 2, mathMax}, {"Math.min", 2, mathMin},
+    {"Memory.init", 0, osNothing}, {"Memory.peek", 1, memoryPeek}, {"Memory.poke", 2, memoryPoke},
+    {"Memory.alloc", 1, memoryAlloc}, {"Memory.deAlloc", 1, memoryDeAlloc},
+    {"Array.new", 1, arrayNew}, {"Array.dispose", 1, memoryDeAlloc},
+    {"String.new", 1, stringNew}, {"String.dispose", 1, memoryDeAlloc}, {"String.length", 1, stringLength},
+    {"String.charAt", 2, stringCharAt}, {"String.setCharAt", 3, stringSetCharAt}, {"String.appendChar", 2, stringAppendChar},
+    {"String.eraseLastChar", 1, stringEraseLastChar}, {"String.intValue", 1, stringIntValue}, {"String.setInt", 2, stringSetInt},
+    {"String.newLine", 0, stringNewLine}, {"String.backSpace", 0, stringBackSpace}, {"String.doubleQuote", 0, stringDoubleQuote},
+    {"Output.init", 0, osNothing}, {"Output.moveCursor", 2, outputMoveCursor}, {"Output.printChar", 1, outputPrintChar},
+    {"Output.printString", 1, outputPrintString}, {"Output.printInt", 1, outputPrintInt}, {"Output.println", 0, outputPrintln},
+    {"Output.backSpace", 0, outputBackSpace},
+    {"Screen.init", 0, osNothing}, {"Screen.clearScreen", 0, screenClearScreen}, {"Screen.setColor", 1, screenSetColor},
+    {"Screen.drawPixel", 2, screenDrawPixel}, {"Screen.drawLine", 4, screenDrawLine}, {"Screen.drawRectangle", 4, screenDrawRectangle},
+    {"Screen.drawCircle", 3, screenDrawCircle},
+    {"Keyboard.init", 0, osNothing}, {"Keyboard.keyPressed", 0, keyboardKeyPressed}, {"Keyboard.readChar", 0, keyboardReadChar},
+    {"Keyboard.readLine", 1, keyboardReadLine}, {"Keyboard.readInt", 1, keyboardReadInt},
+    {"Sys.halt", 0, sysHalt}, {"Sys.error", 1, sysError}, {"Sys.wait", 1, sysWait},
+};
+int vmBuiltinCount = sizeof vmBuiltins / sizeof vmBuiltins[0];
+
+void BootOS() {
+    memset(vmRam, 0, sizeof vmRam);
+    freeList = VM_HEAP_BASE;
+    vmRam[VM_HEAP_BASE] = VM_SCREEN - VM_HEAP_BASE;
+    vmRam[VM_HEAP_BASE + 1] = 0;
+    screenColor = 1;
+    vmHalted = 0;
+    vmStatus = 1;
+}
+
+int SaveVMScreen(char *filename) {
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        printf("Could not open screen output file %s.\n", filename);
+        return 0;
+    }
+    fprintf(fp, "P4\n512 256\n");
+    for (int y = 0; y < 256; ++y) {
+        for (int x = 0; x < 512; x += 8) { // bit 0 of a word is its leftmost pixel, pbm bytes start with the leftmost
+            unsigned char bits = 0;
+            for (int i = 0; i < 8; ++i) {
+                int word = vmRam[VM_SCREEN + y * 32 + (x + i) / 16];
+                bits = bits << 1 | ((word >> ((x + i) % 16)) & 1);
+            }
+            fputc(bits, fp);
+        }
+    }
+    fclose(fp);
+    return 1;
+}
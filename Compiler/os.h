@@ -0,0 +1,25 @@
+#ifndef OS_H
+#define OS_H
+
+#include <stdint.h>
+
+#define VM_RAM_SIZE 65536 // addresses are 16 bit words, so any address a program computes is inside the ram
+
+// hack memory map
+#define VM_STATIC_BASE 16 // statics of all classes, 16..255
+#define VM_STACK_BASE 256
+#define VM_HEAP_BASE 2048
+#define VM_SCREEN 16384 // 256 rows of 512 pixels, 32 words a row
+#define VM_KEYBOARD 24576 // code of the key currently pressed, 0 if none
+
+// an OS subroutine implemented natively -- args points to the arguments on the stack
+typedef struct {
+    char *name;
+    int args;
+    int16_t (*run)(int16_t *args);
+} VMBuiltin;
+
+void BootOS(); // clears the ram and starts the OS for a new run
+int SaveVMScreen(char *filename); // writes the screen memory map as a pbm image
+
+#endif
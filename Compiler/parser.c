@@ -5,18 +5,25 @@
 #include "lexer.h"
 #include "parser.h"
 #include "symbols.h"
+#include "optimiser.h"
 
 // you can declare prototypes of parser functions below
 
+// The state of the file being parsed is per thread (_Thread_local), so that the files of a program can be
+// compiled concurrently -- see UseParserContext
+
 // Semantic Analysis Variables
-SymbolTable tables[512];
-Symbol thisSymbol; // used to store the data needed for the this ref in method tables
-int counter = 0; // used for symbol table array indexing
-int previousClassCounter = 0; 
+SymbolTable programTables[MAX_SYMBOL_TABLES]; // the stdlib's tables, then the tables merged from every file
+int programTableCount = 0; // index of the last table in programTables
+_Thread_local SymbolTable *tables = programTables; // programTables, or the tables of the file of pass 1
+_Thread_local Symbol thisSymbol; // used to store the data needed for the this ref in method tables
+_Thread_local int counter = 0; // used for symbol table array indexing
+_Thread_local int previousClassCounter = 0; 
+_Thread_local ParserContext *parserContext = NULL; // of the file being parsed, NULL when parsing into the program's state
 
 // Used for second pass
-int initialCounter = 0;
-int initialClassCounter = 0;
+_Thread_local int initialCounter = 0;
+_Thread_local int initialClassCounter = 0;
 extern int globalPass; // from compiler.c
 extern int standardPass; // from compiler.c
 
@@ -24,27 +31,53 @@ extern int standardPass; // from compiler.c
 // increases on scope entry, decreases on scope exit
 // 1 = top class scope (memberDeclars)
 // 2 (function) ... 3 (loop in function) ... etc
-int scopeCounter = 0;
+_Thread_local int scopeCounter = 0;
 
 // testing variables
-char fileName[128];
+_Thread_local char fileName[128];
 
 // Code Gen Variables
 char vmCode[9999999999999]; // will hold the VM code generated while parsing and will be output to a .vm file
-int lastArgsCounter = 0;
-char subroutineCommands[99999];
-char auxSubrCommands[99999];
-int codegenIndex = 0;
-int codegenIndexClass = 0; // will always be less than codegenIndex
-int labelCounter = 0;
-int codegenIndexStd = 0;
-int codegenIndexClassStd = 0;
+_Thread_local int lastArgsCounter = 0;
+// the code buffers are per thread, allocated by InitParser for the first file a thread parses
+#define SUBROUTINE_COMMANDS_SIZE 99999
+_Thread_local char *subroutineCommands;
+_Thread_local char *auxSubrCommands;
+_Thread_local int codegenIndex = 0;
+_Thread_local int codegenIndexClass = 0; // will always be less than codegenIndex
+_Thread_local int labelCounter = 0;
+_Thread_local int subroutineIsConstructor = 0; // 1 while a constructor is compiled
+_Thread_local int tailCallLabel = 0; // label at the entry of the current subroutine if it has self tail calls, 0 otherwise
+#define MAX_STRENGTH_REDUCTION_COST 48 // longest shift-add sequence preferred over a Math.multiply call
+_Thread_local int codegenIndexStd = 0;
+_Thread_local int codegenIndexClassStd = 0;
+
+// String literal pooling (-O2) -- each distinct literal of a class is built once by Class.$strings into a static
+#define MAX_POOLED_STRINGS 240 // no more than the static words of the Hack RAM
+_Thread_local char (*stringPool)[128]; // literals of the class currently being compiled, MAX_POOLED_STRINGS of them
+_Thread_local int stringPoolCount = 0;
+char pooledClasses[512][128]; // classes which have a Class.$strings initialiser (called from Main.main)
+int pooledClassesCount = 0;
 
 /** ----------------- Parser Iteration Logic ----------------- **/
 ParserInfo error(Token t, ParserInfo pi);
 
 /** ----------------- Code Gen Logic ----------------- **/
-void addCommandToVM(char *vmCode, char *command); // adds a command to the vm code variable
+void addCommandToVM(char *command); // adds a command to the vm code of the file (or of the program)
+void addTable(); // moves counter on to a new symbol table (pass 1)
+int isConstantFactor(char *code, int *value); // checks whether code is a single (possibly negated) constant push
+void multiplyByConstant(char *code, int value); // adds a shift-add sequence multiplying the top of the stack by value
+int multiplyByConstantCost(int value); // number of vm commands multiplyByConstant would add
+int compileTailCall(char *code); // turns a returned self call at the end of code into a jump, 1 if done
+int findVariable(char *name, Symbol *symbol); // looks up a variable in the current subroutine and class scopes
+void pushVariable(char *code, Symbol symbol); // adds the push command for a variable
+void allocateObject(char *code); // allocates the object of a constructor
+int findSubroutine(char *className, char *name); // index of the table of Class.name or -1
+int isDeclared(char *name, int classes); // semantic checks: 1 if a subroutine (or class) of the program has the name
+void addDependency(char *className); // records that the file being parsed uses declarations of the class
+int subroutineCallTarget(char *code, char *first, char *second, char *callName); // resolves a call, returns extra args pushed
+void buildStringConstant(char *code, char *literal); // adds the String.new + appendChar chain for a literal
+int poolStringConstant(char *literal, int budget); // static index of the pooled literal or -1 once budget literals are
 
 /** ----------------- Grammar Rules ----------------- **/
 /**************** CLASS GRAMMAR ****************/
@@ -140,23 +173,300 @@ ParserInfo error(Token t, ParserInfo pi) {
 }
 
 /** ----------------- Code Gen Logic Implementation ----------------- **/
-void addCommandToVM(char *vmCode, char *command) {
-  if (!strlen(vmCode)) {
-    memset(vmCode, '\0', 1024); // init code string
+void addCommandToVM(char *command) {
+  if (parserContext == NULL) {
+    strcat(vmCode, command);
+    if (vmCode[strlen(vmCode) - 1] != '\n') {
+      strcat(vmCode, "\n"); // add a newline (.vm aesthetic purposes) if it doesn't have one already
+    }
+    return;
+  }
+
+  // the code of the file, grown as needed and kept with its length (no strlen of the whole code per command)
+  int length = strlen(command);
+  if (parserContext->codeLength + length + 2 > parserContext->codeCapacity) {
+    parserContext->codeCapacity = 2 * (parserContext->codeLength + length + 2);
+    parserContext->code = realloc(parserContext->code, parserContext->codeCapacity);
+  }
+  char *code = parserContext->code + parserContext->codeLength;
+  memcpy(code, command, length + 1);
+  if (length == 0 || code[length - 1] != '\n') {
+    code[length++] = '\n';
+    code[length] = '\0';
+  }
+  parserContext->codeLength += length;
+}
+
+void addTable() {
+  counter++;
+  if (parserContext == NULL) {
+    programTableCount = counter;
+    return;
+  }
+  if (counter >= parserContext->tableCapacity) {
+    int capacity = 2 * counter;
+    parserContext->tables = realloc(parserContext->tables, capacity * sizeof(SymbolTable));
+    memset(parserContext->tables + parserContext->tableCapacity, 0, (capacity - parserContext->tableCapacity) * sizeof(SymbolTable));
+    parserContext->tableCapacity = capacity;
+    tables = parserContext->tables;
+  }
+  parserContext->tableCount = counter;
+}
+
+// returns 1 and stores the constant in value if code is exactly ' push constant n' (optionally followed by ' neg')
+int isConstantFactor(char *code, int *value) {
+  int constant;
+  int length = 0;
+  if (strncmp(code, " push constant ", 15) != 0 || sscanf(code + 15, "%d%n", &constant, &length) < 1 || code[15 + length] != '\n') {
+    return 0;
+  }
+  length += 16;
+  if (code[length] == '\0') {
+    *value = constant;
+    return 1;
+  }
+  if (strcmp(code + length, " neg\n") == 0) {
+    *value = -constant;
+    return 1;
+  }
+  return 0;
+}
+
+// multiplies the value on top of the stack by a constant using add doubling instead of Math.multiply
+// temp 1 holds the multiplicand, temp 2 is used for doubling -- both are free again once the sequence ends
+void multiplyByConstant(char *code, int value) {
+
+  int negative = value < 0;
+  if (negative) {
+    value = -value;
   }
-  strcat(vmCode, command);
 
-  if (vmCode[strlen(vmCode) - 1] == '\n') {
+  if (value == 0) {
+    strcat(code, " pop temp 1\n");
+    strcat(code, " push constant 0\n");
     return;
   }
 
-  strcat(vmCode, "\n"); // add a newline (.vm aesthetic purposes) if it doesn't have one already
+  // find most significant bit, the remaining bits are processed Horner style
+  int msb = 14;
+  while (!(value & (1 << msb))) {
+    msb--;
+  }
+
+  if (value & ((1 << msb) - 1)) { // not a power of two, multiplicand is needed for the adds
+    strcat(code, " pop temp 1\n");
+    strcat(code, " push temp 1\n");
+  }
+
+  for (int bit = msb - 1; bit >= 0; --bit) {
+    strcat(code, " pop temp 2\n");
+    strcat(code, " push temp 2\n");
+    strcat(code, " push temp 2\n");
+    strcat(code, " add\n");
+    if (value & (1 << bit)) {
+      strcat(code, " push temp 1\n");
+      strcat(code, " add\n");
+    }
+  }
+
+  if (negative) {
+    strcat(code, " neg\n");
+  }
+}
+
+// returns 1 and fills symbol if name is declared in the current subroutine or its class, 0 otherwise
+int findVariable(char *name, Symbol *symbol) {
+  int subroutineIndex = standardPass == 1 ? codegenIndexStd : codegenIndex;
+  int classIndex = standardPass == 1 ? codegenIndexClassStd : codegenIndexClass;
+
+  int result = FindSymbol(tables[subroutineIndex], name);
+  if (result >= 0) {
+    *symbol = tables[subroutineIndex].symbols[result];
+    return 1;
+  }
+  result = FindSymbol(tables[classIndex], name);
+  if (result >= 0) {
+    *symbol = tables[classIndex].symbols[result];
+    return 1;
+  }
+  return 0;
+}
+
+void pushVariable(char *code, Symbol symbol) {
+  char *segments[4] = {"static", "this", "argument", "local"}; // indexed by SymbolKind
+  char command[200];
+  sprintf(command, " push %s %d\n", segments[symbol.kind], symbol.offset);
+  strcat(code, command);
+}
+
+// code is the vm code of a return expression -- if its last command (the root of the expression) calls the
+// subroutine being compiled, the call and the return are replaced by storing the pushed arguments into the
+// argument segment, zeroing the locals as a new frame would and jumping back to the subroutine entry
+int compileTailCall(char *code) {
+  char *lastCommand = code + strlen(code);
+  if (lastCommand == code || subroutineIsConstructor) {
+    return 0;
+  }
+  do {
+    lastCommand--;
+  } while (lastCommand > code && lastCommand[-1] != '\n');
+
+  char callName[128];
+  int args;
+  char *name = subroutineCommands + strlen("function ");
+  if (sscanf(lastCommand, " call %127s %d", callName, &args) != 2 || strncmp(callName, name, strlen(callName)) != 0
+    || name[strlen(callName)] != ' ') {
+    return 0;
+  }
+
+  if (!tailCallLabel) {
+    tailCallLabel = ++labelCounter;
+  }
+  char command[200];
+  *lastCommand = '\0';
+  for (int i = args - 1; i >= 0; --i) {
+    sprintf(command, " pop argument %d\n", i);
+    strcat(code, command);
+  }
+  int locals = tables[standardPass == 1 ? codegenIndexStd : codegenIndex].numberOfLocalVariables;
+  for (int i = 0; i < locals; ++i) {
+    sprintf(command, " push constant 0\n pop local %d\n", i);
+    strcat(code, command);
+  }
+  sprintf(command, " goto L%d\n", tailCallLabel);
+  strcat(code, command);
+  return 1;
+}
+
+int findSubroutine(char *className, char *name) {
+  for (int i = 0; i <= counter; ++i) {
+    if (strcmp(tables[i].functionName, name) == 0 && strcmp(tables[i].parentClass, className) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// the checks only look the name up, the class declaring it becomes a dependency of the file (for the build manifest)
+int isDeclared(char *name, int classes) {
+  for (int i = 0; i <= counter; ++i) {
+    if (strcmp(tables[i].functionName, name) == 0 || (classes && strcmp(tables[i].className, name) == 0)) {
+      addDependency(strlen(tables[i].className) ? tables[i].className : tables[i].parentClass);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void addDependency(char *className) {
+  if (parserContext == NULL || strcmp(className, thisSymbol.type) == 0) {
+    return;
+  }
+  for (int i = 0; i < parserContext->dependencyCount; ++i) {
+    if (strcmp(parserContext->dependencies[i].className, className) == 0) {
+      return;
+    }
+  }
+  if (parserContext->dependencyCount == parserContext->dependencyCapacity) {
+    parserContext->dependencyCapacity = parserContext->dependencyCapacity ? 2 * parserContext->dependencyCapacity : 16;
+    parserContext->dependencies = realloc(parserContext->dependencies, parserContext->dependencyCapacity * sizeof(ClassDependency));
+  }
+  strcpy(parserContext->dependencies[parserContext->dependencyCount].className, className);
+  parserContext->dependencies[parserContext->dependencyCount].interfaceHash = 0;
+  parserContext->dependencyCount++;
+}
+
+// resolves first[.second](...) to the Class.subroutine name of the call (stored in callName)
+// methods get the object they are called on pushed first -- returns 1 in that case (extra argument), 0 otherwise
+int subroutineCallTarget(char *code, char *first, char *second, char *callName) {
+  Symbol object;
+  if (second == NULL) { // subroutine of the current class
+    sprintf(callName, "%s.%s", thisSymbol.type, first);
+    int index = findSubroutine(thisSymbol.type, first);
+    if (index >= 0 && tables[index].isMethod) {
+      strcat(code, " push pointer 0\n");
+      return 1;
+    }
+    return 0;
+  }
+  if (findVariable(first, &object)) { // method called on an object -- class is the variable's type
+    pushVariable(code, object);
+    sprintf(callName, "%s.%s", object.type, second);
+    return 1;
+  }
+  sprintf(callName, "%s.%s", first, second); // function or constructor of a class
+  return 0;
+}
+
+// sets 'this' to a new block of memory with a word for every field of the class (start of a constructor)
+void allocateObject(char *code) {
+  int classIndex = standardPass == 1 ? codegenIndexClassStd : codegenIndexClass;
+  char command[200];
+  sprintf(command, " push constant %d\n call Memory.alloc 1\n pop pointer 0\n", tables[classIndex].fieldCount);
+  strcat(code, command);
+}
+
+// leaves a new String holding literal on the stack (appendChar returns the string, so the calls chain)
+void buildStringConstant(char *code, char *literal) {
+  char stringCommand[200];
+  sprintf(stringCommand, " push constant %d\n", (int)strlen(literal));
+  strcat(code, stringCommand);
+  strcat(code, " call String.new 1\n");
+  for (int i = 0; literal[i] != '\0'; ++i) {
+    sprintf(stringCommand, " push constant %d\n", literal[i]);
+    strcat(code, stringCommand);
+    strcat(code, " call String.appendChar 2\n");
+  }
+}
+
+// statics after the ones declared by the class hold its pooled literals, budget is how many it may take
+int poolStringConstant(char *literal, int budget) {
+  int classIndex = standardPass == 1 ? codegenIndexClassStd : codegenIndexClass;
+  for (int i = 0; i < stringPoolCount; ++i) {
+    if (strcmp(stringPool[i], literal) == 0) {
+      return tables[classIndex].staticCount + i;
+    }
+  }
+  if (stringPoolCount >= budget || stringPoolCount == MAX_POOLED_STRINGS) {
+    return -1;
+  }
+  strcpy(stringPool[stringPoolCount], literal);
+  stringPoolCount++;
+  return tables[classIndex].staticCount + stringPoolCount - 1;
+}
+
+// cost (in vm commands) of the sequence generated by multiplyByConstant, used to decide against Math.multiply
+int multiplyByConstantCost(int value) {
+  int cost = 0;
+  if (value < 0) {
+    value = -value;
+    cost += 1;
+  }
+  if (value == 0) {
+    return 2;
+  }
+  int msb = 14;
+  while (!(value & (1 << msb))) {
+    msb--;
+  }
+  if (value & ((1 << msb) - 1)) {
+    cost += 2;
+  }
+  for (int bit = msb - 1; bit >= 0; --bit) {
+    cost += (value & (1 << bit)) ? 6 : 4;
+  }
+  return cost;
 }
 
 int InitParser (char* file_name)
 { 
-  strcpy(fileName, file_name); // have a copy of the filename
+  snprintf(fileName, sizeof fileName, "%s", file_name); // have a copy of the filename
   scopeCounter = 0;
+  if (subroutineCommands == NULL) {
+    subroutineCommands = calloc(SUBROUTINE_COMMANDS_SIZE, 1);
+    auxSubrCommands = calloc(SUBROUTINE_COMMANDS_SIZE, 1);
+    stringPool = calloc(MAX_POOLED_STRINGS, sizeof stringPool[0]);
+  }
 	int lexerInitResult = InitLexer(file_name);
 	if (!lexerInitResult) return 0;
 	else return 1;
@@ -186,6 +496,73 @@ int StopParser ()
 	return 1;
 }
 
+void UseParserContext(ParserContext *context) {
+  parserContext = context;
+  tables = programTables;
+  counter = programTableCount;
+  if (context == NULL) {
+    return;
+  }
+  if (globalPass == 1) { // symbols are collected into the file's own tables, numbered from 1
+    if (context->tables == NULL) {
+      context->tableCapacity = 16;
+      context->tables = malloc(context->tableCapacity * sizeof(SymbolTable));
+    }
+    memset(context->tables, 0, context->tableCapacity * sizeof(SymbolTable));
+    tables = context->tables;
+    counter = 0;
+    context->tableCount = 0;
+  }
+  else if (globalPass == 2) {
+    initialCounter = context->firstTable;
+    context->dependencyCount = 0;
+    context->stringLiterals = 0;
+  }
+  else if (globalPass == 3) {
+    codegenIndex = context->firstTable;
+    context->codeLength = 0;
+    if (context->code != NULL) {
+      context->code[0] = '\0';
+    }
+    strcpy(context->pooledClass, "");
+    context->pooledStrings = 0;
+  }
+}
+
+int FreeStaticWords() {
+  int words = 240;
+  for (int i = 1; i <= programTableCount; ++i) {
+    words -= programTables[i].staticCount;
+  }
+  return words;
+}
+
+int MergeSymbolTables(ParserContext *context) {
+  if (programTableCount + context->tableCount >= MAX_SYMBOL_TABLES) {
+    return 0;
+  }
+  memcpy(&programTables[programTableCount + 1], &context->tables[1], context->tableCount * sizeof(SymbolTable));
+  context->firstTable = programTableCount;
+  programTableCount += context->tableCount;
+  return 1;
+}
+
+void FreeParserBuffers() {
+  free(subroutineCommands);
+  free(auxSubrCommands);
+  free(stringPool);
+  subroutineCommands = NULL;
+  auxSubrCommands = NULL;
+  stringPool = NULL;
+}
+
+void FreeParserContext(ParserContext *context) {
+  free(context->tables);
+  free(context->code);
+  free(context->dependencies);
+  memset(context, 0, sizeof *context);
+}
+
 /** Implementations of Prototypes **/
 ParserInfo classDeclar() {
   ParserInfo pi;
@@ -209,7 +586,7 @@ ParserInfo classDeclar() {
       if (globalPass == 1) {
 
         scopeCounter++;
-        counter++;
+        addTable();
         previousClassCounter = counter;
 
         codegenIndexStd++;
@@ -218,20 +595,16 @@ ParserInfo classDeclar() {
         InitSymbolTable(tables[counter]);
         strcpy(tables[counter].className, t.lx);
 
-        initialCounter = 60; // will only be accessed during second pass
-        initialClassCounter = 60; // class on second pass
-
-        codegenIndex = 60; // used during code gen pass on source
-        codegenIndexClass = 60;
-
       }
       else if (globalPass == 2) {
         initialCounter++; // will only be accessed during second pass
         initialClassCounter = initialCounter; // class on second pass
+        stringPoolCount = 0;
       }
       else if (globalPass == 3) { // on pass 3
         codegenIndex++; // for codegen the tables will start processing from this index
         codegenIndexClass = codegenIndex;
+        stringPoolCount = 0;
       }
 
       // init 'this' symbol (arg) for later use
@@ -277,6 +650,39 @@ ParserInfo classDeclar() {
         }
         else {
           // printParserStage("END OF PARSING", t);
+
+          // the literals pass 3 would pool, to share the free statics out before it
+          if (globalPass == 2 && parserContext != NULL) {
+            parserContext->stringLiterals = stringPoolCount;
+            stringPoolCount = 0;
+          }
+
+          // initialiser for the pooled string literals of this class
+          if (globalPass == 3 && stringPoolCount > 0) {
+            char *initialiser = malloc(stringPoolCount * 4096 + 256);
+            char poolCommand[300];
+            sprintf(initialiser, "function %s.$strings 0\n", thisSymbol.type);
+            for (int i = 0; i < stringPoolCount; ++i) {
+              buildStringConstant(initialiser, stringPool[i]);
+              sprintf(poolCommand, " pop static %d\n", tables[codegenIndexClass].staticCount + i);
+              strcat(initialiser, poolCommand);
+            }
+            strcat(initialiser, " push constant 0\n");
+            strcat(initialiser, " return\n");
+            addCommandToVM(initialiser);
+            free(initialiser);
+
+            if (parserContext != NULL) { // added to pooledClasses when the file's code is
+              strcpy(parserContext->pooledClass, thisSymbol.type);
+              parserContext->pooledStrings = stringPoolCount;
+            }
+            else {
+              strcpy(pooledClasses[pooledClassesCount], thisSymbol.type);
+              pooledClassesCount++;
+            }
+            stringPoolCount = 0;
+          }
+
           pi.tk = t;
           pi.er = none;
           return pi;
@@ -323,6 +729,7 @@ ParserInfo memberDeclar() {
       strcpy(subroutineCommands, "");
       strcpy(auxSubrCommands, ""); 
       strcpy(subroutineCommands, "function ");
+      labelCounter = 0; // labels only need to be unique within their function
     }
 
     ParserInfo subroutineDeclarPi = subroutineDeclar();
@@ -343,9 +750,17 @@ ParserInfo memberDeclar() {
       }
       strcat(subroutineCommands, localCounter);
 
+      if (tailCallLabel) { // entry for self tail calls, after the frame is set up
+        sprintf(localCounter, "label L%d\n", tailCallLabel);
+        strcat(subroutineCommands, localCounter);
+        tailCallLabel = 0;
+      }
+
       strcat(subroutineCommands, auxSubrCommands);
 
-      addCommandToVM(vmCode, subroutineCommands);
+      OptimiseSubroutine(subroutineCommands, SUBROUTINE_COMMANDS_SIZE); // dead code elimination etc.
+
+      addCommandToVM(subroutineCommands);
 
       strcpy(subroutineCommands, ""); // clean subroutine buffer
       strcpy(auxSubrCommands, ""); // clean aux subroutine buffer
@@ -387,13 +802,7 @@ ParserInfo type() {
   }
   else if (t.tp == ID) {
     if (globalPass == 2) { // semantic check
-      int ok = 0;
-      for (int i = 0; i <= counter; ++i) {
-        if (strcmp(tables[i].functionName, t.lx) == 0 || strcmp(tables[i].className, t.lx) == 0) {
-          ok = 1;
-          break;
-        }
-      }
+      int ok = isDeclared(t.lx, 1);
       if (!ok) {
           pi.er = undecIdentifier;
           pi.tk = t;
@@ -551,6 +960,7 @@ ParserInfo subroutineDeclar() {
   if (strcmp("constructor", t.lx) == 0 || strcmp("function", t.lx) == 0 || strcmp("method", t.lx) == 0) {
 
     int subroutineIsMethod = (strcmp("method", t.lx) == 0) ? 1 : 0;
+    subroutineIsConstructor = strcmp("constructor", t.lx) == 0;
 
     t = PeekNextToken();
     if (lexerError(t)) {
@@ -562,7 +972,7 @@ ParserInfo subroutineDeclar() {
     if (globalPass == 1) {
 
       previousClassCounter++; // enter function/method/constructor scope
-      counter++; // increase index on method, constructor, function encounter
+      addTable(); // increase index on method, constructor, function encounter
 
       if (standardPass == 1) {
         codegenIndexStd++;
@@ -605,6 +1015,9 @@ ParserInfo subroutineDeclar() {
             strcat(auxSubrCommands, " push argument 0\n");
             strcat(auxSubrCommands, " pop pointer 0\n");
           }
+          else if (subroutineIsConstructor) {
+            allocateObject(auxSubrCommands);
+          }
 
           // add function name to subroutine specific commands
           strcat(subroutineCommands, thisSymbol.type);
@@ -693,6 +1106,9 @@ ParserInfo subroutineDeclar() {
             strcat(auxSubrCommands, " push argument 0\n");
             strcat(auxSubrCommands, " pop pointer 0\n");
           }
+          else if (subroutineIsConstructor) {
+            allocateObject(auxSubrCommands);
+          }
           
           // add function name to subroutine specific commands
           strcat(subroutineCommands, thisSymbol.type);
@@ -1101,59 +1517,11 @@ ParserInfo letStatemnt() {
 
           isIndexed = 1;
 
-          char lhbi[200];
-          strcpy(lhbi, "");
-
-          int resultMethod;
-          int resultClass;
-          if (standardPass == 1) {
-            resultMethod = FindSymbol(tables[codegenIndexStd], lht.lx);
-            resultClass = FindSymbol(tables[codegenIndexClassStd], lht.lx);
-          }
-          else {
-            resultMethod = FindSymbol(tables[codegenIndex], lht.lx);
-            resultClass = FindSymbol(tables[codegenIndexClass], lht.lx);
+          Symbol array;
+          if (findVariable(lht.lx, &array)) {
+            pushVariable(auxSubrCommands, array);
           }
 
-          if (resultMethod >= 0) { // var is declared in method
-            if (standardPass == 1) {
-              if (tables[codegenIndexStd].symbols[resultMethod].kind == ARGUMENT) {
-                sprintf(lhbi, " push argument %d\n", tables[codegenIndexStd].symbols[resultMethod].offset); 
-              }
-              else if (tables[codegenIndexStd].symbols[resultMethod].kind == VAR) {
-                sprintf(lhbi, " push local %d\n", tables[codegenIndexStd].symbols[resultMethod].offset); 
-              }
-            }
-            else {
-              if (tables[codegenIndex].symbols[resultMethod].kind == ARGUMENT) {
-                sprintf(lhbi, " push argument %d\n", tables[codegenIndex].symbols[resultMethod].offset); 
-              }
-              else if (tables[codegenIndex].symbols[resultMethod].kind == VAR) {
-                sprintf(lhbi, " push local %d\n", tables[codegenIndex].symbols[resultMethod].offset); 
-              }
-            }
-          }
-          else if (resultClass >= 0) { // var is declared in class
-            if (standardPass == 1) {
-              if (tables[codegenIndexClassStd].symbols[resultMethod].kind == FIELD) {
-                sprintf(lhbi, " push this %d\n", tables[codegenIndexClassStd].symbols[resultMethod].offset); 
-              }
-              else if (tables[codegenIndexClassStd].symbols[resultMethod].kind == STATIC) {
-                sprintf(lhbi, " push static %d\n", tables[codegenIndexClassStd].symbols[resultMethod].offset); 
-              }
-            }
-            else {
-              if (tables[codegenIndexClass].symbols[resultMethod].kind == FIELD) {
-                sprintf(lhbi, " push this %d\n", tables[codegenIndexClass].symbols[resultMethod].offset); 
-              }
-              else if (tables[codegenIndexClass].symbols[resultMethod].kind == STATIC) {
-                sprintf(lhbi, " push static %d\n", tables[codegenIndexClass].symbols[resultMethod].offset); 
-              }
-            }
-          }
-
-          strcat(auxSubrCommands, lhbi);
-
         }
 
         GetNextToken();
@@ -1175,9 +1543,9 @@ ParserInfo letStatemnt() {
         }
         
         // code gen for indexed access - variable (add indexing)
+        // the address stays on the stack, as the rhs may use pointer 1 itself
         if (globalPass == 3 || standardPass == 1) {
           strcat(auxSubrCommands, " add\n");
-          strcat(auxSubrCommands, " pop pointer 1\n");
         }
 
         t = PeekNextToken(); // should be =
@@ -1219,7 +1587,7 @@ ParserInfo letStatemnt() {
             }
 
             if (isIndexed) { // pointer
-              strcat(auxSubrCommands, " pop that 0\n");
+              strcat(auxSubrCommands, " pop temp 0\n pop pointer 1\n push temp 0\n pop that 0\n");
             }
             else { // other
               if (resultMethod >= 0) { // var is declared in method
@@ -1282,6 +1650,8 @@ ParserInfo letStatemnt() {
 }
 ParserInfo ifStatement() {
   ParserInfo pi;
+  int elseLabel = 0; // nested statements move labelCounter on, so keep this if's labels locally
+  int endLabel = 0;
   Token t = GetNextToken();
   if (lexerError(t)) {
     pi.tk = t;
@@ -1297,6 +1667,7 @@ ParserInfo ifStatement() {
       return pi;
     }
     if (strcmp(t.lx, "(") == 0) {
+      int conditionStart = strlen(auxSubrCommands);
       ParserInfo expressionPi = expression();
       if (expressionPi.er != none) {
         return error(expressionPi.tk, expressionPi);
@@ -1315,20 +1686,26 @@ ParserInfo ifStatement() {
 
       // vm code gen for if -- HEADER
       if (globalPass == 3 || standardPass == 1) {
-        if (strlen(auxSubrCommands)) {
 
-          strcat(auxSubrCommands, " not\n");
+        labelCounter++;
+        elseLabel = labelCounter;
+        labelCounter++;
+        endLabel = labelCounter;
 
-          labelCounter++;
+        // boolean & / | conditions become a jump chain, anything else is evaluated and tested
+        if (!PassEnabled("shortcircuit") || !ShortCircuitCondition(auxSubrCommands + conditionStart, SUBROUTINE_COMMANDS_SIZE - conditionStart, elseLabel, &labelCounter)) {
+
+          strcat(auxSubrCommands, " not\n");
 
           char ifGotoCommand[200];
           strcpy(ifGotoCommand, "");
 
-          sprintf(ifGotoCommand, " if-goto L%d\n", labelCounter);
+          sprintf(ifGotoCommand, " if-goto L%d\n", elseLabel);
           strcat(auxSubrCommands, ifGotoCommand);
 
         }
-     }
+
+      }
 
       t = GetNextToken();
       // begin if body
@@ -1354,20 +1731,18 @@ ParserInfo ifStatement() {
 
         // vm code gen for if -- END OF PRIMARY EXEC IF CONDITION IS MET
         if (globalPass == 3 || standardPass == 1) {
-          if (strlen(auxSubrCommands)) {
 
-            char ifGotoCommand[200];
-            strcpy(ifGotoCommand, "");
+          char ifGotoCommand[200];
+          strcpy(ifGotoCommand, "");
 
-            sprintf(ifGotoCommand, " goto L%d\n", labelCounter + 1);
-            strcat(auxSubrCommands, ifGotoCommand);
+          sprintf(ifGotoCommand, " goto L%d\n", endLabel);
+          strcat(auxSubrCommands, ifGotoCommand);
 
-            strcpy(ifGotoCommand, "");
+          strcpy(ifGotoCommand, "");
 
-            sprintf(ifGotoCommand, "label L%d\n", labelCounter);
-            strcat(auxSubrCommands, ifGotoCommand);
+          sprintf(ifGotoCommand, "label L%d\n", elseLabel);
+          strcat(auxSubrCommands, ifGotoCommand);
 
-          }
         }
 
         t = GetNextToken();
@@ -1387,21 +1762,6 @@ ParserInfo ifStatement() {
           }
           if (strcmp(t.lx, "else") == 0) {
 
-            // vm code gen for if -- ELSE
-            if (globalPass == 3 || standardPass == 1) {
-            if (strlen(auxSubrCommands)) {
-
-              char ifGotoCommand[200];
-              strcpy(ifGotoCommand, "");
-
-              sprintf(ifGotoCommand, "label L%d\n", labelCounter + 1);
-              strcat(auxSubrCommands, ifGotoCommand);
-
-              labelCounter++;
-
-            }
-          }
-
             GetNextToken();
 
             t = GetNextToken(); // should be {
@@ -1436,6 +1796,14 @@ ParserInfo ifStatement() {
                 return pi;
               }
               if (strcmp(t.lx, "}") == 0) {
+
+                // vm code gen for if -- ENDIF (after else body)
+                if (globalPass == 3 || standardPass == 1) {
+                  char ifGotoCommand[200];
+                  sprintf(ifGotoCommand, "label L%d\n", endLabel);
+                  strcat(auxSubrCommands, ifGotoCommand);
+                }
+
                 pi.er = none;
                 pi.tk = t;
                 return pi;
@@ -1455,17 +1823,13 @@ ParserInfo ifStatement() {
 
           // vm code gen for if -- ENDIF
           if (globalPass == 3 || standardPass == 1) {
-            if (strlen(auxSubrCommands)) {
-
-              char ifGotoCommand[200];
-              strcpy(ifGotoCommand, "");
 
-              sprintf(ifGotoCommand, "label L%d\n", labelCounter + 1);
-              strcat(auxSubrCommands, ifGotoCommand);
+            char ifGotoCommand[200];
+            strcpy(ifGotoCommand, "");
 
-              labelCounter++;
+            sprintf(ifGotoCommand, "label L%d\n", endLabel);
+            strcat(auxSubrCommands, ifGotoCommand);
 
-            }
           }
 
           pi.er = none;
@@ -1499,7 +1863,7 @@ ParserInfo ifStatement() {
 ParserInfo whileStatement() {
 
   ParserInfo pi;
-  int labelCounterLocal;
+  int labelCounterLocal = 0;
 
   Token t = GetNextToken();
   if (lexerError(t)) {
@@ -1519,21 +1883,21 @@ ParserInfo whileStatement() {
 
       // vm code gen for while loop -- HEADER
       if (globalPass == 3 || standardPass == 1) {
-        if (strlen(auxSubrCommands)) {
 
-          labelCounter++;
-          labelCounterLocal = labelCounter;
+        labelCounter++;
+        labelCounterLocal = labelCounter;
+        labelCounter++; // exit label
 
-          char whileCommand[200];
-          strcpy(whileCommand, "");
+        char whileCommand[200];
+        strcpy(whileCommand, "");
 
-          sprintf(whileCommand, "label L%d\n", labelCounter);
+        sprintf(whileCommand, "label L%d\n", labelCounterLocal);
 
-          strcat(auxSubrCommands, whileCommand);
+        strcat(auxSubrCommands, whileCommand);
 
-        }
       }
 
+      int conditionStart = strlen(auxSubrCommands);
       ParserInfo expressionPi = expression();
       if (expressionPi.er != none) {
         return error(expressionPi.tk, expressionPi);
@@ -1548,19 +1912,20 @@ ParserInfo whileStatement() {
 
         // vm code gen for while loop -- AFTER !(cond) PUSH
         if (globalPass == 3 || standardPass == 1) {
-          if (strlen(auxSubrCommands)) {
+
+          // boolean & / | conditions become a jump chain, anything else is evaluated and tested
+          if (!PassEnabled("shortcircuit") || !ShortCircuitCondition(auxSubrCommands + conditionStart, SUBROUTINE_COMMANDS_SIZE - conditionStart, labelCounterLocal + 1, &labelCounter)) {
 
             strcat(auxSubrCommands, " not\n");
 
             char whileCommand[200];
             strcpy(whileCommand, "");
 
-            sprintf(whileCommand, " if-goto L%d\n", labelCounter + 1);
+            sprintf(whileCommand, " if-goto L%d\n", labelCounterLocal + 1);
             strcat(auxSubrCommands, whileCommand);
 
-            labelCounter++;
-
           }
+
         }
 
         t = GetNextToken(); // should be {
@@ -1598,20 +1963,16 @@ ParserInfo whileStatement() {
 
             // vm code gen for while loop
             if (globalPass == 3 || standardPass == 1) {
-              if (strlen(auxSubrCommands)) {
 
-                char whileCommand[200];
-                strcpy(whileCommand, "");
+              char whileCommand[200];
+              strcpy(whileCommand, "");
 
-                sprintf(whileCommand, " goto L%d\n", labelCounterLocal);
-                strcat(auxSubrCommands, whileCommand);
+              sprintf(whileCommand, " goto L%d\n", labelCounterLocal);
+              strcat(auxSubrCommands, whileCommand);
 
-                sprintf(whileCommand, "label L%d\n", labelCounterLocal + 1);
-                strcat(auxSubrCommands, whileCommand);
+              sprintf(whileCommand, "label L%d\n", labelCounterLocal + 1);
+              strcat(auxSubrCommands, whileCommand);
 
-                labelCounter++;
-
-              }
             }
 
             pi.er = none;
@@ -1670,6 +2031,9 @@ ParserInfo doStatement() {
       return pi;
     }
     if (strcmp(t.lx, ";") == 0) { // end subroutine call
+      if (globalPass == 3 || standardPass == 1) {
+        strcat(auxSubrCommands, " pop temp 0\n"); // discard the returned value
+      }
       pi.er = none;
       pi.tk = t;
       return pi;
@@ -1688,9 +2052,9 @@ ParserInfo doStatement() {
 }
 ParserInfo subroutineCall() {
 
-  char subroutineFormat[200];
-  strcpy(subroutineFormat, "");
-  int isMethod = 0;
+  Token firstID;
+  Token secondID;
+  int hasDot = 0;
 
   ParserInfo pi;
   Token t = GetNextToken();
@@ -1705,14 +2069,7 @@ ParserInfo subroutineCall() {
     if (globalPass == 2) { // semantic check
 
       if (FindSymbol(tables[initialCounter], t.lx) < 0 && FindSymbol(tables[initialClassCounter], t.lx) < 0) {
-        int ok = 0;
-        for (int i = 0; i <= counter; ++i) {
-          if (i == initialCounter || i == initialClassCounter) continue;
-          if (strcmp(tables[i].functionName, t.lx) == 0 || strcmp(tables[i].className, t.lx) == 0) { // declared subroutine / class
-            ok = 1;
-            break;
-          }
-        }
+        int ok = isDeclared(t.lx, 1);
         if (!ok) {
           pi.er = undecIdentifier;
           pi.tk = t;
@@ -1723,68 +2080,7 @@ ParserInfo subroutineCall() {
         ;
     }
 
-    if (globalPass == 3 || standardPass == 1) { // check whether the called subroutine is in parent class or in other class
-
-      int methodResult;
-      int classResult;
-      if (standardPass == 1) {
-        methodResult = FindSymbol(tables[codegenIndexStd], t.lx);
-        classResult = FindSymbol(tables[codegenIndexClassStd], t.lx);
-      }
-      else {
-        methodResult = FindSymbol(tables[codegenIndex], t.lx);
-        classResult = FindSymbol(tables[codegenIndexClass], t.lx);
-      }
-      int filledBeginningSymbol = 0;
-      int isSameClass = 0;
-
-      if (methodResult >= 0) { // beginning symbol is local var or argument
-        if (tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[methodResult].kind == ARGUMENT) {
-          sprintf(subroutineFormat, " push argument %d\n", tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[methodResult].offset);
-          strcat(auxSubrCommands, subroutineFormat);
-        }
-        else if (tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[methodResult].kind == VAR) {
-          sprintf(subroutineFormat, " push local %d\n", tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[methodResult].offset);
-          strcat(auxSubrCommands, subroutineFormat);
-        }
-        sprintf(subroutineFormat, " call %s", t.lx); // this ref
-        filledBeginningSymbol = 1;
-      }
-      else if (classResult >= 0) { // beginning symbol is a class level var
-        sprintf(subroutineFormat, " push this %d\n", tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass].symbols[classResult].offset);
-        strcat(auxSubrCommands, subroutineFormat);
-        sprintf(subroutineFormat, " call %s", t.lx); // this ref
-        filledBeginningSymbol = 1;
-      }
-
-      for (int i = 0; i <= counter; ++i) {
-        if (strcmp(tables[i].functionName, t.lx) == 0) { // declared subroutine / class
-          if (strlen(auxSubrCommands)) {
-            if (strcmp(thisSymbol.type, tables[i].parentClass) == 0) {
-              isMethod = tables[i].isMethod;
-              if (strcmp(tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass].className, tables[i].parentClass) == 0) {
-                strcat(auxSubrCommands, " push pointer 0\n"); // this ref
-              }
-              if (!filledBeginningSymbol) {
-                sprintf(subroutineFormat, " call %s", tables[i].parentClass); // this ref
-              }
-              strcat(subroutineFormat, ".");
-              strcat(subroutineFormat, t.lx);
-            }
-          }
-          break;
-        }
-        else if (strcmp(tables[i].parentClass, t.lx) == 0) {
-          if (strlen(auxSubrCommands)) {
-            isMethod = tables[i].isMethod;
-            if (!filledBeginningSymbol) {
-              sprintf(subroutineFormat, " call %s", tables[i].parentClass); // this ref
-            }
-          }
-          break;
-        }
-      }
-    }
+    firstID = t;
 
     t = PeekNextToken();
     if (lexerError(t)) {
@@ -1795,12 +2091,6 @@ ParserInfo subroutineCall() {
     // check for member access (ie: .[identifier])
     if (strcmp(t.lx, ".") == 0) {
 
-      if (globalPass == 3 || standardPass == 1) {
-        if (strlen(auxSubrCommands)) {
-          strcat(subroutineFormat, ".");
-        }
-      }
-
       GetNextToken();
       t = PeekNextToken();
       if (lexerError(t)) {
@@ -1810,33 +2100,17 @@ ParserInfo subroutineCall() {
       }
       if (t.tp == ID) {
 
-        if (globalPass == 3 || standardPass == 1) {
-          if (strlen(auxSubrCommands)) {
-            strcat(subroutineFormat, t.lx);
-
-            // find out if this subroutine is a method
-            for (int i = 0; i <= counter; ++i) {
-              if (strcmp(tables[i].functionName, t.lx) == 0 && tables[i].isMethod) {
-                isMethod = 1;
-              }
-            }
-          }
-        }
-
         if (globalPass == 2) { // semantic check
-          int ok = 0;
-          for (int i = 0; i <= counter; ++i) {
-            if (strcmp(tables[i].functionName, t.lx) == 0) { // undeclared var, subroutine, class
-              ok = 1;
-              break;
-            }
-          }
+          int ok = isDeclared(t.lx, 0);
           if (!ok) {
             pi.er = undecIdentifier;
             pi.tk = t;
             return pi;
           } 
         }
+
+        secondID = t;
+        hasDot = 1;
         GetNextToken();
       }
       else {
@@ -1846,6 +2120,15 @@ ParserInfo subroutineCall() {
       }
     }
 
+    // vm code gen -- push the object for method calls and resolve the Class.subroutine name
+    char callName[300];
+    int extraArgs = 0;
+    int savedArgsCounter = lastArgsCounter; // this call may be an argument of an outer call
+    if (globalPass == 3 || standardPass == 1) {
+      extraArgs = subroutineCallTarget(auxSubrCommands, firstID.lx, hasDot ? secondID.lx : NULL, callName);
+      lastArgsCounter = 0;
+    }
+
     t = GetNextToken(); // should be (
     if (strcmp(t.lx, "(") == 0) {
       ParserInfo expressionListPi = expressionList();
@@ -1862,21 +2145,10 @@ ParserInfo subroutineCall() {
 
         // add number of args to command and add command to vm code
         if (globalPass == 3 || standardPass == 1) {
-          if (strlen(auxSubrCommands)) {
-
-            char argsCounter[200];
-            strcpy(argsCounter, "");
-
-            if (isMethod) { // if method, push this as well
-              lastArgsCounter += 1; 
-            }
-
-            sprintf(argsCounter, " %d\n", lastArgsCounter);
-            strcat(subroutineFormat, argsCounter);
-            strcat(auxSubrCommands, subroutineFormat);
-
-            lastArgsCounter = 0; // reset args counter
-          }
+          char callCommand[400];
+          sprintf(callCommand, " call %s %d\n", callName, lastArgsCounter + extraArgs);
+          strcat(auxSubrCommands, callCommand);
+          lastArgsCounter = savedArgsCounter;
         }
 
         pi.er = none;
@@ -1989,6 +2261,7 @@ ParserInfo returnStatemnt() {
     strcmp(t.lx, "this") == 0 ||
     t.tp == ID)
     {
+      int expressionStart = strlen(auxSubrCommands);
       ParserInfo expressionPi = expression();
       if (expressionPi.er != none) {
         return error(expressionPi.tk, expressionPi);
@@ -1998,7 +2271,8 @@ ParserInfo returnStatemnt() {
 
         // return vm command -- with expression here
         if (globalPass == 3 || standardPass == 1) {
-          if (strlen(auxSubrCommands)) {
+          int tailCall = PassEnabled("tailcalls") && compileTailCall(auxSubrCommands + expressionStart);
+          if (!tailCall) {
             strcat(auxSubrCommands, " return\n");
           }
         }
@@ -2017,10 +2291,8 @@ ParserInfo returnStatemnt() {
 
       // return vm command
       if (globalPass == 3 || standardPass == 1) {
-        if (strlen(auxSubrCommands)) {
-          strcat(auxSubrCommands, " push constant 0\n");
-          strcat(auxSubrCommands, " return\n");
-        }
+        strcat(auxSubrCommands, " push constant 0\n");
+        strcat(auxSubrCommands, " return\n");
       }
 
       t = GetNextToken();
@@ -2061,37 +2333,40 @@ ParserInfo expression() {
   }
   while (strcmp(t.lx, "&") == 0 || strcmp(t.lx, "|") == 0) {
 
-    // add vm code
+    Token savedToken = t;
+
+    GetNextToken();
+    t = PeekNextToken();
+    if (lexerError(t)) {
+      pi.tk = t;
+      pi.er = lexerErr;
+      return pi;
+    }
+    ParserInfo chainedRelExprPi = relationalExpression();
+    if (chainedRelExprPi.er != none) {
+      return error(chainedRelExprPi.tk, chainedRelExprPi);
+    }
+
+    // add vm code -- after both operands are on the stack
     if (globalPass == 3 || standardPass == 1) {
-      if (strcmp(t.lx, "&") == 0) {
+      if (strcmp(savedToken.lx, "&") == 0) {
         if (strlen(auxSubrCommands)) {
           strcat(auxSubrCommands, " and\n");
         }
         else {
-          addCommandToVM(vmCode, "and");
+          addCommandToVM("and");
         }
       }
-      else if (strcmp(t.lx, "|") == 0) {
+      else if (strcmp(savedToken.lx, "|") == 0) {
         if (strlen(auxSubrCommands)) {
           strcat(auxSubrCommands, " or\n");
         }
         else {
-          addCommandToVM(vmCode, "or");
+          addCommandToVM("or");
         }
       }
     }
 
-    GetNextToken();
-    t = PeekNextToken();
-    if (lexerError(t)) {
-      pi.tk = t;
-      pi.er = lexerErr;
-      return pi;
-    }
-    ParserInfo chainedRelExprPi = relationalExpression();
-    if (chainedRelExprPi.er != none) {
-      return error(chainedRelExprPi.tk, chainedRelExprPi);
-    }
     t = PeekNextToken();
     if (lexerError(t)) {
       pi.tk = t;
@@ -2157,13 +2432,13 @@ ParserInfo relationalExpression() {
       }
       else {
         if (strcmp(savedToken.lx, "=") == 0) {
-          addCommandToVM(vmCode, "eq");
+          addCommandToVM("eq");
         }
         else if (strcmp(savedToken.lx, ">") == 0) {
-          addCommandToVM(vmCode, "gt");
+          addCommandToVM("gt");
         }
         else if (strcmp(savedToken.lx, "<") == 0) {
-          addCommandToVM(vmCode, "lt");
+          addCommandToVM("lt");
         }
       }
     }
@@ -2231,10 +2506,10 @@ ParserInfo ArithmeticExpression() {
       }
       else {
         if (strcmp(savedToken.lx, "+") == 0) {
-          addCommandToVM(vmCode, "add");
+          addCommandToVM("add");
         }
         else if (strcmp(savedToken.lx, "-") == 0) {
-          addCommandToVM(vmCode, "sub");
+          addCommandToVM("sub");
         }
       }
     }
@@ -2262,6 +2537,7 @@ ParserInfo term() {
     return pi;
   }
   // printParserStage("term", t);
+  int termStart = strlen(auxSubrCommands); // start of the left operand code, used for strength reduction
   ParserInfo factorPi = factor();
   if (factorPi.er != none) {
     return error(factorPi.tk, factorPi);
@@ -2284,6 +2560,8 @@ ParserInfo term() {
       return pi;
     }
 
+    int factorStart = strlen(auxSubrCommands); // start of the right operand code
+
     ParserInfo factorChainedPi = factor();
     if (factorChainedPi.er != none) {
       return error(factorChainedPi.tk, factorChainedPi);
@@ -2292,19 +2570,61 @@ ParserInfo term() {
     // vm code gen
     if (globalPass == 3 || standardPass == 1) {
       if (strlen(auxSubrCommands)) {
-        if (strcmp(savedToken.lx, "*") == 0) {
-          strcat(auxSubrCommands, " call Math.multiply 2\n");
+
+        // strength reduction -- look for a constant operand on either side
+        int constant;
+        int hasConstant = 0;
+        if (isConstantFactor(auxSubrCommands + factorStart, &constant)) {
+          auxSubrCommands[factorStart] = '\0'; // drop the constant push, the left operand stays on the stack
+          hasConstant = 1;
+        }
+        else if (strcmp(savedToken.lx, "*") == 0) {
+          char leftOperand[200];
+          int leftLength = factorStart - termStart;
+          if (leftLength < (int)sizeof leftOperand) {
+            strncpy(leftOperand, auxSubrCommands + termStart, leftLength);
+            leftOperand[leftLength] = '\0';
+            if (isConstantFactor(leftOperand, &constant)) { // constant * x = x * constant
+              memmove(auxSubrCommands + termStart, auxSubrCommands + factorStart, strlen(auxSubrCommands + factorStart) + 1);
+              hasConstant = 1;
+            }
+          }
         }
-        else if (strcmp(savedToken.lx, "/") == 0) {
-          strcat(auxSubrCommands, " call Math.divide 2\n");
+
+        int reduce = hasConstant && PassEnabled("strength");
+        if (reduce && strcmp(savedToken.lx, "*") == 0 && constant >= -32767 && constant <= 32767 && multiplyByConstantCost(constant) <= MAX_STRENGTH_REDUCTION_COST) {
+          multiplyByConstant(auxSubrCommands, constant);
+        }
+        // only x / 1 and x / -1 are reduced -- Math.divide rounds toward zero, so an arithmetic shift right would
+        // be wrong for a negative x divided by a power of two (-7 / 2 is -3, -7 >> 1 is -4)
+        else if (reduce && strcmp(savedToken.lx, "/") == 0 && (constant == 1 || constant == -1)) {
+          if (constant == -1) {
+            strcat(auxSubrCommands, " neg\n");
+          }
+        }
+        else {
+          if (hasConstant) { // no cheaper sequence, put the constant back as the right operand
+            char constantCommand[200];
+            sprintf(constantCommand, " push constant %d\n", constant < 0 ? -constant : constant);
+            strcat(auxSubrCommands, constantCommand);
+            if (constant < 0) {
+              strcat(auxSubrCommands, " neg\n");
+            }
+          }
+          if (strcmp(savedToken.lx, "*") == 0) {
+            strcat(auxSubrCommands, " call Math.multiply 2\n");
+          }
+          else if (strcmp(savedToken.lx, "/") == 0) {
+            strcat(auxSubrCommands, " call Math.divide 2\n");
+          }
         }
       }
       else {
         if (strcmp(savedToken.lx, "*") == 0) {
-          addCommandToVM(vmCode, "call Math.multiply 2");
+          addCommandToVM("call Math.multiply 2");
         }
         else if (strcmp(savedToken.lx, "/") == 0) {
-          addCommandToVM(vmCode, "call Math.divide 2");
+          addCommandToVM("call Math.divide 2");
         }
       }
     }
@@ -2354,10 +2674,10 @@ ParserInfo factor() {
       }
       else {
         if (strcmp(savedToken.lx, "-") == 0) {
-          addCommandToVM(vmCode, "neg");
+          addCommandToVM("neg");
         }
         else if (strcmp(savedToken.lx, "~") == 0) {
-          addCommandToVM(vmCode, "not");
+          addCommandToVM("not");
         }
       }
     }
@@ -2424,6 +2744,11 @@ ParserInfo operand() {
   }
   else if (t.tp == INT || t.tp == STRING || strcmp(t.lx, "true") == 0 || strcmp(t.lx, "false") == 0 || strcmp(t.lx, "null") == 0 || strcmp(t.lx, "this") == 0) {
 
+    // count the distinct literals of the class, for the budget of pass 3
+    if (globalPass == 2 && t.tp == STRING && PassEnabled("strings") && standardPass == 0) {
+      poolStringConstant(t.lx, MAX_POOLED_STRINGS);
+    }
+
     // add vm code
     if (globalPass == 3 || standardPass == 1) {
 
@@ -2435,9 +2760,12 @@ ParserInfo operand() {
         sprintf(constantCommand, " push constant %s\n", t.lx);
         strcat(auxSubrCommands, constantCommand);
       }
-      else if (strcmp(t.lx, "true") == 0 || strcmp(t.lx, "false") == 0) {
-        sprintf(constantCommand, " push constant %d\n", (strcmp(t.lx, "true") == 0 ? 1 : 0));
-        strcat(auxSubrCommands, constantCommand);
+      else if (strcmp(t.lx, "true") == 0) { // true is -1 (all bits set)
+        strcat(auxSubrCommands, " push constant 0\n");
+        strcat(auxSubrCommands, " not\n");
+      }
+      else if (strcmp(t.lx, "false") == 0) {
+        strcat(auxSubrCommands, " push constant 0\n");
       }
       else if (strcmp(t.lx, "null") == 0) {
         sprintf(constantCommand, " push constant 0\n");
@@ -2445,24 +2773,19 @@ ParserInfo operand() {
       }
       else if (t.tp == STRING) {
 
-        // allocate memory for string
-        int stringConstantLength = strlen(t.lx);
-        sprintf(constantCommand, " push constant %d\n", stringConstantLength);
-        strcat(auxSubrCommands, constantCommand);
-        strcat(auxSubrCommands, " call String.new 1\n");
-        strcat(auxSubrCommands, " pop temp 0\n"); // save result of .new in temp
-
-        // create string in memory
-        for (int i = 0; i < strlen(t.lx); ++i) {
-          char stringCommand[200];
-          strcat(auxSubrCommands, " push temp 0\n");
-          sprintf(stringCommand, " push constant %c\n", t.lx[i]);
-          strcat(auxSubrCommands, stringCommand);
-          strcat(auxSubrCommands, " call String.appendChar 2\n");
+        // literals of user classes are built once (by Class.$strings) and read from a static afterwards
+        int poolIndex = -1;
+        if (PassEnabled("strings") && standardPass == 0 && parserContext != NULL) {
+          poolIndex = poolStringConstant(t.lx, parserContext->stringBudget);
         }
 
-        // push ref of newly allocated string
-        strcat(auxSubrCommands, " push temp 0\n");
+        if (poolIndex >= 0) {
+          sprintf(constantCommand, " push static %d\n", poolIndex);
+          strcat(auxSubrCommands, constantCommand);
+        }
+        else {
+          buildStringConstant(auxSubrCommands, t.lx);
+        }
 
       }
       else if (strcmp(t.lx, "this") == 0) { // this operand vm code gen here
@@ -2482,13 +2805,7 @@ ParserInfo operand() {
     if (globalPass == 2) { // semantic check
       if (FindSymbol(tables[initialCounter], t.lx) < 0 && FindSymbol(tables[initialClassCounter], t.lx) < 0) { // undeclared var, subroutine, class in current class scope
         // check for standard lib ID + previous tables
-        int ok = 0;
-        for (int i = 0; i <= counter; ++i) {
-          if (strcmp(tables[i].className, t.lx) == 0) { // declared stdlib subroutine / class
-            ok = 1;
-            break;
-          }
-        }
+        int ok = isDeclared(t.lx, 1);
         if (!ok) {
           pi.er = undecIdentifier;
           pi.tk = t;
@@ -2498,45 +2815,7 @@ ParserInfo operand() {
       }
     }
 
-    // generate vm code 
-    if (globalPass == 3 || standardPass == 1) {
-
-      initialID = t;
-
-      char constantCommand[200];
-      strcpy(constantCommand, "");
-
-      // find offset and segment of token
-      int localIndex = FindSymbol(tables[standardPass == 1 ? codegenIndexStd : codegenIndex], initialID.lx);
-      if (localIndex >= 0) { // in local scope
-        if (tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[localIndex].kind == VAR) {
-          sprintf(constantCommand, " push local %d\n", tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[localIndex].offset);
-        }
-        else if (tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[localIndex].kind == ARGUMENT) {
-          sprintf(constantCommand, " push argument %d\n", tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[localIndex].offset);
-        }
-      }
-      else {
-        int classIndex = FindSymbol(tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass], initialID.lx);
-        if (classIndex >= 0) { // in parent class scope
-          if (tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass].symbols[classIndex].kind == STATIC) {
-            sprintf(constantCommand, " push static %d\n", tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass].symbols[classIndex].offset);
-          }
-          else if (tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass].symbols[classIndex].kind == FIELD) {
-            sprintf(constantCommand, " push this %d\n", tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass].symbols[classIndex].offset);
-          }
-        }
-        else { // in any other scope (?)
-          // TODO
-          // sprintf(constantCommand, " pop pointer 1\n");
-          // strcat(auxSubrCommands, constantCommand);
-
-        }
-      }
-
-      strcat(auxSubrCommands, constantCommand);
-
-    }
+    initialID = t;
     
     GetNextToken();
     t = PeekNextToken();
@@ -2561,13 +2840,7 @@ ParserInfo operand() {
           if (FindSymbol(tables[initialCounter], t.lx) < 0 && FindSymbol(tables[initialClassCounter], t.lx) < 0) { // undeclared var, subroutine, class
             
             // check for standard lib ID
-            int ok = 0;
-            for (int i = 0; i <= counter; ++i) {
-              if (strcmp(tables[i].functionName, t.lx) == 0) { // declared stdlib subroutine / class
-                ok = 1;
-                break;
-              }
-            }
+            int ok = isDeclared(t.lx, 0);
             if (!ok) {
               pi.er = undecIdentifier;
               pi.tk = t;
@@ -2577,10 +2850,7 @@ ParserInfo operand() {
           }
         } 
 
-        // check whether the ID is a variable or a subroutine
-        if (globalPass == 3 || standardPass == 1) {
-          secondaryID = t;
-        }
+        secondaryID = t;
 
       }
       else {
@@ -2610,22 +2880,10 @@ ParserInfo operand() {
 
       // code gen for indexed access - variable (before indexing)
       if (globalPass == 3 || standardPass == 1) {
-
-        char lhbi[200];
-        strcpy(lhbi, "");
-
-        int resultMethod = FindSymbol(tables[standardPass == 1 ? codegenIndexStd : codegenIndex], secondaryID.lx);
-        int resultClass = FindSymbol(tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass], secondaryID.lx);
-
-        if (resultMethod >= 0) { // var is declared in method
-          sprintf(lhbi, " push local %d\n", tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[resultMethod].offset); 
-        }
-        else if (resultClass >= 0) { // var is declared in class
-          sprintf(lhbi, " push this %d\n", tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass].symbols[resultClass].offset); 
+        Symbol array;
+        if (findVariable(initialID.lx, &array)) {
+          pushVariable(auxSubrCommands, array);
         }
-
-        strcat(auxSubrCommands, lhbi);
-
       }
 
       ParserInfo expressionPi = expression();
@@ -2640,26 +2898,6 @@ ParserInfo operand() {
         strcat(auxSubrCommands, " push that 0\n");
       }
 
-      // code gen for indexed access - variable (before indexing)
-      if (globalPass == 3 || standardPass == 1) {
-
-        char indexedOperandCommand[200];
-        strcpy(indexedOperandCommand, "");
-
-        int resultMethod = FindSymbol(tables[standardPass == 1 ? codegenIndexStd : codegenIndex], secondaryID.lx);
-        int resultClass = FindSymbol(tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass], secondaryID.lx);
-
-        if (resultMethod >= 0) { // var is declared in method
-          sprintf(indexedOperandCommand, " push local %d\n", tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[resultMethod].offset); 
-        }
-        else if (resultClass >= 0) { // var is declared in class
-          sprintf(indexedOperandCommand, " push this %d\n", tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass].symbols[resultClass].offset); 
-        }
-
-        strcat(auxSubrCommands, indexedOperandCommand);
-
-      }      
-
       t = GetNextToken();
       if (lexerError(t)) {
         pi.tk = t;
@@ -2680,6 +2918,16 @@ ParserInfo operand() {
     else if (strcmp(t.lx, "(") == 0) { // ( expressionList )
 
       GetNextToken();
+      isSubroutineCall = 1;
+
+      // vm code gen -- push the object for method calls and resolve the Class.subroutine name
+      char callName[300];
+      int extraArgs = 0;
+      int savedArgsCounter = lastArgsCounter; // this call may be an argument of an outer call
+      if (globalPass == 3 || standardPass == 1) {
+        extraArgs = subroutineCallTarget(auxSubrCommands, initialID.lx, hasDot ? secondaryID.lx : NULL, callName);
+        lastArgsCounter = 0;
+      }
 
       t = PeekNextToken();
       if (lexerError(t)) {
@@ -2695,49 +2943,10 @@ ParserInfo operand() {
 
       // vm code gen for subroutine call operand 
       if (globalPass == 3 || standardPass == 1) {
-        
-        int isMethod = 0;
-        char subroutineFormat[200];
-        strcpy(subroutineFormat, "");
-
-        int methodResult = FindSymbol(tables[standardPass == 1 ? codegenIndexStd : codegenIndex], initialID.lx);
-        int classResult = FindSymbol(tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass], initialID.lx);
-        int filledBeginningSymbol = 0;
-
-        if (methodResult >= 0) { // beginning symbol is local var or argument
-          if (tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[methodResult].kind == ARGUMENT) {
-            sprintf(subroutineFormat, " push argument %d\n", tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[methodResult].offset);
-            strcat(auxSubrCommands, subroutineFormat);
-          }
-          else if (tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[methodResult].kind == VAR) {
-            sprintf(subroutineFormat, " push local %d\n", tables[standardPass == 1 ? codegenIndexStd : codegenIndex].symbols[methodResult].offset);
-            strcat(auxSubrCommands, subroutineFormat);
-          }
-          sprintf(subroutineFormat, " call %s", initialID.lx); // this ref
-          filledBeginningSymbol = 1;
-        }
-        else if (classResult >= 0) { // beginning symbol is a class level var
-          sprintf(subroutineFormat, " push this %d\n", tables[standardPass == 1 ? codegenIndexClassStd : codegenIndexClass].symbols[classResult].offset);
-          strcat(auxSubrCommands, subroutineFormat);
-          sprintf(subroutineFormat, " call %s", initialID.lx); // this ref
-          filledBeginningSymbol = 1;
-        }
-
-        for (int i = 0; i <= counter; ++i) {
-          if (strcmp(tables[i].functionName, secondaryID.lx) == 0 && strcmp(initialID.lx, tables[i].parentClass) == 0) { // declared subroutine / class
-            isMethod = tables[i].isMethod;
-            if (!filledBeginningSymbol) {
-              if (isMethod) {
-                lastArgsCounter++;
-              }
-              sprintf(subroutineFormat, " call %s.%s %d\n", tables[i].parentClass, tables[i].functionName, lastArgsCounter); // this ref
-            }
-            strcat(auxSubrCommands, subroutineFormat);
-            break;
-          }
-        } 
-
-        lastArgsCounter = 0;   
+        char callCommand[400];
+        sprintf(callCommand, " call %s %d\n", callName, lastArgsCounter + extraArgs);
+        strcat(auxSubrCommands, callCommand);
+        lastArgsCounter = savedArgsCounter;
       }
 
       t = GetNextToken();
@@ -2758,6 +2967,14 @@ ParserInfo operand() {
       }
     }
 
+    // plain variable
+    if (globalPass == 3 || standardPass == 1) {
+      Symbol variable;
+      if (findVariable(initialID.lx, &variable)) {
+        pushVariable(auxSubrCommands, variable);
+      }
+    }
+
     pi.er = none;
     pi.tk = t;
     return pi;
@@ -44,4 +44,37 @@ int InitParser (char* file_name); // initialise the parser to parse source code
 ParserInfo Parse (); // parse the input file (the one passed to InitParser)
 int StopParser (); // stop the parser and do any necessary clean up
 
+#define MAX_SYMBOL_TABLES 512 // class and subroutine tables of a program, the stdlib's included
+
+// a class declaring names the semantic checks of a file found outside the file
+typedef struct {
+	char className[128];
+	unsigned long interfaceHash; // of the class when the file was compiled (set by the build manifest)
+} ClassDependency;
+
+// what the parser keeps of one file between passes, so that the files of a program can be parsed on several threads
+// at once -- everything else the parser and lexer use while parsing a file is per thread
+typedef struct {
+	SymbolTable *tables; // pass 1: the class and subroutine tables of the file, tables[1 .. tableCount]
+	int tableCount;
+	int tableCapacity;
+	int firstTable; // passes 2 and 3: index of the class table in the program's tables - 1 (set by MergeSymbolTables)
+	char *code; // pass 3: the vm code of the file
+	int codeLength;
+	int codeCapacity;
+	char pooledClass[128]; // pass 3: the class if it got a Class.$strings initialiser, "" otherwise
+	int stringLiterals; // pass 2: the distinct string literals of the class, which -fstrings would pool
+	int stringBudget; // pass 3: how many of them it may pool (set by the compiler, the statics being shared in file order)
+	int pooledStrings; // pass 3: the statics its pooled literals took
+	ClassDependency *dependencies; // pass 2: the classes the file depends on, each once
+	int dependencyCount;
+	int dependencyCapacity;
+} ParserContext;
+
+void UseParserContext (ParserContext *context); // the files parsed next by this thread use context (NULL: the program's state)
+int MergeSymbolTables (ParserContext *context); // appends the tables of a file after pass 1, 0 if there are too many
+int FreeStaticWords (); // the static words (of the 240 of the Hack RAM) the statics of the program's tables leave
+void FreeParserContext (ParserContext *context);
+void FreeParserBuffers (); // frees the code buffers of the calling thread, before it ends
+
 #endif
@@ -53,6 +53,9 @@ void AddSymbol(SymbolTable *symTable, char *name, char *type, SymbolKind kind) {
         symTable -> symbols[symTable -> count].offset = symTable -> fieldCount;
         symTable -> fieldCount += 1;
     }
+    else if (kind == VAR) { // locals are numbered separately from the arguments
+        symTable -> symbols[symTable -> count].offset = symTable -> numberOfLocalVariables;
+    }
     else {
         symTable -> symbols[symTable -> count].offset = symTable -> count;
     }
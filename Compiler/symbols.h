@@ -2,7 +2,6 @@
 #define SYMBOLS_H
 
 #include "lexer.h"
-#include "parser.h"
 
 // define your own types and function prototypes for the symbol table(s) module below
 
@@ -0,0 +1,1011 @@
+/************************************************************************
+University of Leeds
+School of Computing
+COMP2932- Compiler Design and Construction
+The VM Module
+
+Runs (and profiles) the vm code of a compiled program without the nand2tetris tools.
+The code is loaded once into VMInstruction structs (segments folded into the
+opcodes, labels and calls resolved to instruction indexes) and run with
+threaded dispatch (computed goto, gcc / clang) on the hack memory of os.c.
+A loaded program can be saved as a bytecode file, which later loads by
+mapping it, without reading the vm text again.
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vm.h"
+
+// a subroutine of the loaded program
+typedef struct {
+    char name[128]; // Class.subroutine
+    int entry; // index of its 'function' instruction
+    int firstLabel; // its labels are vmLabels[firstLabel .. firstLabel + labels - 1]
+    int labels;
+    int staticClass; // index in vmClasses of its class
+} VMRoutine;
+
+// a label of the loaded program (labels are local to their subroutine)
+typedef struct {
+    char name[128];
+    int target; // index of the instruction following the label
+} VMLabel;
+
+// the static segment of a class -- every class gets its own part of 16..255
+typedef struct {
+    char name[128];
+    int statics; // highest static index used + 1
+    int base; // address of static 0
+} VMClass;
+
+// bytecode file -- the header, then the sections below in this order, in the byte order of the machine
+// which wrote it; names are offsets into the string table at the end
+typedef struct {
+    char magic[4]; // "JVMB"
+    uint32_t version; // VM_BYTECODE_VERSION
+    uint32_t instructions;
+    uint32_t routines;
+    uint32_t labels;
+    uint32_t classes;
+    uint32_t builtins; // the OS subroutines VM_CALL_BUILTIN indexes, by name
+    uint32_t stringBytes;
+} VMBytecodeHeader;
+
+typedef struct {
+    int32_t opcode;
+    int32_t arg;
+    int32_t extra;
+} VMBytecodeInstruction;
+
+typedef struct {
+    uint32_t name;
+    int32_t entry;
+    int32_t firstLabel;
+    int32_t labels;
+    int32_t staticClass;
+} VMBytecodeRoutine;
+
+typedef struct {
+    uint32_t name;
+    int32_t target;
+} VMBytecodeLabel;
+
+typedef struct {
+    uint32_t name;
+    int32_t statics;
+    int32_t base;
+} VMBytecodeClass;
+
+VMInstruction *vmInstructions;
+int vmInstructionCount;
+VMRoutine *vmRoutines;
+int vmRoutineCount;
+VMLabel *vmLabels;
+int vmLabelCount;
+VMClass *vmClasses;
+int vmClassCount;
+
+extern int16_t vmRam[VM_RAM_SIZE]; // from os.c
+extern VMBuiltin vmBuiltins[]; // from os.c
+extern int vmBuiltinCount; // from os.c
+extern int vmHalted; // from os.c
+extern int vmStatus; // from os.c
+
+double vmLoadSeconds; // of the last LoadVMProgram / LoadVMBytecode
+
+// run state
+long vmSteps; // instructions run
+double vmSeconds;
+int vmStepLimitReached;
+
+int readVMCommand(char **cursor, char *line, char *command, char *arg, int *index); // next command of the code, 0 at the end
+int findRoutine(char *name); // index in vmRoutines or -1
+int findBuiltin(char *name); // index in vmBuiltins or -1
+int findClass(char *name); // index in vmClasses, added if new
+int loadError(char *message, char *line); // prints the error, returns 0
+double vmClock();
+
+char *bytecodeStrings; // string table being written
+uint32_t bytecodeStringBytes;
+uint32_t bytecodeStringCapacity;
+int *bytecodeStringHash; // offset + 1 of the string in every used slot, for sharing repeated names
+int bytecodeHashSize;
+
+uint32_t bytecodeString(char *string); // offset of string in the table, added if new
+int bytecodeError(char *message, char *filename); // prints the error, returns 0
+
+/** ----------------- Loading ----------------- **/
+
+int readVMCommand(char **cursor, char *line, char *command, char *arg, int *index) {
+    while (**cursor != '\0') {
+        char *start = *cursor;
+        char *end = strchr(start, '\n');
+        int length = end ? (int)(end - start) : (int)strlen(start);
+        *cursor = end ? end + 1 : start + length;
+        if (length > 255) {
+            length = 255;
+        }
+        memcpy(line, start, length);
+        line[length] = '\0';
+        if (length > 0 && line[length - 1] == '\r') {
+            line[length - 1] = '\0';
+        }
+
+        command[0] = '\0';
+        arg[0] = '\0';
+        *index = 0;
+        if (sscanf(line, "%15s %127s %d", command, arg, index) >= 1 && strncmp(command, "//", 2) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int findRoutine(char *name) {
+    for (int i = 0; i < vmRoutineCount; ++i) {
+        if (strcmp(vmRoutines[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int findBuiltin(char *name) {
+    for (int i = 0; i < vmBuiltinCount; ++i) {
+        if (strcmp(vmBuiltins[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int findClass(char *name) {
+    char className[128];
+    strcpy(className, name);
+    char *dot = strchr(className, '.');
+    if (dot) {
+        *dot = '\0';
+    }
+    for (int i = 0; i < vmClassCount; ++i) {
+        if (strcmp(vmClasses[i].name, className) == 0) {
+            return i;
+        }
+    }
+    strcpy(vmClasses[vmClassCount].name, className);
+    vmClasses[vmClassCount].statics = 0;
+    vmClasses[vmClassCount].base = 0;
+    return vmClassCount++;
+}
+
+int loadError(char *message, char *line) {
+    printf("VM error: %s: %s\n", message, line);
+    StopVM();
+    return 0;
+}
+
+int LoadVMProgram(char *code) {
+    StopVM();
+    double start = vmClock();
+
+    int lines = 1;
+    for (char *c = code; *c != '\0'; ++c) {
+        lines += *c == '\n';
+    }
+    vmInstructions = malloc((lines + 3) * sizeof(VMInstruction));
+    vmRoutines = malloc(VM_MAX_FUNCTIONS * sizeof(VMRoutine));
+    vmLabels = malloc(VM_MAX_LABELS * sizeof(VMLabel));
+    vmClasses = malloc(VM_MAX_FUNCTIONS * sizeof(VMClass));
+
+    char line[256], command[16], arg[128];
+    int index;
+
+    // first pass -- subroutine entries, labels and the size of the static segment of every class
+    // instructions 0 and 1 call Main.main and halt, so the program starts at 2
+    int count = 2;
+    int routine = -1;
+    char *cursor = code;
+    while (readVMCommand(&cursor, line, command, arg, &index)) {
+        if (strcmp(command, "function") == 0) {
+            if (vmRoutineCount == VM_MAX_FUNCTIONS || findRoutine(arg) >= 0) {
+                return loadError(vmRoutineCount == VM_MAX_FUNCTIONS ? "too many subroutines" : "subroutine declared twice", line);
+            }
+            routine = vmRoutineCount++;
+            strcpy(vmRoutines[routine].name, arg);
+            vmRoutines[routine].entry = count;
+            vmRoutines[routine].firstLabel = vmLabelCount;
+            vmRoutines[routine].labels = 0;
+            vmRoutines[routine].staticClass = findClass(arg);
+        }
+        else if (routine < 0) {
+            return loadError("command outside of a subroutine", line);
+        }
+        if (strcmp(command, "label") == 0) {
+            if (vmLabelCount == VM_MAX_LABELS) {
+                return loadError("too many labels", line);
+            }
+            strcpy(vmLabels[vmLabelCount].name, arg);
+            vmLabels[vmLabelCount].target = count;
+            vmLabelCount++;
+            vmRoutines[routine].labels++;
+            continue; // labels take no instruction
+        }
+        if (strcmp(arg, "static") == 0) {
+            VMClass *staticClass = &vmClasses[vmRoutines[routine].staticClass];
+            if (index + 1 > staticClass->statics) {
+                staticClass->statics = index + 1;
+            }
+        }
+        count++;
+    }
+    if (count + 1 > VM_MAX_INSTRUCTIONS) {
+        return loadError("program too large", "");
+    }
+
+    int staticAddress = VM_STATIC_BASE;
+    for (int i = 0; i < vmClassCount; ++i) {
+        vmClasses[i].base = staticAddress;
+        staticAddress += vmClasses[i].statics;
+    }
+    if (staticAddress > VM_STACK_BASE) {
+        return loadError("static segment larger than 240 words", "");
+    }
+
+    int mainRoutine = findRoutine("Main.main");
+    if (mainRoutine < 0) {
+        return loadError("no Main.main to run", "");
+    }
+    vmInstructions[0].opcode = VM_CALL;
+    vmInstructions[0].arg = vmRoutines[mainRoutine].entry;
+    vmInstructions[0].extra = 0;
+    vmInstructions[1] = (VMInstruction){.opcode = VM_HALT};
+
+    // second pass -- decode the commands
+    char *pushSegments[8] = {"constant", "local", "argument", "this", "that", "pointer", "temp", "static"};
+    char *arithmetic[9] = {"add", "sub", "neg", "eq", "gt", "lt", "and", "or", "not"};
+    count = 2;
+    routine = -1;
+    cursor = code;
+    while (readVMCommand(&cursor, line, command, arg, &index)) {
+        VMInstruction *instruction = &vmInstructions[count];
+        instruction->opcode = VM_OPCODES;
+        instruction->arg = index;
+        instruction->extra = 0;
+
+        if (strcmp(command, "label") == 0) {
+            continue;
+        }
+        else if (strcmp(command, "function") == 0) {
+            routine++;
+            instruction->opcode = VM_FUNCTION;
+            instruction->extra = routine; // lets the profiler tell which subroutine a call enters
+        }
+        else if (strcmp(command, "return") == 0) {
+            instruction->opcode = VM_RETURN;
+        }
+        else if (strcmp(command, "push") == 0 || strcmp(command, "pop") == 0) {
+            int isPush = strcmp(command, "push") == 0;
+            for (int i = isPush ? 0 : 1; i < 8; ++i) {
+                if (strcmp(arg, pushSegments[i]) == 0) {
+                    instruction->opcode = isPush ? VM_PUSH_CONSTANT + i : VM_POP_LOCAL + i - 1;
+                }
+            }
+            if (instruction->opcode == VM_OPCODES || index < 0 || (strcmp(arg, "pointer") == 0 && index > 1)
+                || (strcmp(arg, "temp") == 0 && index > 7) || index > 32767) {
+                return loadError("bad segment or index", line);
+            }
+            if (strcmp(arg, "static") == 0) {
+                instruction->arg = vmClasses[vmRoutines[routine].staticClass].base + index;
+            }
+        }
+        else if (strcmp(command, "goto") == 0 || strcmp(command, "if-goto") == 0) {
+            instruction->opcode = strcmp(command, "goto") == 0 ? VM_GOTO : VM_IF_GOTO;
+            VMRoutine *current = &vmRoutines[routine];
+            for (int i = current->firstLabel; i < current->firstLabel + current->labels; ++i) {
+                if (strcmp(vmLabels[i].name, arg) == 0) {
+                    instruction->arg = vmLabels[i].target;
+                    instruction->extra = 1;
+                }
+            }
+            if (!instruction->extra) {
+                return loadError("jump to an undefined label", line);
+            }
+            instruction->extra = 0;
+        }
+        else if (strcmp(command, "call") == 0) {
+            int builtin = findBuiltin(arg);
+            int callee = findRoutine(arg);
+            instruction->extra = index;
+            if (builtin >= 0) {
+                if (vmBuiltins[builtin].args != index) {
+                    return loadError("wrong number of arguments for an OS subroutine", line);
+                }
+                instruction->opcode = VM_CALL_BUILTIN;
+                instruction->arg = builtin;
+            }
+            else if (callee >= 0) {
+                instruction->opcode = VM_CALL;
+                instruction->arg = vmRoutines[callee].entry;
+            }
+            else {
+                return loadError("call to an undefined subroutine", line);
+            }
+        }
+        else {
+            for (int i = 0; i < 9; ++i) {
+                if (strcmp(command, arithmetic[i]) == 0) {
+                    instruction->opcode = VM_ADD + i;
+                }
+            }
+            if (instruction->opcode == VM_OPCODES) {
+                return loadError("unknown command", line);
+            }
+        }
+        count++;
+    }
+    vmInstructions[count++] = (VMInstruction){.opcode = VM_HALT}; // for code running off the end of the last subroutine
+    vmInstructionCount = count;
+    vmLoadSeconds = vmClock() - start;
+    return 1;
+}
+
+/** ----------------- Bytecode ----------------- **/
+
+uint32_t bytecodeString(char *string) {
+    unsigned hash = 5381;
+    for (char *c = string; *c; ++c) {
+        hash = hash * 33 + (unsigned char)*c;
+    }
+    int slot = hash & (bytecodeHashSize - 1);
+    while (bytecodeStringHash[slot] != 0) {
+        if (strcmp(bytecodeStrings + bytecodeStringHash[slot] - 1, string) == 0) {
+            return bytecodeStringHash[slot] - 1;
+        }
+        slot = (slot + 1) & (bytecodeHashSize - 1);
+    }
+    uint32_t length = strlen(string) + 1;
+    if (bytecodeStringBytes + length > bytecodeStringCapacity) {
+        bytecodeStringCapacity = 2 * (bytecodeStringCapacity + length);
+        bytecodeStrings = realloc(bytecodeStrings, bytecodeStringCapacity);
+    }
+    uint32_t offset = bytecodeStringBytes;
+    memcpy(bytecodeStrings + offset, string, length);
+    bytecodeStringBytes += length;
+    bytecodeStringHash[slot] = offset + 1;
+    return offset;
+}
+
+int bytecodeError(char *message, char *filename) {
+    printf("VM error: %s: %s\n", message, filename);
+    return 0;
+}
+
+int SaveVMBytecode(char *filename) {
+    if (vmInstructions == NULL) {
+        return 0;
+    }
+    // the table has room for every name, so it is at most half full
+    int names = vmRoutineCount + vmLabelCount + vmClassCount + vmBuiltinCount;
+    for (bytecodeHashSize = 16; bytecodeHashSize < 2 * names; bytecodeHashSize *= 2);
+    bytecodeStringHash = calloc(bytecodeHashSize, sizeof(int));
+    bytecodeStrings = NULL;
+    bytecodeStringBytes = 0;
+    bytecodeStringCapacity = 0;
+
+    VMBytecodeHeader header = {{'J', 'V', 'M', 'B'}, VM_BYTECODE_VERSION, vmInstructionCount, vmRoutineCount,
+        vmLabelCount, vmClassCount, vmBuiltinCount, 0};
+    VMBytecodeInstruction *instructions = malloc(vmInstructionCount * sizeof(VMBytecodeInstruction));
+    VMBytecodeRoutine *routines = malloc((vmRoutineCount + 1) * sizeof(VMBytecodeRoutine));
+    VMBytecodeLabel *labels = malloc((vmLabelCount + 1) * sizeof(VMBytecodeLabel));
+    VMBytecodeClass *classes = malloc((vmClassCount + 1) * sizeof(VMBytecodeClass));
+    uint32_t *builtins = malloc(vmBuiltinCount * sizeof(uint32_t));
+    for (int i = 0; i < vmInstructionCount; ++i) {
+        instructions[i] = (VMBytecodeInstruction){vmInstructions[i].opcode, vmInstructions[i].arg, vmInstructions[i].extra};
+    }
+    for (int i = 0; i < vmRoutineCount; ++i) {
+        VMRoutine *routine = &vmRoutines[i];
+        routines[i] = (VMBytecodeRoutine){bytecodeString(routine->name), routine->entry, routine->firstLabel,
+            routine->labels, routine->staticClass};
+    }
+    for (int i = 0; i < vmLabelCount; ++i) {
+        labels[i] = (VMBytecodeLabel){bytecodeString(vmLabels[i].name), vmLabels[i].target};
+    }
+    for (int i = 0; i < vmClassCount; ++i) {
+        classes[i] = (VMBytecodeClass){bytecodeString(vmClasses[i].name), vmClasses[i].statics, vmClasses[i].base};
+    }
+    for (int i = 0; i < vmBuiltinCount; ++i) {
+        builtins[i] = bytecodeString(vmBuiltins[i].name);
+    }
+    header.stringBytes = bytecodeStringBytes;
+
+    int status = 0;
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        bytecodeError("could not open the bytecode file", filename);
+    }
+    else {
+        fwrite(&header, sizeof header, 1, fp);
+        fwrite(instructions, sizeof(VMBytecodeInstruction), vmInstructionCount, fp);
+        fwrite(routines, sizeof(VMBytecodeRoutine), vmRoutineCount, fp);
+        fwrite(labels, sizeof(VMBytecodeLabel), vmLabelCount, fp);
+        fwrite(classes, sizeof(VMBytecodeClass), vmClassCount, fp);
+        fwrite(builtins, sizeof(uint32_t), vmBuiltinCount, fp);
+        fwrite(bytecodeStrings, 1, bytecodeStringBytes, fp);
+        status = !ferror(fp);
+        status &= fclose(fp) == 0;
+        if (!status) {
+            bytecodeError("could not write the bytecode file", filename);
+        }
+    }
+    free(instructions);
+    free(routines);
+    free(labels);
+    free(classes);
+    free(builtins);
+    free(bytecodeStrings);
+    free(bytecodeStringHash);
+    bytecodeStrings = NULL;
+    bytecodeStringHash = NULL;
+    return status;
+}
+
+// the sections are read from the mapping without parsing, checked and copied into the in-memory structs (which
+// carry the dispatch handlers the file does not), then the file is unmapped
+int LoadVMBytecode(char *filename) {
+    StopVM();
+    double start = vmClock();
+    int fd = open(filename, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return bytecodeError("could not open the bytecode file", filename);
+    }
+    size_t size = info.st_size;
+    char *file = size >= sizeof(VMBytecodeHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (file == MAP_FAILED) {
+        return bytecodeError("not a bytecode file", filename);
+    }
+
+    VMBytecodeHeader *header = (VMBytecodeHeader *)file;
+    VMBytecodeInstruction *instructions = (VMBytecodeInstruction *)(header + 1);
+    VMBytecodeRoutine *routines = (VMBytecodeRoutine *)(instructions + header->instructions);
+    VMBytecodeLabel *labels = (VMBytecodeLabel *)(routines + header->routines);
+    VMBytecodeClass *classes = (VMBytecodeClass *)(labels + header->labels);
+    uint32_t *builtins = (uint32_t *)(classes + header->classes);
+    char *strings = (char *)(builtins + header->builtins);
+    char *error = NULL;
+    if (memcmp(header->magic, "JVMB", 4) != 0) {
+        error = "not a bytecode file";
+    }
+    else if (header->version != VM_BYTECODE_VERSION) {
+        error = "bytecode of another version of the vm";
+    }
+    else if (header->instructions < 2 || header->instructions > VM_MAX_INSTRUCTIONS || header->routines > VM_MAX_FUNCTIONS
+             || header->labels > VM_MAX_LABELS || header->classes > VM_MAX_FUNCTIONS
+             || sizeof *header + (size_t)header->instructions * sizeof *instructions + (size_t)header->routines * sizeof *routines
+                + (size_t)header->labels * sizeof *labels + (size_t)header->classes * sizeof *classes
+                + (size_t)header->builtins * sizeof *builtins + header->stringBytes != size
+             || header->stringBytes == 0 || strings[header->stringBytes - 1] != '\0') {
+        error = "damaged bytecode file";
+    }
+    else if (header->builtins != (uint32_t)vmBuiltinCount) {
+        error = "bytecode linked against another OS";
+    }
+    for (int i = 0; error == NULL && i < vmBuiltinCount; ++i) {
+        if (builtins[i] >= header->stringBytes || strcmp(strings + builtins[i], vmBuiltins[i].name) != 0) {
+            error = "bytecode linked against another OS";
+        }
+    }
+    if (error != NULL) {
+        munmap(file, size);
+        return bytecodeError(error, filename);
+    }
+
+    int count = header->instructions;
+    vmInstructions = malloc(count * sizeof(VMInstruction));
+    vmRoutines = malloc((header->routines + 1) * sizeof(VMRoutine));
+    vmLabels = malloc((header->labels + 1) * sizeof(VMLabel));
+    vmClasses = malloc((header->classes + 1) * sizeof(VMClass));
+    vmInstructionCount = count;
+    vmRoutineCount = header->routines;
+    vmLabelCount = header->labels;
+    vmClassCount = header->classes;
+
+    // every index the interpreter follows without checking has to be in range
+    for (int i = 0; i < count && error == NULL; ++i) {
+        VMBytecodeInstruction *instruction = &instructions[i];
+        int opcode = instruction->opcode, arg = instruction->arg;
+        if (opcode < 0 || opcode >= VM_OPCODES
+            || ((opcode == VM_GOTO || opcode == VM_IF_GOTO || opcode == VM_CALL) && (arg < 0 || arg >= count))
+            || (opcode == VM_CALL_BUILTIN && (arg < 0 || arg >= vmBuiltinCount || instruction->extra != vmBuiltins[arg].args))
+            || (opcode == VM_FUNCTION && (instruction->extra < 0 || instruction->extra >= vmRoutineCount))
+            || (opcode >= VM_PUSH_LOCAL && opcode <= VM_POP_STATIC && arg < 0)
+            || (((opcode >= VM_PUSH_LOCAL && opcode <= VM_PUSH_THAT) || (opcode >= VM_POP_LOCAL && opcode <= VM_POP_THAT)) && arg > 32767)
+            || ((opcode == VM_PUSH_POINTER || opcode == VM_POP_POINTER) && arg > 1)
+            || ((opcode == VM_PUSH_TEMP || opcode == VM_POP_TEMP) && arg > 7)
+            || ((opcode == VM_PUSH_STATIC || opcode == VM_POP_STATIC) && arg >= VM_STACK_BASE)) {
+            error = "bad instruction in the bytecode file";
+            break;
+        }
+        vmInstructions[i].handler = NULL;
+        vmInstructions[i].opcode = opcode;
+        vmInstructions[i].arg = arg;
+        vmInstructions[i].extra = instruction->extra;
+    }
+    if (error == NULL && (vmInstructions[count - 1].opcode != VM_HALT || vmInstructions[1].opcode != VM_HALT
+                          || vmInstructions[0].opcode != VM_CALL)) {
+        error = "bad instruction in the bytecode file";
+    }
+    for (int i = 0; i < vmRoutineCount && error == NULL; ++i) {
+        VMBytecodeRoutine *routine = &routines[i];
+        if (routine->name >= header->stringBytes || routine->entry < 0 || routine->entry >= count
+            || routine->firstLabel < 0 || routine->labels < 0 || routine->firstLabel + routine->labels > vmLabelCount
+            || routine->staticClass < 0 || routine->staticClass >= vmClassCount) {
+            error = "damaged bytecode file";
+            break;
+        }
+        snprintf(vmRoutines[i].name, sizeof vmRoutines[i].name, "%s", strings + routine->name);
+        vmRoutines[i].entry = routine->entry;
+        vmRoutines[i].firstLabel = routine->firstLabel;
+        vmRoutines[i].labels = routine->labels;
+        vmRoutines[i].staticClass = routine->staticClass;
+    }
+    for (int i = 0; i < vmLabelCount && error == NULL; ++i) {
+        if (labels[i].name >= header->stringBytes || labels[i].target < 0 || labels[i].target >= count) {
+            error = "damaged bytecode file";
+            break;
+        }
+        snprintf(vmLabels[i].name, sizeof vmLabels[i].name, "%s", strings + labels[i].name);
+        vmLabels[i].target = labels[i].target;
+    }
+    for (int i = 0; i < vmClassCount && error == NULL; ++i) {
+        if (classes[i].name >= header->stringBytes) {
+            error = "damaged bytecode file";
+            break;
+        }
+        snprintf(vmClasses[i].name, sizeof vmClasses[i].name, "%s", strings + classes[i].name);
+        vmClasses[i].statics = classes[i].statics;
+        vmClasses[i].base = classes[i].base;
+    }
+    munmap(file, size);
+    if (error != NULL) {
+        StopVM();
+        return bytecodeError(error, filename);
+    }
+    vmLoadSeconds = vmClock() - start;
+    return 1;
+}
+
+/** ----------------- Profiling ----------------- **/
+
+// a node of the calling context tree -- one for every distinct call stack seen while profiling
+typedef struct {
+    int function; // index in vmRoutines, vmRoutineCount + index in vmBuiltins for the OS, -1 for the root
+    int parent;
+    int firstChild;
+    int nextSibling;
+    long self; // instructions run with exactly this call stack
+} VMProfileNode;
+
+// an active call while profiling
+typedef struct {
+    int function;
+    long entryStep;
+} VMProfileFrame;
+
+// a loop found from a jump back to a label
+typedef struct {
+    int label; // index in vmLabels
+    int function;
+    long headerRuns; // times the first instruction of the loop ran
+    long instructions; // instructions run inside the loop
+} VMProfileLoop;
+
+int profiling; // 1 while RunVMProgram profiles
+long *instructionCounts; // times every instruction ran
+long *functionCalls; // indexed like VMProfileNode.function
+long *functionExclusive;
+long *functionInclusive;
+int *functionDepth; // activations of the function currently on the call stack
+VMProfileNode *profileNodes;
+int profileNodeCount;
+int profileNodeCapacity;
+VMProfileFrame *profileFrames;
+int profileDepth;
+int profileLostFrames; // calls deeper than VM_MAX_CALL_DEPTH, not tracked
+int profileNode; // node of the current call stack
+
+void startProfile();
+int profileChild(int node, int function); // child node of node for a call to function, added if new
+void enterProfile(int function, long step);
+void leaveProfile(long step);
+void profileInstruction(int index, long step); // counts the instruction about to run at step
+void finishProfile(long step); // closes the calls still active when the run ended
+char *functionName(int function);
+int compareFunctions(const void *a, const void *b); // by exclusive instructions, descending
+int compareLoops(const void *a, const void *b); // by instructions, descending
+
+void startProfile() {
+    int functions = vmRoutineCount + vmBuiltinCount;
+    instructionCounts = calloc(vmInstructionCount, sizeof(long));
+    functionCalls = calloc(functions, sizeof(long));
+    functionExclusive = calloc(functions, sizeof(long));
+    functionInclusive = calloc(functions, sizeof(long));
+    functionDepth = calloc(functions, sizeof(int));
+    profileNodeCapacity = 1024;
+    profileNodes = malloc(profileNodeCapacity * sizeof(VMProfileNode));
+    profileFrames = malloc(VM_MAX_CALL_DEPTH * sizeof(VMProfileFrame));
+    profileNodes[0] = (VMProfileNode){-1, -1, -1, -1, 0};
+    profileNodeCount = 1;
+    profileDepth = 0;
+    profileLostFrames = 0;
+    profileNode = 0;
+}
+
+int profileChild(int node, int function) {
+    int child = profileNodes[node].firstChild;
+    while (child >= 0 && profileNodes[child].function != function) {
+        child = profileNodes[child].nextSibling;
+    }
+    if (child >= 0) {
+        return child;
+    }
+    if (profileNodeCount == profileNodeCapacity) {
+        profileNodeCapacity *= 2;
+        profileNodes = realloc(profileNodes, profileNodeCapacity * sizeof(VMProfileNode));
+    }
+    child = profileNodeCount++;
+    profileNodes[child] = (VMProfileNode){function, node, -1, profileNodes[node].firstChild, 0};
+    profileNodes[node].firstChild = child;
+    return child;
+}
+
+void enterProfile(int function, long step) {
+    functionCalls[function]++;
+    if (profileDepth == VM_MAX_CALL_DEPTH) {
+        profileLostFrames++;
+        return;
+    }
+    profileFrames[profileDepth++] = (VMProfileFrame){function, step};
+    functionDepth[function]++;
+    profileNode = profileChild(profileNode, function);
+}
+
+void leaveProfile(long step) {
+    if (profileLostFrames > 0) {
+        profileLostFrames--;
+        return;
+    }
+    if (profileDepth == 0) {
+        return;
+    }
+    VMProfileFrame frame = profileFrames[--profileDepth];
+    if (--functionDepth[frame.function] == 0) { // outermost activation -- recursive calls are already inside it
+        functionInclusive[frame.function] += step - frame.entryStep;
+    }
+    profileNode = profileNodes[profileNode].parent;
+}
+
+void profileInstruction(int index, long step) {
+    VMInstruction *instruction = &vmInstructions[index];
+    instructionCounts[index]++;
+    if (instruction->opcode == VM_CALL_BUILTIN) { // the call is all an OS subroutine runs
+        int builtin = vmRoutineCount + instruction->arg;
+        functionCalls[builtin]++;
+        functionInclusive[builtin]++;
+        profileNodes[profileChild(profileNode, builtin)].self++;
+        return;
+    }
+    profileNodes[profileNode].self++;
+    if (instruction->opcode == VM_CALL) {
+        enterProfile(vmInstructions[instruction->arg].extra, step);
+    }
+    else if (instruction->opcode == VM_RETURN) {
+        leaveProfile(step);
+    }
+}
+
+void finishProfile(long step) {
+    while (profileDepth > 0) {
+        leaveProfile(step);
+    }
+    for (int i = 1; i < profileNodeCount; ++i) {
+        functionExclusive[profileNodes[i].function] += profileNodes[i].self;
+    }
+}
+
+char *functionName(int function) {
+    if (function < 0) {
+        return "(vm)";
+    }
+    return function < vmRoutineCount ? vmRoutines[function].name : vmBuiltins[function - vmRoutineCount].name;
+}
+
+int compareFunctions(const void *a, const void *b) {
+    long difference = functionExclusive[*(int *)b] - functionExclusive[*(int *)a];
+    return difference > 0 ? 1 : difference < 0 ? -1 : *(int *)a - *(int *)b;
+}
+
+int compareLoops(const void *a, const void *b) {
+    long difference = ((VMProfileLoop *)b)->instructions - ((VMProfileLoop *)a)->instructions;
+    return difference > 0 ? 1 : difference < 0 ? -1 : 0;
+}
+
+void PrintVMProfile() {
+    if (instructionCounts == NULL) {
+        return;
+    }
+    int functions = vmRoutineCount + vmBuiltinCount;
+    int *order = malloc(functions * sizeof(int));
+    int called = 0;
+    for (int i = 0; i < functions; ++i) {
+        if (functionCalls[i] > 0) {
+            order[called++] = i;
+        }
+    }
+    qsort(order, called, sizeof(int), compareFunctions);
+    printf("\n%-32s %10s %12s %12s\n", "function", "calls", "exclusive", "inclusive");
+    for (int i = 0; i < called; ++i) {
+        int function = order[i];
+        printf("%-32s %10ld %12ld %12ld\n", functionName(function), functionCalls[function],
+            functionExclusive[function], functionInclusive[function]);
+    }
+    free(order);
+
+    // a label is a loop header if a jump later in its subroutine goes back to it
+    VMProfileLoop *loops = malloc((vmLabelCount + 1) * sizeof(VMProfileLoop));
+    int loopCount = 0;
+    for (int r = 0; r < vmRoutineCount; ++r) {
+        int end = r + 1 < vmRoutineCount ? vmRoutines[r + 1].entry : vmInstructionCount;
+        for (int l = vmRoutines[r].firstLabel; l < vmRoutines[r].firstLabel + vmRoutines[r].labels; ++l) {
+            int target = vmLabels[l].target;
+            int backEdge = -1;
+            for (int i = target; i < end; ++i) {
+                if ((vmInstructions[i].opcode == VM_GOTO || vmInstructions[i].opcode == VM_IF_GOTO) && vmInstructions[i].arg == target) {
+                    backEdge = i;
+                }
+            }
+            if (backEdge < 0 || instructionCounts[target] == 0) {
+                continue;
+            }
+            VMProfileLoop *loop = &loops[loopCount++];
+            loop->label = l;
+            loop->function = r;
+            loop->headerRuns = instructionCounts[target];
+            loop->instructions = 0;
+            for (int i = target; i <= backEdge; ++i) {
+                loop->instructions += instructionCounts[i];
+            }
+        }
+    }
+    qsort(loops, loopCount, sizeof(VMProfileLoop), compareLoops);
+    printf("\n%-12s %-32s %12s %12s\n", "hot loop", "function", "header runs", "instructions");
+    for (int i = 0; i < loopCount && i < VM_PROFILE_LOOPS; ++i) {
+        printf("%-12s %-32s %12ld %12ld\n", vmLabels[loops[i].label].name, vmRoutines[loops[i].function].name,
+            loops[i].headerRuns, loops[i].instructions);
+    }
+    free(loops);
+}
+
+int SaveVMFoldedStacks(char *filename) {
+    if (profileNodes == NULL) {
+        return 0;
+    }
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("Could not open folded stacks output file %s.\n", filename);
+        return 0;
+    }
+    int *path = malloc((VM_MAX_CALL_DEPTH + 1) * sizeof(int));
+    for (int i = 1; i < profileNodeCount; ++i) {
+        if (profileNodes[i].self == 0) {
+            continue;
+        }
+        int depth = 0;
+        for (int node = i; node > 0; node = profileNodes[node].parent) {
+            path[depth++] = node;
+        }
+        for (int j = depth - 1; j >= 0; --j) {
+            fprintf(fp, "%s%c", functionName(profileNodes[path[j]].function), j > 0 ? ';' : ' ');
+        }
+        fprintf(fp, "%ld\n", profileNodes[i].self);
+    }
+    free(path);
+    fclose(fp);
+    return 1;
+}
+
+/** ----------------- Running ----------------- **/
+
+double vmClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int RunVMProgram(long maxSteps, int profile) {
+    // handler of every opcode, in VMOpcode order
+    static void *handlers[VM_OPCODES] = {
+        &&pushConstant, &&pushLocal, &&pushArgument, &&pushThis, &&pushThat, &&pushPointer, &&pushTemp, &&pushStatic,
+        &&popLocal, &&popArgument, &&popThis, &&popThat, &&popPointer, &&popTemp, &&popStatic,
+        &&add, &&sub, &&neg, &&eq, &&gt, &&lt, &&and, &&or, &&not,
+        &&jump, &&ifJump, &&call, &&callBuiltin, &&function, &&ret, &&halt
+    };
+    if (vmInstructions == NULL) {
+        return 0;
+    }
+    // profiling sends every instruction through the counting handler first
+    profiling = profile;
+    if (profiling) {
+        startProfile();
+    }
+    for (int i = 0; i < vmInstructionCount; ++i) {
+        vmInstructions[i].handler = profiling ? &&count : handlers[vmInstructions[i].opcode];
+    }
+
+    BootOS();
+    vmStepLimitReached = 0;
+
+    // sp, lcl and arg live in locals while running, and are written to ram[0..2] only for the OS
+    int16_t *ram = vmRam;
+    VMInstruction *code = vmInstructions;
+    VMInstruction *ip = code;
+    uint16_t sp = VM_STACK_BASE, lcl = VM_STACK_BASE, arg = VM_STACK_BASE;
+    long steps = 1;
+    double start = vmClock();
+
+    #define NEXT() do { ++ip; ++steps; goto *ip->handler; } while (0)
+    #define JUMP(target) do { ip = code + (target); ++steps; goto *ip->handler; } while (0)
+    #define CHECK_STEPS() if (maxSteps > 0 && steps >= maxSteps) { vmStepLimitReached = 1; goto halt; }
+    #define TOP ram[(uint16_t)(sp - 1)]
+
+    goto *ip->handler;
+
+count:
+    profileInstruction(ip - code, steps);
+    goto *handlers[ip->opcode];
+
+pushConstant: ram[sp++] = ip->arg; NEXT();
+pushLocal: ram[sp++] = ram[(uint16_t)(lcl + ip->arg)]; NEXT();
+pushArgument: ram[sp++] = ram[(uint16_t)(arg + ip->arg)]; NEXT();
+pushThis: ram[sp++] = ram[(uint16_t)(ram[3] + ip->arg)]; NEXT();
+pushThat: ram[sp++] = ram[(uint16_t)(ram[4] + ip->arg)]; NEXT();
+pushPointer: ram[sp++] = ram[3 + ip->arg]; NEXT();
+pushTemp: ram[sp++] = ram[5 + ip->arg]; NEXT();
+pushStatic: ram[sp++] = ram[ip->arg]; NEXT();
+
+popLocal: --sp; ram[(uint16_t)(lcl + ip->arg)] = ram[sp]; NEXT();
+popArgument: --sp; ram[(uint16_t)(arg + ip->arg)] = ram[sp]; NEXT();
+popThis: --sp; ram[(uint16_t)(ram[3] + ip->arg)] = ram[sp]; NEXT();
+popThat: --sp; ram[(uint16_t)(ram[4] + ip->arg)] = ram[sp]; NEXT();
+popPointer: --sp; ram[3 + ip->arg] = ram[sp]; NEXT();
+popTemp: --sp; ram[5 + ip->arg] = ram[sp]; NEXT();
+popStatic: --sp; ram[ip->arg] = ram[sp]; NEXT();
+
+add: --sp; TOP = (int16_t)(TOP + ram[sp]); NEXT();
+sub: --sp; TOP = (int16_t)(TOP - ram[sp]); NEXT();
+neg: TOP = (int16_t)-TOP; NEXT();
+eq: --sp; TOP = -(TOP == ram[sp]); NEXT();
+gt: --sp; TOP = -(TOP > ram[sp]); NEXT();
+lt: --sp; TOP = -(TOP < ram[sp]); NEXT();
+and: --sp; TOP = TOP & ram[sp]; NEXT();
+or: --sp; TOP = TOP | ram[sp]; NEXT();
+not: TOP = ~TOP; NEXT();
+
+jump:
+    CHECK_STEPS();
+    JUMP(ip->arg);
+ifJump:
+    if (ram[--sp] != 0) {
+        CHECK_STEPS();
+        JUMP(ip->arg);
+    }
+    NEXT();
+
+call: {
+    CHECK_STEPS();
+    int args = ip->extra;
+    ram[sp++] = (int16_t)(ip - code + 1); // return address
+    ram[sp++] = lcl;
+    ram[sp++] = arg;
+    ram[sp++] = ram[3];
+    ram[sp++] = ram[4];
+    arg = sp - 5 - args;
+    lcl = sp;
+    JUMP(ip->arg);
+}
+callBuiltin: {
+    VMBuiltin *builtin = &vmBuiltins[ip->arg];
+    ram[0] = sp;
+    ram[1] = lcl;
+    ram[2] = arg;
+    sp -= builtin->args;
+    int16_t result = builtin->run(ram + sp);
+    ram[sp++] = result;
+    if (vmHalted) {
+        goto halt;
+    }
+    NEXT();
+}
+function:
+    for (int i = ip->arg; i > 0; --i) {
+        ram[sp++] = 0;
+    }
+    NEXT();
+ret: {
+    uint16_t frame = lcl;
+    int returnAddress = (uint16_t)ram[(uint16_t)(frame - 5)];
+    ram[arg] = TOP;
+    sp = arg + 1;
+    ram[4] = ram[(uint16_t)(frame - 1)];
+    ram[3] = ram[(uint16_t)(frame - 2)];
+    arg = ram[(uint16_t)(frame - 3)];
+    lcl = ram[(uint16_t)(frame - 4)];
+    if (returnAddress >= vmInstructionCount) {
+        printf("VM error: return to a corrupted address\n");
+        vmStatus = 0;
+        goto halt;
+    }
+    JUMP(returnAddress);
+}
+halt:
+    #undef NEXT
+    #undef JUMP
+    #undef CHECK_STEPS
+    #undef TOP
+    ram[0] = sp;
+    ram[1] = lcl;
+    ram[2] = arg;
+    vmSteps = steps;
+    vmSeconds = vmClock() - start;
+    if (profiling) {
+        finishProfile(steps);
+    }
+    fflush(stdout);
+    return vmStatus && !vmStepLimitReached;
+}
+
+void PrintVMReport() {
+    printf("\nvm: %d instructions loaded in %.3f ms\n", vmInstructionCount, vmLoadSeconds * 1000);
+    printf("vm: %ld instructions in %.3f s (%.1f million per second)%s\n", vmSteps, vmSeconds,
+        vmSeconds > 0 ? vmSteps / vmSeconds / 1e6 : 0.0, vmStepLimitReached ? ", stopped at the step limit" : "");
+}
+
+void StopVM() {
+    free(instructionCounts);
+    free(functionCalls);
+    free(functionExclusive);
+    free(functionInclusive);
+    free(functionDepth);
+    free(profileNodes);
+    free(profileFrames);
+    instructionCounts = NULL;
+    functionCalls = NULL;
+    functionExclusive = NULL;
+    functionInclusive = NULL;
+    functionDepth = NULL;
+    profileNodes = NULL;
+    profileFrames = NULL;
+    profileNodeCount = 0;
+    free(vmInstructions);
+    free(vmRoutines);
+    free(vmLabels);
+    free(vmClasses);
+    vmInstructions = NULL;
+    vmRoutines = NULL;
+    vmLabels = NULL;
+    vmClasses = NULL;
+    vmInstructionCount = 0;
+    vmRoutineCount = 0;
+    vmLabelCount = 0;
+    vmClassCount = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef VM_H
+#define VM_H
+
+#include "os.h"
+
+#define VM_MAX_INSTRUCTIONS 65536 // return addresses are kept in a stack word
+#define VM_MAX_FUNCTIONS 4096 // max number of subroutines in a program
+#define VM_MAX_LABELS 65536 // max number of labels in a program
+#define VM_MAX_CALL_DEPTH 16384 // calls tracked by the profiler, a frame takes at least 5 stack words
+#define VM_PROFILE_LOOPS 10 // hot loops listed by PrintVMProfile
+#define VM_BYTECODE_VERSION 1 // of the bytecode file layout, and of VMOpcode -- bump when either changes
+
+// vm commands with the segment folded into the opcode, so no instruction has to look at its segment at run time
+typedef enum {
+    VM_PUSH_CONSTANT, VM_PUSH_LOCAL, VM_PUSH_ARGUMENT, VM_PUSH_THIS, VM_PUSH_THAT, VM_PUSH_POINTER, VM_PUSH_TEMP, VM_PUSH_STATIC,
+    VM_POP_LOCAL, VM_POP_ARGUMENT, VM_POP_THIS, VM_POP_THAT, VM_POP_POINTER, VM_POP_TEMP, VM_POP_STATIC,
+    VM_ADD, VM_SUB, VM_NEG, VM_EQ, VM_GT, VM_LT, VM_AND, VM_OR, VM_NOT,
+    VM_GOTO, VM_IF_GOTO, VM_CALL, VM_CALL_BUILTIN, VM_FUNCTION, VM_RETURN, VM_HALT,
+    VM_OPCODES
+} VMOpcode;
+
+// a loaded vm command
+typedef struct {
+    void *handler; // address of the code running the instruction (threaded dispatch), set by RunVMProgram
+    VMOpcode opcode;
+    int arg; // constant, segment index (absolute address for statics), jump target, callee or built-in index
+    int extra; // number of arguments of a call, subroutine index of a function
+} VMInstruction;
+
+int LoadVMProgram(char *code); // loads the vm code of a whole program, returns 0 (after printing why) if it cannot run
+int SaveVMBytecode(char *filename); // writes the loaded program as a bytecode file (header, fixed-width instructions, tables, strings)
+int LoadVMBytecode(char *filename); // maps a file written by SaveVMBytecode and loads it without parsing, returns 0 (after printing why) if it cannot
+int RunVMProgram(long maxSteps, int profile); // runs Main.main on the built-in OS, stops after maxSteps instructions if > 0 -- 1 if the program ended normally
+void PrintVMReport(); // number of instructions run and speed
+void PrintVMProfile(); // calls and instructions of every subroutine and the hottest loops of a profiled run
+int SaveVMFoldedStacks(char *filename); // instructions per call stack of a profiled run, in flamegraph.pl's folded format
+void StopVM();
+
+#endif
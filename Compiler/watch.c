@@ -0,0 +1,110 @@
+/************************************************************************
+University of Leeds
+School of Computing
+COMP2932- Compiler Design and Construction
+The Watch Module
+
+Keeps the compiler resident on a project and builds it again whenever one
+of its .jack files is written, moved or removed (inotify on the directory):
+    compiler -watch -O2 -o out Pong
+Saves come in bursts (an editor writing a file in steps, a checkout
+writing many), so a build starts once the directory has been quiet for
+WATCH_DEBOUNCE_MS. The standard libraries are parsed once, and the builds
+are incremental (-incremental), so only the files which changed and the
+files depending on them are compiled again. As with the daemon, every
+build runs in a forked process, so one exiting on an error leaves the
+watcher as it was.
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+
+#include "compiler.h"
+#include "watch.h"
+
+extern char *projectDirectory; // from compiler.c
+extern int incrementalBuild; // from compiler.c
+double vmClock(); // from vm.c
+
+// reads the pending events, returns how many are about .jack files (not hidden ones, as editors' swap files are)
+// or -1 if the directory is gone
+int readWatchEvents(int fd) {
+	char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t length = read(fd, buffer, sizeof buffer);
+	if (length <= 0) {
+		return length < 0 ? 0 : -1; // interrupted
+	}
+	int changes = 0;
+	struct inotify_event *event;
+	for (char *next = buffer; next < buffer + length; next += sizeof(struct inotify_event) + event->len) {
+		event = (struct inotify_event *)next;
+		if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+			return -1;
+		}
+		int nameLength = event->len ? strlen(event->name) : 0;
+		if (nameLength > 5 && event->name[0] != '.' && strcmp(event->name + nameLength - 5, ".jack") == 0) {
+			changes++;
+		}
+	}
+	return changes;
+}
+
+// builds the project in a process of its own
+void buildProject() {
+	double start = vmClock();
+	fflush(stdout); // or the forked process would print it again
+	pid_t builder = fork();
+	if (builder == 0) {
+		exit(BuildProgram() ? 0 : 1);
+	}
+	int status;
+	if (builder < 0 || waitpid(builder, &status, 0) != builder) {
+		printf("Could not start a build of %s.\n", projectDirectory);
+		return;
+	}
+	printf("watch: %s %s in %.1f ms\n", projectDirectory, WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "built" : "has errors",
+		(vmClock() - start) * 1000);
+	fflush(stdout);
+}
+
+int RunWatch(int argc, char **argv) {
+	if (!ParseCompilerOptions(argc, argv)) {
+		return 1;
+	}
+	incrementalBuild = 1;
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, projectDirectory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+		printf("Could not watch the directory %s.\n", projectDirectory);
+		return 1;
+	}
+	InitCompiler();
+	if (LoadStandardLibs().er != none) {
+		printf("Could not compile the standard libraries.\n"); // the error is printed by the parser
+		return 1;
+	}
+
+	buildProject();
+	for (;;) {
+		int changes = readWatchEvents(fd);
+		while (changes >= 0) { // until the directory is quiet
+			struct pollfd watched = {fd, POLLIN, 0};
+			if (poll(&watched, 1, WATCH_DEBOUNCE_MS) <= 0) {
+				break;
+			}
+			int more = readWatchEvents(fd);
+			changes = more < 0 ? -1 : changes + more;
+		}
+		if (changes < 0) {
+			printf("watch: %s is gone.\n", projectDirectory);
+			return 1;
+		}
+		if (changes > 0) {
+			buildProject();
+		}
+	}
+}
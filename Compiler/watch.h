@@ -0,0 +1,8 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#define WATCH_DEBOUNCE_MS 25 // a build starts once no file of the directory changed for this long
+
+int RunWatch(int argc, char **argv); // compiles the directory of the command line (argv[0] is not read) on every change of its .jack files, returns if it cannot watch it
+
+#endif